@@ -0,0 +1,234 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Quick estimate of the area ratios of the feature classes from a stratified spatial sample.
+The sample units are those the full run measures the areas by: the cells of the occupancy raster covered by the cloud
+(a cell belongs to every class with a point in it), or the representatives of the homogeneous simplification when
+areas are measured by points. Only the classification of most of the points (color conversion, plane fitting error)
+is skipped.
+Strata are squares of the xy extent, the sample grows in rounds until the 95% confidence interval of every ratio
+is as narrow as requested.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AreaRaster.h"
+#include "Classification.h"
+#include "ThreadPool.h"
+
+// Area ratios in percent with the half widths of their 95% confidence intervals, in percentage points
+struct AreaRatioEstimate
+{
+	double percentage[FEATURE_CLASS_COUNT];
+	double half_width[FEATURE_CLASS_COUNT];
+	std::size_t sampled;		// units (points or cells) classified so far
+	std::size_t strata;			// occupied strata
+	bool complete;				// every point was classified, the ratios are exact
+};
+
+// Points grouped by the xy square (stratum) they lie in, every stratum in a random but reproducible order,
+// so the first n points of a stratum are a simple random sample of it
+class StratifiedSample
+{
+public:
+	// Squares of the xy extent: 'strata_per_axis' along its longer side
+	template <typename Points>
+	void Build(const Points& points, std::size_t count, std::size_t strata_per_axis, std::uint64_t seed)
+	{
+		m_order.clear();
+		m_stratum_start.clear();
+		if (count == 0) return;
+		float min_x = float(points[0][0]), max_x = min_x, min_y = float(points[0][1]), max_y = min_y;
+		for (std::size_t i = 1; i < count; i++)
+		{
+			min_x = std::min(min_x, float(points[i][0]));
+			max_x = std::max(max_x, float(points[i][0]));
+			min_y = std::min(min_y, float(points[i][1]));
+			max_y = std::max(max_y, float(points[i][1]));
+		}
+		double side = std::max(double(max_x) - min_x, double(max_y) - min_y) / double(strata_per_axis);
+		if (side <= 0) side = 1;
+		const std::size_t columns = std::size_t((double(max_x) - min_x) / side) + 1;
+		const std::size_t rows = std::size_t((double(max_y) - min_y) / side) + 1;
+
+		// counting sort of the points by their square, empty squares are dropped
+		std::vector<std::uint32_t> square(count);
+		std::vector<std::size_t> start(columns * rows + 1, 0);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			std::size_t column = std::min(columns - 1, std::size_t((double(points[i][0]) - min_x) / side));
+			std::size_t row = std::min(rows - 1, std::size_t((double(points[i][1]) - min_y) / side));
+			square[i] = std::uint32_t(row * columns + column);
+			start[square[i] + 1]++;
+		}
+		for (std::size_t s = 0; s < columns * rows; s++) start[s + 1] += start[s];
+		m_order.resize(count);
+		std::vector<std::size_t> cursor(start.begin(), start.end() - 1);
+		for (std::size_t i = 0; i < count; i++) m_order[cursor[square[i]]++] = std::uint32_t(i);
+		for (std::size_t s = 0; s < columns * rows; s++)
+		{
+			if (start[s + 1] > start[s]) m_stratum_start.push_back(start[s]);
+		}
+		m_stratum_start.push_back(count);
+
+		// Fisher-Yates shuffle of every stratum, seeded by the stratum number only
+		ParallelFor(StrataCount(), 64, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t h = begin; h < end; h++)
+			{
+				std::uint64_t state = seed + 0x9e3779b97f4a7c15ULL * (h + 1);
+				for (std::size_t k = StratumSize(h); k > 1; k--)
+				{
+					std::size_t j = std::size_t(NextRandom(state) % k);
+					std::swap(m_order[m_stratum_start[h] + k - 1], m_order[m_stratum_start[h] + j]);
+				}
+			}
+		});
+	}
+
+	std::size_t StrataCount() const { return m_stratum_start.empty() ? 0 : m_stratum_start.size() - 1; }
+	std::size_t StratumSize(std::size_t h) const { return m_stratum_start[h + 1] - m_stratum_start[h]; }
+
+	// Original index of the k-th sampled point of stratum h
+	std::uint32_t PointAt(std::size_t h, std::size_t k) const { return m_order[m_stratum_start[h] + k]; }
+
+private:
+	static std::uint64_t NextRandom(std::uint64_t& state)
+	{
+		std::uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	std::vector<std::uint32_t> m_order;
+	std::vector<std::size_t> m_stratum_start;
+};
+
+// Points grouped by the raster cell they lie in, for the cells covered by any point
+class CoveredCells
+{
+public:
+	template <typename Points>
+	void Build(const AreaCells& cells, const Points& points, std::size_t count)
+	{
+		// points sorted by cell, the cells may be far more than the points so they are not counted
+		std::vector<std::uint64_t> keys(count);
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++) keys[i] = (std::uint64_t(cells.CellOf(points[i][0], points[i][1])) << 32) | i;
+		});
+		std::sort(keys.begin(), keys.end());
+		m_order.resize(count);
+		m_start.clear();
+		m_centers.clear();
+		for (std::size_t k = 0; k < count; k++)
+		{
+			m_order[k] = std::uint32_t(keys[k]);
+			if (k > 0 && keys[k] >> 32 == keys[k - 1] >> 32) continue;
+			std::array<double, 2> center;
+			cells.CenterOf(std::size_t(keys[k] >> 32), center[0], center[1]);
+			m_start.push_back(k);
+			m_centers.push_back(center);
+		}
+		m_start.push_back(count);
+	}
+
+	std::size_t Count() const { return m_centers.size(); }
+	const std::vector<std::array<double, 2>>& Centers() const { return m_centers; }
+
+	// Mask of the classes of the points of cell k (bit c for class c, FEATURE_NONE if no point has a class),
+	// classify(i) gives the class of point i. Stops once every class is found.
+	template <typename Classify>
+	unsigned ClassesOf(std::size_t k, Classify classify) const
+	{
+		const unsigned all = ((1u << FEATURE_CLASS_COUNT) - 1) & ~(1u << FEATURE_NONE);
+		unsigned classes = 0;
+		for (std::size_t p = m_start[k]; p < m_start[k + 1] && classes != all; p++)
+		{
+			const int feature_class = classify(std::size_t(m_order[p]));
+			if (feature_class != FEATURE_NONE) classes |= 1u << feature_class;
+		}
+		return classes ? classes : 1u << FEATURE_NONE;
+	}
+
+private:
+	std::vector<std::uint32_t> m_order;		// points, cell by cell
+	std::vector<std::size_t> m_start;		// first point of every covered cell
+	std::vector<std::array<double, 2>> m_centers;
+};
+
+// Strata along the longer side of the xy extent
+const std::size_t PREVIEW_STRATA_PER_AXIS = 32;
+
+// Points sampled from every stratum in the first round, doubled in every following round
+const std::size_t PREVIEW_FIRST_ROUND_POINTS = 8;
+
+// Classifies a growing sample - classify(i) gives the mask of the feature classes of unit i (bit c for class c) and is
+// called in parallel - until the confidence half width of every ratio is at most 'precision' percentage points or all
+// units are classified.
+// report(estimate) gets the estimate after every round.
+template <typename Classify, typename Report>
+inline AreaRatioEstimate PreviewAreaRatios(const StratifiedSample& sample, double precision, Classify classify, Report report)
+{
+	const std::size_t strata = sample.StrataCount();
+	std::vector<FeatureCounts> stratum_counts(strata, ZeroFeatureCounts());
+	AreaRatioEstimate estimate = {};
+	estimate.complete = true;
+	if (strata == 0) return estimate;
+	double population = 0;
+	for (std::size_t h = 0; h < strata; h++) population += double(sample.StratumSize(h));
+	for (std::size_t round_points = PREVIEW_FIRST_ROUND_POINTS; ; round_points *= 2)
+	{
+		ParallelFor(strata, 16, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t h = begin; h < end; h++)
+			{
+				FeatureCounts& counts = stratum_counts[h];
+				std::size_t target = std::min(round_points, sample.StratumSize(h));
+				for (std::size_t k = counts.total; k < target; k++)
+				{
+					const unsigned classes = classify(std::size_t(sample.PointAt(h, k)));
+					for (int c = 0; c < FEATURE_CLASS_COUNT; c++) counts.points[c] += (classes >> c) & 1;
+					counts.total++;
+				}
+			}
+		});
+
+		// stratified estimate, a stratum weighs by its number of units; variance with the finite population correction
+		estimate.sampled = 0;
+		estimate.strata = strata;
+		estimate.complete = true;
+		double variance[FEATURE_CLASS_COUNT] = {};
+		for (int c = 0; c < FEATURE_CLASS_COUNT; c++) estimate.percentage[c] = 0;
+		for (std::size_t h = 0; h < strata; h++)
+		{
+			const double n = double(stratum_counts[h].total), size = double(sample.StratumSize(h));
+			const double weight = size / population;
+			estimate.sampled += stratum_counts[h].total;
+			if (n < size) estimate.complete = false;
+			for (int c = 0; c < FEATURE_CLASS_COUNT; c++)
+			{
+				double p = stratum_counts[h].points[c] / n;
+				estimate.percentage[c] += weight * p;
+				if (n > 1) variance[c] += weight * weight * (1 - n / size) * p * (1 - p) / (n - 1);
+			}
+		}
+		for (int c = 0; c < FEATURE_CLASS_COUNT; c++)
+		{
+			estimate.percentage[c] *= 100.0;
+			estimate.half_width[c] = 1.96 * 100.0 * std::sqrt(variance[c]);
+		}
+		report(estimate);
+
+		bool precise = true;
+		for (int c = 0; c < FEATURE_CLASS_COUNT; c++) precise = precise && estimate.half_width[c] <= precision;
+		if (precise || estimate.complete) return estimate;
+	}
+}
@@ -0,0 +1,179 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Areas of the feature classes measured on occupancy rasters: the xy extent of a cloud is covered by square cells, a cell
+belongs to the area of a class when at least one point of the class lies in it, and to the covered area when any point
+does. Areas are in squared units of the coordinates (m2 for metric clouds), the ratios are relative to the covered area.
+A cell holding points of several classes belongs to each of them, so the ratios of the classes may sum up to over 100%.
+Points are marked in parallel with atomic bit operations, the areas don't depend on the order the points come in.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "Classification.h"
+#include "ColorKernels.h"
+#include "Reductions.h"
+#include "ThreadPool.h"
+
+// Cells of a raster at most, a cell size giving more of them is enlarged (32 MB per bitmap)
+const std::size_t AREA_MAX_CELLS = std::size_t(1) << 28;
+
+// Areas of the classes, area[FEATURE_NONE] - cells with points of no class only
+struct FeatureAreas
+{
+	double area[FEATURE_CLASS_COUNT];
+	double covered;		// cells with any point
+	double cell_size;	// size the cells got after the enlargement
+
+	// Percentage of the covered area
+	double Ratio(int feature_class) const
+	{
+		return covered > 0 ? area[feature_class] / covered * 100.0 : 0.0;
+	}
+};
+
+// Square cells over an xy extent, the cell size is enlarged so there are at most AREA_MAX_CELLS of them
+class AreaCells
+{
+public:
+	AreaCells() : m_cell_size(1), m_columns(0), m_rows(0)
+	{
+		m_origin[0] = m_origin[1] = 0;
+	}
+
+	// Cells of 'cell_size' over the extent [lo, hi]
+	void Set(const double lo[2], const double hi[2], double cell_size)
+	{
+		double width = 0, height = 0;
+		m_origin[0] = m_origin[1] = 0;
+		if (lo[0] <= hi[0] && lo[1] <= hi[1])		// else no points
+		{
+			m_origin[0] = lo[0]; m_origin[1] = lo[1];
+			width = hi[0] - lo[0]; height = hi[1] - lo[1];
+		}
+		m_cell_size = cell_size > 0 ? cell_size : 1;
+		m_cell_size = std::max(m_cell_size, std::sqrt(width * height / double(AREA_MAX_CELLS)));
+		while ((std::floor(width / m_cell_size) + 1) * (std::floor(height / m_cell_size) + 1) > double(AREA_MAX_CELLS)) m_cell_size *= 1.25;
+		m_columns = std::size_t(width / m_cell_size) + 1;
+		m_rows = std::size_t(height / m_cell_size) + 1;
+	}
+
+	// Cell of a point, points outside the extent fall into the nearest cell
+	std::size_t CellOf(double x, double y) const
+	{
+		const double column = std::floor((x - m_origin[0]) / m_cell_size), row = std::floor((y - m_origin[1]) / m_cell_size);
+		const std::size_t c = column < 0 ? 0 : std::min(std::size_t(column), m_columns - 1);
+		const std::size_t r = row < 0 ? 0 : std::min(std::size_t(row), m_rows - 1);
+		return r * m_columns + c;
+	}
+
+	void CenterOf(std::size_t cell, double& x, double& y) const
+	{
+		x = m_origin[0] + (double(cell % m_columns) + 0.5) * m_cell_size;
+		y = m_origin[1] + (double(cell / m_columns) + 0.5) * m_cell_size;
+	}
+
+	double CellSize() const { return m_cell_size; }
+	std::size_t Count() const { return m_columns * m_rows; }
+
+private:
+	double m_cell_size;
+	double m_origin[2];
+	std::size_t m_columns, m_rows;
+};
+
+class FeatureAreaRaster
+{
+public:
+	FeatureAreaRaster() : m_words(0) {}
+
+	// Cells of 'cell_size' over the extent [lo, hi], all of them empty
+	void SetExtent(const double lo[2], const double hi[2], double cell_size)
+	{
+		m_cells.Set(lo, hi, cell_size);
+		m_words = (m_cells.Count() + 63) / 64;
+		for (int b = 0; b < BITMAPS; b++)
+		{
+			m_bitmaps[b].reset(new std::atomic<std::uint64_t>[m_words]);
+			for (std::size_t w = 0; w < m_words; w++) m_bitmaps[b][w].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// Cells over the extent of the loaded points
+	template <typename Points>
+	void SetExtentOf(const Points& points, std::size_t count, double cell_size)
+	{
+		const XyExtent extent = XyExtentOf(points, count);
+		SetExtent(extent.lo, extent.hi, cell_size);
+	}
+
+	// Marks a point of the class (FEATURE_NONE for a point of no class), may be called from many threads at once
+	void Mark(double x, double y, int feature_class)
+	{
+		const std::size_t cell = m_cells.CellOf(x, y);
+		Set(m_bitmaps[COVERED], cell);
+		Set(m_bitmaps[feature_class], cell);
+	}
+
+	// Marks the points [0, count) in parallel, class_of(i) gives the class of point i or a negative number for a point left out
+	template <typename Points, typename ClassOf>
+	void MarkAll(const Points& points, std::size_t count, ClassOf class_of)
+	{
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++)
+			{
+				const int feature_class = class_of(i);
+				if (feature_class >= 0) Mark(points[i][0], points[i][1], feature_class);
+			}
+		});
+	}
+
+	FeatureAreas Areas() const
+	{
+		// a cell with points of a class and of no class belongs to the class only
+		std::size_t cells[BITMAPS] = {};
+		for (std::size_t w = 0; w < m_words; w++)
+		{
+			std::uint64_t classified = 0;
+			for (int c = FEATURE_NONE + 1; c < FEATURE_CLASS_COUNT; c++)
+			{
+				const std::uint64_t word = m_bitmaps[c][w].load(std::memory_order_relaxed);
+				cells[c] += PopCount64(word);
+				classified |= word;
+			}
+			cells[FEATURE_NONE] += PopCount64(m_bitmaps[FEATURE_NONE][w].load(std::memory_order_relaxed) & ~classified);
+			cells[COVERED] += PopCount64(m_bitmaps[COVERED][w].load(std::memory_order_relaxed));
+		}
+		FeatureAreas areas;
+		const double cell_area = m_cells.CellSize() * m_cells.CellSize();
+		for (int c = 0; c < FEATURE_CLASS_COUNT; c++) areas.area[c] = double(cells[c]) * cell_area;
+		areas.covered = double(cells[COVERED]) * cell_area;
+		areas.cell_size = m_cells.CellSize();
+		return areas;
+	}
+
+	const AreaCells& Cells() const { return m_cells; }
+
+private:
+	static const int COVERED = FEATURE_CLASS_COUNT;
+	static const int BITMAPS = FEATURE_CLASS_COUNT + 1;
+
+	// Dense clouds hit the same cell many times, the bit is read before the atomic write
+	static void Set(const std::unique_ptr<std::atomic<std::uint64_t>[]>& bitmap, std::size_t cell)
+	{
+		std::atomic<std::uint64_t>& word = bitmap[cell / 64];
+		const std::uint64_t bit = std::uint64_t(1) << (cell % 64);
+		if (!(word.load(std::memory_order_relaxed) & bit)) word.fetch_or(bit, std::memory_order_relaxed);
+	}
+
+	AreaCells m_cells;
+	std::size_t m_words;
+	std::unique_ptr<std::atomic<std::uint64_t>[]> m_bitmaps[BITMAPS];		// bitmaps of the classes, then of all points
+};
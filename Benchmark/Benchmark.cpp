@@ -0,0 +1,514 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Benchmark of the plugins outside the host application.
+Methods run on synthetic terrain clouds through the ogx stand-in, their hot loops are also timed one by one.
+Reports time, points per second, bytes allocated and peak of allocated memory of every stage.
+
+Usage: ogx_benchmark [points ...] [--seed N] [--memory-budget MB] [--trace DIR] [--preview P] [--index-dir DIR] [--verbose] [--check-rules] [--help]
+Sizes may use k / M suffixes, default: 1M 10M 100M. With --trace every method run writes the Chrome trace
+of its stages to DIR/<method>_<points>.json, --verbose also prints their summary tables.
+--preview also times the AreasDetection preview with precision P (in percentage points).
+Spatial indexes kept in memory are dropped before every method run; with --index-dir they are saved
+there and a second benchmark with the same seed times loading them.
+--check-rules only checks lightness comparisons of the classification rules against the exact lightness (ctest).
+*/
+
+#include <ogx/Plugins/EasyPlugin.h>
+#include <ogx/Data/Clouds/CloudHelpers.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "AreaRaster.h"
+#include "Classification.h"
+#include "ClassificationRules.h"
+#include "ColorHistograms.h"
+#include "ColorKernels.h"
+#include "ColorLookup.h"
+#include "ColumnViews.h"
+#include "GroundRaster.h"
+#include "IndexStore.h"
+#include "LocalGeometry.h"
+#include "PluginHelpers.h"
+#include "Reductions.h"
+#include "SelectionSets.h"
+#include "Simplification.h"
+#include "SpatialIndex.h"
+#include "StageProfile.h"
+#include "TerrainGenerator.h"
+#include "ThreadPool.h"
+
+using namespace ogx;
+using namespace ogx::Data;
+
+// Allocation counters of the global operator new
+namespace
+{
+	std::atomic<std::size_t> g_allocated(0);	// all bytes ever allocated
+	std::atomic<std::size_t> g_live(0);
+	std::atomic<std::size_t> g_peak(0);
+
+	const std::size_t ALLOCATION_HEADER = 16;	// keeps the size, preserves alignment
+
+	// Every block comes from std::malloc and goes back through CountedFree to std::free, whichever overload of
+	// new and delete is used. Null if there is no memory.
+	void* CountedAlloc(std::size_t size)
+	{
+		void* block = std::malloc(size + ALLOCATION_HEADER);
+		if (!block) return nullptr;
+		*static_cast<std::size_t*>(block) = size;
+		g_allocated += size;
+		StageAllocations().count++;
+		StageAllocations().bytes += size;
+		std::size_t live = g_live += size;
+		std::size_t peak = g_peak.load();
+		while (live > peak && !g_peak.compare_exchange_weak(peak, live)) {}
+		return static_cast<char*>(block) + ALLOCATION_HEADER;
+	}
+
+	// Not inlined into the callers of delete, where GCC would see std::free on a pointer of operator new
+#if defined(__GNUC__)
+	__attribute__((noinline))
+#endif
+	void CountedFree(void* p)
+	{
+		if (!p) return;
+		char* block = static_cast<char*>(p) - ALLOCATION_HEADER;
+		g_live -= *reinterpret_cast<std::size_t*>(block);
+		std::free(block);
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	void* p = CountedAlloc(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return CountedAlloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return CountedAlloc(size); }
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept { CountedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { CountedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { CountedFree(p); }
+
+struct StageResult
+{
+	std::string name;
+	double seconds;
+	std::size_t points;
+	std::size_t allocated;		// bytes allocated by the stage
+	std::size_t peak;			// peak of live bytes above the start of the stage
+};
+
+template <typename Function>
+StageResult MeasureStage(const std::string& name, std::size_t points, Function function)
+{
+	std::size_t live = g_live.load();
+	std::size_t allocated = g_allocated.load();
+	g_peak = live;
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto stop = std::chrono::steady_clock::now();
+	StageResult result;
+	result.name = name;
+	result.seconds = std::chrono::duration<double>(stop - start).count();
+	result.points = points;
+	result.allocated = g_allocated.load() - allocated;
+	result.peak = g_peak.load() - live;
+	return result;
+}
+
+void PrintStage(const StageResult& stage)
+{
+	const double mb = 1.0 / (1 << 20);
+	std::printf("%12zu  %-36s %10.1f %10.2f %12.1f %12.1f\n", stage.points, stage.name.c_str(), stage.seconds * 1000.0,
+		stage.points / stage.seconds / 1e6, stage.allocated * mb, stage.peak * mb);
+	std::fflush(stdout);
+}
+
+// Cloud attached to a new node under the project root
+Clouds::ICloud* AddBenchmarkCloud(Execution::Context& context, std::size_t points, const TerrainSettings& settings, ResourceID& node_id)
+{
+	auto element = context.Project().ElementCreate<Clouds::ICloud>();
+	element->Rename(L"Terrain");
+	auto node = context.m_project->m_root->CreateChild();
+	node->Rename(L"Terrain");
+	node->SetElement(element);
+	node_id = node->GetID();
+	Clouds::ICloud* cloud = element->GetData<Clouds::ICloud>();
+	cloud->Resize(points);
+	GenerateTerrain(settings, points, cloud->m_xyz, cloud->m_colors);
+	return cloud;
+}
+
+// Stand-in of the host simplification algorithm: representatives stay, other points are marked deleted
+void RegisterStandInAlgorithms(Execution::Context& context)
+{
+	context.Execution().Register(L"Clouds_Simplification.HomogeneousSimplification", [](Execution::Context& algorithm_context, Execution::Parameters& in)
+	{
+		Nodes::ITransTreeNode* node = algorithm_context.m_project->TransTreeFindNode(in[L"node_id"].m_id);
+		double minimal_distance = in[L"minimal_distance"].m_number;
+		if (!node) return;
+		Clouds::ForEachCloud(*node, [&](Clouds::ICloud& cloud, Nodes::ITransTreeNode&)
+		{
+			VoxelHashGrid grid;
+			grid.Build(cloud.m_xyz, cloud.m_xyz.size(), float(minimal_distance));
+			std::vector<std::uint64_t> representatives;
+			HomogeneousRepresentatives(grid, minimal_distance, representatives);
+			for (std::size_t i = 0; i < cloud.m_states.size(); i++)
+			{
+				cloud.m_states[i][Clouds::PS_DELETED] = ((representatives[i / 64] >> (i % 64)) & 1) == 0;
+			}
+		});
+	});
+}
+
+// Parameters set for every method run
+struct RunOptions
+{
+	double memory_budget;
+	std::string trace_dir;
+	std::string index_dir;
+};
+
+// Exported method initialized with the options on the cloud of the node, with a preview precision only for AreasDetection
+std::unique_ptr<Plugin::EasyMethod> InitMethod(Execution::Context& context, const char* method, const wchar_t* node_parameter, ResourceID node_id,
+	std::size_t points, const RunOptions& options, double preview_precision = 0)
+{
+	// Selections combines the stored selections, it loads no points
+	const bool loads_points = method != std::string("Selections");
+	std::unique_ptr<Plugin::EasyMethod> instance = Plugin::MethodRegistry()[method]();
+	Plugin::ParameterBank bank;
+	instance->DefineParameters(bank);
+	bank.Set(node_parameter, node_id);
+	if (loads_points) bank.Set(L"memory budget", options.memory_budget);
+	if (preview_precision > 0) bank.Set(L"preview precision", preview_precision);
+	if (!options.trace_dir.empty())
+	{
+		std::string trace_file = options.trace_dir + "/" + method + "_" + std::to_string(points) + ".json";
+		bank.Set(L"trace file", std::wstring(trace_file.begin(), trace_file.end()));
+	}
+	if (!options.index_dir.empty() && loads_points && method != std::string("ColorFilter"))
+	{
+		bank.Set(L"index directory", std::wstring(options.index_dir.begin(), options.index_dir.end()));
+	}
+	instance->Init(context);
+	return instance;
+}
+
+// Whole Run of an exported method on a fresh terrain cloud, with a preview precision only for AreasDetection
+StageResult RunMethod(const char* method, const wchar_t* node_parameter, std::size_t points, const TerrainSettings& settings, const RunOptions& options,
+	double preview_precision = 0)
+{
+	Execution::Context context;
+	RegisterStandInAlgorithms(context);
+	ResourceID node_id;
+	AddBenchmarkCloud(context, points, settings, node_id);
+	SharedSpatialIndexes().Clear();
+	SharedLayerCache().Clear();
+	SharedSelections().Clear();
+	std::unique_ptr<Plugin::EasyMethod> instance = InitMethod(context, method, node_parameter, node_id, points, options, preview_precision);
+	return MeasureStage(std::string(method) + (preview_precision > 0 ? "::Run preview" : "::Run"), points, [&] { instance->Run(context); });
+}
+
+// Whole Run of Selections on a fresh terrain cloud, the selections of ColorFilter and AreasDetection stored before
+StageResult RunSelections(std::size_t points, const TerrainSettings& settings, const RunOptions& options)
+{
+	Execution::Context context;
+	RegisterStandInAlgorithms(context);
+	ResourceID node_id;
+	AddBenchmarkCloud(context, points, settings, node_id);
+	SharedSpatialIndexes().Clear();
+	SharedLayerCache().Clear();
+	SharedSelections().Clear();
+	InitMethod(context, "ColorFilter", L"node id", node_id, points, options)->Run(context);
+	InitMethod(context, "AreasDetection", L"node_id", node_id, points, options)->Run(context);
+	std::unique_ptr<Plugin::EasyMethod> instance = InitMethod(context, "Selections", L"node_id", node_id, points, options);
+	return MeasureStage("Selections::Run", points, [&] { instance->Run(context); });
+}
+
+// Lightness comparisons of the rules, run on the codes, against the exact lightness (max + min) / 510 of colors
+// covering every code, for thresholds inside and outside [0, 1]. Returns the number of wrong classes.
+std::size_t CheckLightnessRules()
+{
+	std::vector<std::uint8_t> rgb;
+	for (int v = 0; v < 256; v++)
+	{
+		const std::uint8_t colors[3][3] = { { std::uint8_t(v), std::uint8_t(v), std::uint8_t(v) }, { std::uint8_t(v), 0, 0 }, { 255, std::uint8_t(v), std::uint8_t(v) } };
+		for (auto& color : colors) rgb.insert(rgb.end(), color, color + 3);
+	}
+	const std::size_t count = rgb.size() / 3;
+	std::vector<std::uint16_t> H(count), L(count);
+	RgbToHlCodes(rgb.data(), 3, count, H.data(), L.data());
+	std::vector<float> zeros(count, 0.0f);
+
+	const char* const comparisons[] = { "<", "<=", ">", ">=", "==", "!=" };
+	const double thresholds[] = { -1, -0.0001, 0, 0.2, 0.5, 1, 1.0001, 2, 200 };
+	std::size_t wrong = 0;
+	for (int c = 0; c < 6; c++)
+	{
+		for (double t : thresholds)
+		{
+			wchar_t text[64];
+			std::swprintf(text, 64, L"snow: L %hs %g", comparisons[c], t);
+			FeatureRules rules;
+			std::wstring error;
+			if (!rules.Compile(text, error))
+			{
+				std::printf("%ls: %ls\n", text, error.c_str());
+				wrong++;
+				continue;
+			}
+			RuleInputs inputs = {};
+			inputs.H = H.data();
+			inputs.L = L.data();
+			inputs.colors = rgb.data();
+			inputs.color_stride = 3;
+			inputs.plane_error = inputs.z = inputs.x = inputs.y = MakeChannelView(zeros.data());
+			inputs.count = count;
+			std::size_t rule_wrong = 0;
+			ClassifyFeaturesByRules(inputs, rules, [&](std::size_t i, int feature_class)
+			{
+				const std::uint8_t* color = &rgb[3 * i];
+				double lightness = (std::max({ color[0], color[1], color[2] }) + std::min({ color[0], color[1], color[2] })) / 510.0;
+				bool expected[6] = { lightness < t, lightness <= t, lightness > t, lightness >= t, lightness == t, lightness != t };
+				if ((feature_class == FEATURE_SNOW) != expected[c]) rule_wrong++;
+			}, [](std::size_t) { return false; });
+			if (rule_wrong) std::printf("%ls: %zu wrong points\n", text, rule_wrong);
+			wrong += rule_wrong;
+		}
+	}
+	return wrong;
+}
+
+// Hot loops of the methods timed one by one on the same cloud
+void RunKernelStages(std::size_t points, const TerrainSettings& settings)
+{
+	Execution::Context context;
+	ResourceID node_id;
+	Clouds::ICloud* cloud = AddBenchmarkCloud(context, points, settings, node_id);
+	const std::vector<Clouds::Point3D>& xyz = cloud->m_xyz;
+	const std::uint8_t* color_bytes = reinterpret_cast<const std::uint8_t*>(cloud->m_colors.data());
+	const std::size_t stride = sizeof(Clouds::Color);
+
+	// ColorFilter
+	std::vector<std::uint64_t> mask(MaskWords(points));
+	RgbBox box = StrictRgbBox(100, 200, 80, 180, 90, 200);
+	std::size_t found = 0;
+	PrintStage(MeasureStage("ColorFilter: rgb range mask", points, [&]
+	{
+		found = ParallelReduce(mask.size(), PARALLEL_GRAIN / 64, std::size_t(0), [&](std::size_t first_word, std::size_t last_word)
+		{
+			std::size_t first = first_word * 64;
+			return RgbRangeMask(color_bytes + first * stride, stride, std::min(last_word * 64, points) - first, box, mask.data() + first_word);
+		}, std::plus<std::size_t>());
+	}));
+
+	std::vector<ColorRegion> regions;
+	std::vector<ColorClass> classes;
+	std::wstring error;
+	ParseColorRegions(L"rgb(100-200, 80-180, 90-200); rgb(0-40, 0-40, 0-40); hsl(90-150, 0.2-1, 0.1-0.6); hsl(330-20, 0.3-1, 0.2-0.7); "
+		L"palette(12: #7a5f87 #6e5a80); palette(8: #f5f5f5); rgb(200-255, 150-255, 0-60); hsl(200-250, 0.1-1, 0.3-0.8)", regions, classes, error);
+	ColorLookupTable table;
+	PrintStage(MeasureStage("ColorFilter: compile 8 color regions", 0, [&] { table.Compile(regions); }));
+	PrintStage(MeasureStage("ColorFilter: color regions lookup", points, [&]
+	{
+		found = ParallelReduce(mask.size(), PARALLEL_GRAIN / 64, std::size_t(0), [&](std::size_t first_word, std::size_t last_word)
+		{
+			std::size_t first = first_word * 64;
+			return table.RegionMask(color_bytes + first * stride, stride, std::min(last_word * 64, points) - first, mask.data() + first_word);
+		}, std::plus<std::size_t>());
+	}));
+	PrintStage(MeasureStage("ColorFilter: color histograms", points, [&]
+	{
+		ColorHistograms histograms = ColorHistogramsOf(color_bytes, stride, points, true);
+		for (int channel = 0; channel < COLOR_CHANNEL_COUNT; channel++) histograms.Thresholds(channel);
+	}));
+
+	// ColorIntensity
+	KdTree search_tree;
+	PrintStage(MeasureStage("ColorIntensity: kd-tree build", points, [&] { search_tree.Build(xyz, points); }));
+	PrintStage(MeasureStage("ColorIntensity: 10 nearest neighbours", points, [&]
+	{
+		found = ParallelReduce(search_tree.Size(), PARALLEL_GRAIN / 16, std::size_t(0), [&](std::size_t begin, std::size_t end)
+		{
+			std::uint32_t neighbours[10];
+			float distances[10];
+			std::size_t chunk = 0;
+			for (std::size_t pos = begin; pos < end; pos++)
+			{
+				chunk += search_tree.FindNearest(search_tree.PointAt(pos), 10, neighbours, distances);
+			}
+			return chunk;
+		}, std::plus<std::size_t>());
+	}));
+	search_tree = KdTree();
+	std::vector<float> intensity(points), statistics(4 * points);
+	PrintStage(MeasureStage("ColorIntensity: radius statistics", points, [&]
+	{
+		for (std::size_t i = 0; i < points; i++) intensity[i] = (color_bytes[i * stride] + color_bytes[i * stride + 1] + color_bytes[i * stride + 2]) / 3.0f;
+		VoxelHashGrid grid;
+		grid.Build(xyz, points, float(1.0 / STATISTICS_CELLS_PER_RADIUS));
+		NeighbourhoodStatistics(grid, 1.0, intensity.data(), &statistics[0], &statistics[points], &statistics[2 * points], &statistics[3 * points]);
+	}));
+	statistics = std::vector<float>();
+
+	// AreasDetection
+	std::vector<std::uint16_t> H(points), L(points);
+	std::vector<float> plane_error(points);
+	PrintStage(MeasureStage("AreasDetection: rgb to hsl", points, [&]
+	{
+		ParallelFor(points, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			RgbToHlCodes(color_bytes + begin * stride, stride, end - begin, H.data() + begin, L.data() + begin);
+		});
+	}));
+	const double radius = 1.0;
+	PrintStage(MeasureStage("AreasDetection: plane fitting error", points, [&]
+	{
+		VoxelHashGrid grid;
+		grid.Build(xyz, points, float(radius / PLANE_FIT_CELLS_PER_RADIUS));
+		PlaneFittingErrors(grid, radius, plane_error.data());
+	}));
+	std::vector<std::uint64_t> representatives;
+	PrintStage(MeasureStage("AreasDetection: representatives", points, [&]
+	{
+		VoxelHashGrid grid;
+		grid.Build(xyz, points, 0.1f);
+		HomogeneousRepresentatives(grid, 0.1, representatives);
+	}));
+	double mean_height = 0;
+	PrintStage(MeasureStage("AreasDetection: mean height", points, [&]
+	{
+		mean_height = ReduceChannel(CoordinateView(xyz, 2), points).Mean();
+	}));
+	std::vector<std::uint8_t> features(points);
+	GroundRaster ground;
+	PrintStage(MeasureStage("AreasDetection: ground raster", points, [&]
+	{
+		ground.Build(xyz, points, 5.0, 5.0);
+	}));
+	FeatureRules rules;
+	std::wstring rules_error;
+	rules.Compile(DEFAULT_FEATURE_RULES, rules_error);
+	PrintStage(MeasureStage("AreasDetection: classification rules", points, [&]
+	{
+		RuleInputs inputs;
+		inputs.H = H.data();
+		inputs.L = L.data();
+		inputs.colors = color_bytes;
+		inputs.color_stride = stride;
+		inputs.plane_error = MakeChannelView(plane_error.data());
+		inputs.x = CoordinateView(xyz, 0);
+		inputs.y = CoordinateView(xyz, 1);
+		inputs.z = CoordinateView(xyz, 2);
+		inputs.ground = &ground;
+		inputs.count = points;
+		inputs.mean_height = mean_height;
+		ClassifyFeaturesByRules(inputs, rules, [&](std::size_t i, int feature_class) { features[i] = std::uint8_t(feature_class); },
+			[&](std::size_t i) { return ((representatives[i / 64] >> (i % 64)) & 1) != 0; });
+	}));
+	PrintStage(MeasureStage("AreasDetection: area rasters", points, [&]
+	{
+		FeatureAreaRaster areas;
+		areas.SetExtentOf(xyz, points, 0.5);
+		areas.MarkAll(xyz, points, [&](std::size_t i) { return int(features[i]); });
+		areas.Areas();
+	}));
+
+	// Selections
+	PrintStage(MeasureStage("Selections: vegetation and not selected-by-color", points, [&]
+	{
+		const PointSelection vegetation = PointSelection::Of(points, [&](std::size_t i) { return features[i] == FEATURE_VEGETATION; });
+		const PointSelection by_color = PointSelection::OfMask(mask.data(), points);
+		SelectionExpression expression;
+		PointSelection result;
+		expression.Compile(L"vegetation and not selected-by-color", error);
+		expression.Evaluate([&](const std::wstring& name) { return name == L"vegetation" ? &vegetation : &by_color; }, result, error);
+		result.Count();
+	}));
+}
+
+// Number of points with an optional k / M suffix, 0 if the text is not one
+std::size_t ParsePoints(const char* text)
+{
+	char* end = nullptr;
+	double value = std::strtod(text, &end);
+	if (end == text) return 0;
+	if (*end == 'k' || *end == 'K') value *= 1e3;
+	if (*end == 'm' || *end == 'M') value *= 1e6;
+	if (*end == 'k' || *end == 'K' || *end == 'm' || *end == 'M') end++;
+	return *end || value < 1 ? 0 : std::size_t(value);
+}
+
+void PrintUsage()
+{
+	std::printf("Usage: ogx_benchmark [points ...] [--seed N] [--memory-budget MB] [--trace DIR] [--preview P] [--index-dir DIR] [--verbose] [--check-rules] [--help]\n"
+		"Sizes may use k / M suffixes, default: 1M 10M 100M.\n");
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::size_t> sizes;
+	TerrainSettings settings;
+	RunOptions options = { 0, "", "" };
+	double preview_precision = 0;
+	Log::Threshold() = Warning;
+	StageAllocations().enabled = true;
+	for (int a = 1; a < argc; a++)
+	{
+		if (!std::strcmp(argv[a], "--help") || !std::strcmp(argv[a], "-h"))
+		{
+			PrintUsage();
+			return 0;
+		}
+		if (!std::strcmp(argv[a], "--check-rules"))
+		{
+			// exact rule semantics instead of timing, run by ctest
+			std::size_t wrong = CheckLightnessRules();
+			std::printf("lightness rules: %s\n", wrong ? "FAILED" : "ok");
+			return wrong ? 1 : 0;
+		}
+	}
+	for (int a = 1; a < argc; a++)
+	{
+		if (!std::strcmp(argv[a], "--seed") && a + 1 < argc) settings.seed = std::strtoull(argv[++a], nullptr, 10);
+		else if (!std::strcmp(argv[a], "--memory-budget") && a + 1 < argc) options.memory_budget = std::strtod(argv[++a], nullptr);
+		else if (!std::strcmp(argv[a], "--trace") && a + 1 < argc) options.trace_dir = argv[++a];
+		else if (!std::strcmp(argv[a], "--preview") && a + 1 < argc) preview_precision = std::strtod(argv[++a], nullptr);
+		else if (!std::strcmp(argv[a], "--index-dir") && a + 1 < argc) options.index_dir = argv[++a];
+		else if (!std::strcmp(argv[a], "--verbose")) Log::Threshold() = Debug;
+		else if (std::size_t points = ParsePoints(argv[a])) sizes.push_back(points);
+		else
+		{
+			std::fprintf(stderr, "Unknown argument: %s\n", argv[a]);
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (sizes.empty()) sizes = { 1000000, 10000000, 100000000 };
+
+	std::printf("threads: %u, seed: %llu, memory budget: %g MB\n", SharedThreadPool().Concurrency(), (unsigned long long)settings.seed, options.memory_budget);
+	std::printf("%12s  %-36s %10s %10s %12s %12s\n", "points", "stage", "time [ms]", "Mpts/s", "alloc [MB]", "peak [MB]");
+	for (std::size_t points : sizes)
+	{
+		RunKernelStages(points, settings);
+		PrintStage(RunMethod("ColorFilter", L"node id", points, settings, options));
+		PrintStage(RunMethod("ColorIntensity", L"node_id", points, settings, options));
+		PrintStage(RunMethod("AreasDetection", L"node_id", points, settings, options));
+		if (preview_precision > 0) PrintStage(RunMethod("AreasDetection", L"node_id", points, settings, options, preview_precision));
+		PrintStage(RunSelections(points, settings, options));
+	}
+	return 0;
+}
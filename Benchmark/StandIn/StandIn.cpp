@@ -0,0 +1,8 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Out-of-line definitions of the ogx stand-in.
+*/
+
+#include "ogx/StandIn.h"
+
+const ogx::Data::ResourceID ogx::Data::ResourceID::invalid(-1);
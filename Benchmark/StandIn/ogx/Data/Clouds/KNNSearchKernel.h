@@ -0,0 +1,44 @@
+// Stand-in of the ogx SDK header, see StandIn.h
+#pragma once
+#include "../../StandIn.h"
+
+namespace ogx { namespace Data { namespace Clouds {
+
+	// k nearest neighbours of a point, answered from the cloud's uniform grid
+	class KNNSearchKernel : public ISearchKernel
+	{
+	public:
+		KNNSearchKernel(const Math::Point3D& point, int count) : m_point(point), m_count(count) {}
+		Math::Point3D& GetPoint() { return m_point; }
+		const Math::Point3D& GetPoint() const { return m_point; }
+
+		void Find(const ICloud& cloud, std::vector<std::uint32_t>& indices) const override
+		{
+			indices.clear();
+			const ICloud::Grid& grid = cloud.GetGrid();
+			if (grid.empty() || m_count <= 0) return;
+			Eigen::Vector3f query = m_point.cast<float>();
+			Eigen::Vector3i center = GridCell(grid, query);
+			std::vector<std::pair<float, std::uint32_t>> best;	// max-heap on distance
+			int max_ring = grid.m_dims.maxCoeff() + std::abs(center.maxCoeff()) + std::abs(center.minCoeff());
+			for (int ring = 0; ring <= max_ring; ring++)
+			{
+				VisitShell(grid, center, ring, [&](std::uint32_t i)
+				{
+					float d = (cloud.m_xyz[i] - query).squaredNorm();
+					if (int(best.size()) < m_count) { best.emplace_back(d, i); std::push_heap(best.begin(), best.end()); }
+					else if (d < best.front().first) { std::pop_heap(best.begin(), best.end()); best.back() = std::make_pair(d, i); std::push_heap(best.begin(), best.end()); }
+				});
+				// every point outside this shell is further than ring * cell
+				if (int(best.size()) == m_count && best.front().first <= (ring * grid.m_cell) * (ring * grid.m_cell)) break;
+			}
+			std::sort_heap(best.begin(), best.end());
+			for (auto& b : best) indices.push_back(b.second);
+		}
+
+	private:
+		Math::Point3D m_point;
+		int m_count;
+	};
+
+} } }
@@ -0,0 +1,36 @@
+// Stand-in of the ogx SDK header, see StandIn.h
+#pragma once
+#include "../../StandIn.h"
+
+namespace ogx { namespace Data { namespace Clouds {
+
+	// all points within a radius of a point, answered from the cloud's uniform grid
+	class SphericalSearchKernel : public ISearchKernel
+	{
+	public:
+		SphericalSearchKernel(const Math::Point3D& point, double radius) : m_point(point), m_radius(radius) {}
+		Math::Point3D& GetPoint() { return m_point; }
+		double& GetRadius() { return m_radius; }
+
+		void Find(const ICloud& cloud, std::vector<std::uint32_t>& indices) const override
+		{
+			indices.clear();
+			const ICloud::Grid& grid = cloud.GetGrid();
+			if (grid.empty()) return;
+			Eigen::Vector3f query = m_point.cast<float>();
+			Eigen::Vector3i center = GridCell(grid, query);
+			int rings = int(std::ceil(m_radius / grid.m_cell));
+			float r2 = float(m_radius * m_radius);
+			for (int ring = 0; ring <= rings; ring++)
+				VisitShell(grid, center, ring, [&](std::uint32_t i)
+				{
+					if ((cloud.m_xyz[i] - query).squaredNorm() <= r2) indices.push_back(i);
+				});
+		}
+
+	private:
+		Math::Point3D m_point;
+		double m_radius;
+	};
+
+} } }
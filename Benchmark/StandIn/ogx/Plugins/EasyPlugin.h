@@ -0,0 +1,3 @@
+// Stand-in of the ogx SDK header, see StandIn.h
+#pragma once
+#include "../StandIn.h"
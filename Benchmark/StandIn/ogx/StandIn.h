@@ -0,0 +1,629 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Minimal in-memory stand-in for the parts of the ogx SDK used by the plugins.
+Only meant for building and benchmarking the methods outside the host application.
+*/
+
+#pragma once
+
+#include <Eigen/Dense>
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cwchar>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ogx
+{
+	typedef std::wstring String;
+	typedef float StoredReal;
+	typedef Eigen::Vector3f StoredPoint3D;
+	typedef double Real;
+
+	enum LogLevel { Debug, Info, User, Warning, Error };
+
+	namespace Math
+	{
+		typedef Eigen::Vector3d Point3D;
+	}
+
+	// Log sink - prints to stdout (narrow, like the benchmark tables), the level filter is set by the benchmark
+	struct Log
+	{
+		Log() {}		// scopes (OGX_SCOPE) are declared without being used, like in the host
+		static LogLevel& Threshold() { static LogLevel level = Info; return level; }
+
+		void Msg(LogLevel level, const String& text)
+		{
+			if (level >= Threshold()) std::printf("%ls\n", text.c_str());
+		}
+
+		void Format(LogLevel level, const wchar_t* format, ...)
+		{
+			if (level < Threshold()) return;
+			wchar_t buffer[1024];
+			va_list args;
+			va_start(args, format);
+			std::vswprintf(buffer, sizeof(buffer) / sizeof(buffer[0]), format, args);
+			va_end(args);
+			std::printf("%ls\n", buffer);
+		}
+	};
+
+	namespace Data
+	{
+		struct ResourceID
+		{
+			long long m_id;
+			ResourceID(long long id = -1) : m_id(id) {}
+			bool operator==(const ResourceID& other) const { return m_id == other.m_id; }
+			bool operator!=(const ResourceID& other) const { return m_id != other.m_id; }
+			bool operator<(const ResourceID& other) const { return m_id < other.m_id; }
+			static const ResourceID invalid;
+		};
+		inline ResourceID NextResourceID() { static long long next = 1; return ResourceID(next++); }
+
+		namespace Layers
+		{
+			class ILayer
+			{
+			public:
+				ILayer(const String& name, StoredReal default_value) : m_name(name), m_default(default_value) {}
+				const String& GetName() const { return m_name; }
+				StoredReal GetDefaultValue() const { return m_default; }
+
+				String m_name;
+				StoredReal m_default;
+				std::vector<StoredReal> m_values;	// one value per point of the owning cloud
+			};
+		}
+
+		namespace Clouds
+		{
+			typedef Eigen::Vector3f Point3D;
+			typedef Eigen::Matrix<std::uint8_t, 4, 1> Color;
+			typedef Eigen::Vector3f Normal;
+			typedef std::bitset<32> State;
+
+			enum PointState { PS_SELECTED = 0, PS_DELETED = 31 };
+
+			class ICloud;
+			class PointsRange;
+
+			// Base of the neighbourhood search kernels
+			struct ISearchKernel
+			{
+				virtual ~ISearchKernel() {}
+				virtual void Find(const ICloud& cloud, std::vector<std::uint32_t>& indices) const = 0;
+			};
+
+			class PointsRange
+			{
+			public:
+				PointsRange() : m_cloud(nullptr) {}
+
+				std::size_t size() const { return m_indices.size(); }
+				bool empty() const { return m_indices.empty(); }
+				void clear() { m_indices.clear(); }
+
+				void GetXYZ(std::vector<Point3D>& out) const;
+				void SetXYZ(const std::vector<Point3D>& in);
+				void GetColors(std::vector<Color>& out) const;
+				void SetColors(const std::vector<Color>& in);
+				void GetStates(std::vector<State>& out) const;
+				void SetStates(const std::vector<State>& in);
+				void GetNormals(std::vector<Normal>& out) const;
+				void GetLayerVals(std::vector<StoredReal>& out, const Layers::ILayer& layer) const;
+				void SetLayerVals(const std::vector<StoredReal>& in, Layers::ILayer& layer);
+
+				ICloud* m_cloud;
+				std::vector<std::uint32_t> m_indices;
+			};
+
+			class ICloud
+			{
+			public:
+				class Access
+				{
+				public:
+					explicit Access(ICloud& cloud) : m_cloud(cloud) {}
+
+					void GetAllPoints(PointsRange& range)
+					{
+						range.m_cloud = &m_cloud;
+						range.m_indices.resize(m_cloud.m_xyz.size());
+						for (std::size_t i = 0; i < range.m_indices.size(); i++) range.m_indices[i] = std::uint32_t(i);
+					}
+
+					void FindPoints(const ISearchKernel& kernel, PointsRange& range)
+					{
+						range.m_cloud = &m_cloud;
+						kernel.Find(m_cloud, range.m_indices);
+					}
+
+					void AllocPoints(std::size_t count, PointsRange* range)
+					{
+						std::size_t first = m_cloud.m_xyz.size();
+						m_cloud.Resize(first + count);
+						if (!range) return;
+						range->m_cloud = &m_cloud;
+						range->m_indices.resize(count);
+						for (std::size_t i = 0; i < count; i++) range->m_indices[i] = std::uint32_t(first + i);
+					}
+
+				private:
+					ICloud& m_cloud;
+				};
+
+				Access GetAccess() { return Access(*this); }
+
+				std::vector<Layers::ILayer*> FindLayers(const String& name)
+				{
+					std::vector<Layers::ILayer*> found;
+					for (auto& layer : m_layers)
+						if (layer->GetName() == name) found.push_back(layer.get());
+					return found;
+				}
+
+				Layers::ILayer* CreateLayer(const String& name, StoredReal default_value)
+				{
+					m_layers.emplace_back(new Layers::ILayer(name, default_value));
+					m_layers.back()->m_values.assign(m_xyz.size(), default_value);
+					return m_layers.back().get();
+				}
+
+				void Resize(std::size_t count)
+				{
+					m_xyz.resize(count, Point3D::Zero());
+					m_colors.resize(count, Color::Zero());
+					m_states.resize(count);
+					m_normals.resize(count, Normal::Zero());
+					for (auto& layer : m_layers) layer->m_values.resize(count, layer->GetDefaultValue());
+					m_grid.clear();
+				}
+
+				std::vector<Point3D> m_xyz;
+				std::vector<Color> m_colors;
+				std::vector<State> m_states;
+				std::vector<Normal> m_normals;
+				std::vector<std::unique_ptr<Layers::ILayer>> m_layers;
+
+				// lazily built uniform grid used by the stand-in search kernels
+				struct Grid
+				{
+					float m_cell = 0;
+					Eigen::Vector3f m_origin = Eigen::Vector3f::Zero();
+					Eigen::Vector3i m_dims = Eigen::Vector3i::Zero();
+					std::vector<std::uint32_t> m_cell_start;
+					std::vector<std::uint32_t> m_points;
+					bool empty() const { return m_points.empty(); }
+					void clear() { m_points.clear(); m_cell_start.clear(); }
+				};
+				mutable Grid m_grid;
+				mutable std::mutex m_grid_mutex;
+				const Grid& GetGrid() const;
+			};
+
+			inline void PointsRange::GetXYZ(std::vector<Point3D>& out) const
+			{
+				out.resize(m_indices.size());
+				for (std::size_t i = 0; i < m_indices.size(); i++) out[i] = m_cloud->m_xyz[m_indices[i]];
+			}
+			inline void PointsRange::SetXYZ(const std::vector<Point3D>& in)
+			{
+				for (std::size_t i = 0; i < m_indices.size() && i < in.size(); i++) m_cloud->m_xyz[m_indices[i]] = in[i];
+				m_cloud->m_grid.clear();
+			}
+			inline void PointsRange::GetColors(std::vector<Color>& out) const
+			{
+				out.resize(m_indices.size());
+				for (std::size_t i = 0; i < m_indices.size(); i++) out[i] = m_cloud->m_colors[m_indices[i]];
+			}
+			inline void PointsRange::SetColors(const std::vector<Color>& in)
+			{
+				for (std::size_t i = 0; i < m_indices.size() && i < in.size(); i++) m_cloud->m_colors[m_indices[i]] = in[i];
+			}
+			inline void PointsRange::GetStates(std::vector<State>& out) const
+			{
+				out.resize(m_indices.size());
+				for (std::size_t i = 0; i < m_indices.size(); i++) out[i] = m_cloud->m_states[m_indices[i]];
+			}
+			inline void PointsRange::SetStates(const std::vector<State>& in)
+			{
+				for (std::size_t i = 0; i < m_indices.size() && i < in.size(); i++) m_cloud->m_states[m_indices[i]] = in[i];
+			}
+			inline void PointsRange::GetNormals(std::vector<Normal>& out) const
+			{
+				out.resize(m_indices.size());
+				for (std::size_t i = 0; i < m_indices.size(); i++) out[i] = m_cloud->m_normals[m_indices[i]];
+			}
+			inline void PointsRange::GetLayerVals(std::vector<StoredReal>& out, const Layers::ILayer& layer) const
+			{
+				out.resize(m_indices.size());
+				for (std::size_t i = 0; i < m_indices.size(); i++) out[i] = layer.m_values[m_indices[i]];
+			}
+			inline void PointsRange::SetLayerVals(const std::vector<StoredReal>& in, Layers::ILayer& layer)
+			{
+				for (std::size_t i = 0; i < m_indices.size() && i < in.size(); i++) layer.m_values[m_indices[i]] = in[i];
+			}
+
+			// Iterable view over one per-point attribute of a range, with random access iterators
+			template <typename T, typename Getter>
+			class AttributeRange
+			{
+			public:
+				class iterator
+				{
+				public:
+					typedef std::random_access_iterator_tag iterator_category;
+					typedef typename std::remove_const<T>::type value_type;
+					typedef std::ptrdiff_t difference_type;
+					typedef T* pointer;
+					typedef T& reference;
+
+					iterator(const PointsRange* range, std::size_t pos, Getter getter) : m_range(range), m_pos(pos), m_getter(getter) {}
+					T& operator*() const { return m_getter(m_range->m_indices[m_pos]); }
+					T* operator->() const { return &m_getter(m_range->m_indices[m_pos]); }
+					iterator& operator++() { ++m_pos; return *this; }
+					iterator operator++(int) { iterator copy = *this; ++m_pos; return copy; }
+					iterator& operator--() { --m_pos; return *this; }
+					bool operator!=(const iterator& other) const { return m_pos != other.m_pos; }
+					bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+					bool operator<(const iterator& other) const { return m_pos < other.m_pos; }
+					iterator& operator+=(difference_type n) { m_pos += n; return *this; }
+					iterator operator+(difference_type n) const { iterator copy = *this; return copy += n; }
+					difference_type operator-(const iterator& other) const { return difference_type(m_pos) - difference_type(other.m_pos); }
+					T& operator[](difference_type n) const { return m_getter(m_range->m_indices[m_pos + n]); }
+				private:
+					const PointsRange* m_range;
+					std::size_t m_pos;
+					Getter m_getter;
+				};
+
+				AttributeRange(const PointsRange& range, Getter getter) : m_range(&range), m_getter(getter) {}
+				iterator begin() const { return iterator(m_range, 0, m_getter); }
+				iterator end() const { return iterator(m_range, m_range->size(), m_getter); }
+				std::size_t size() const { return m_range->size(); }
+
+			private:
+				const PointsRange* m_range;
+				Getter m_getter;
+			};
+
+			struct StateGetter { ICloud* c; State& operator()(std::uint32_t i) const { return c->m_states[i]; } };
+			struct XYZGetter { const ICloud* c; const Point3D& operator()(std::uint32_t i) const { return c->m_xyz[i]; } };
+			struct ColorGetter { const ICloud* c; const Color& operator()(std::uint32_t i) const { return c->m_colors[i]; } };
+			struct NormalGetter { const ICloud* c; const Normal& operator()(std::uint32_t i) const { return c->m_normals[i]; } };
+			struct LayerGetter { Layers::ILayer* l; StoredReal& operator()(std::uint32_t i) const { return l->m_values[i]; } };
+
+			inline AttributeRange<State, StateGetter> RangeState(const PointsRange& range) { return AttributeRange<State, StateGetter>(range, StateGetter{ range.m_cloud }); }
+			inline AttributeRange<const Point3D, XYZGetter> RangeLocalXYZConst(const PointsRange& range) { return AttributeRange<const Point3D, XYZGetter>(range, XYZGetter{ range.m_cloud }); }
+			inline AttributeRange<const Color, ColorGetter> RangeColorConst(const PointsRange& range) { return AttributeRange<const Color, ColorGetter>(range, ColorGetter{ range.m_cloud }); }
+			inline AttributeRange<const Normal, NormalGetter> RangeLocalNormalConst(const PointsRange& range) { return AttributeRange<const Normal, NormalGetter>(range, NormalGetter{ range.m_cloud }); }
+			inline AttributeRange<StoredReal, LayerGetter> RangeLayer(const PointsRange& range, Layers::ILayer& layer) { return AttributeRange<StoredReal, LayerGetter>(range, LayerGetter{ &layer }); }
+
+			inline const ICloud::Grid& ICloud::GetGrid() const
+			{
+				std::lock_guard<std::mutex> lock(m_grid_mutex);
+				if (!m_grid.empty() || m_xyz.empty()) return m_grid;
+				Eigen::Vector3f lo = m_xyz[0], hi = m_xyz[0];
+				for (auto& p : m_xyz) { lo = lo.cwiseMin(p); hi = hi.cwiseMax(p); }
+				Eigen::Vector3f extent = (hi - lo).cwiseMax(Eigen::Vector3f::Constant(1e-3f));
+				// about four points per cell on average
+				double volume = double(extent.x()) * extent.y() * extent.z();
+				float cell = float(std::cbrt(volume * 4.0 / double(m_xyz.size())));
+				cell = std::max(cell, std::max(extent.maxCoeff() / 1024.0f, 1e-3f));
+				m_grid.m_cell = cell;
+				m_grid.m_origin = lo;
+				for (int a = 0; a < 3; a++) m_grid.m_dims[a] = int(extent[a] / cell) + 1;
+				std::size_t cells = std::size_t(m_grid.m_dims.x()) * m_grid.m_dims.y() * m_grid.m_dims.z();
+				std::vector<std::uint32_t> cell_of(m_xyz.size());
+				m_grid.m_cell_start.assign(cells + 1, 0);
+				for (std::size_t i = 0; i < m_xyz.size(); i++)
+				{
+					Eigen::Vector3i c = ((m_xyz[i] - lo) / cell).cast<int>().cwiseMin(m_grid.m_dims - Eigen::Vector3i::Ones());
+					cell_of[i] = std::uint32_t((std::size_t(c.z()) * m_grid.m_dims.y() + c.y()) * m_grid.m_dims.x() + c.x());
+					m_grid.m_cell_start[cell_of[i] + 1]++;
+				}
+				for (std::size_t c = 0; c < cells; c++) m_grid.m_cell_start[c + 1] += m_grid.m_cell_start[c];
+				std::vector<std::uint32_t> cursor(m_grid.m_cell_start.begin(), m_grid.m_cell_start.end() - 1);
+				m_grid.m_points.resize(m_xyz.size());
+				for (std::size_t i = 0; i < m_xyz.size(); i++) m_grid.m_points[cursor[cell_of[i]]++] = std::uint32_t(i);
+				return m_grid;
+			}
+
+			// Visits grid cells in growing cubic shells around the query point
+			template <typename Visitor>
+			inline void VisitShell(const ICloud::Grid& grid, const Eigen::Vector3i& center, int ring, Visitor visit)
+			{
+				for (int z = center.z() - ring; z <= center.z() + ring; z++)
+					for (int y = center.y() - ring; y <= center.y() + ring; y++)
+						for (int x = center.x() - ring; x <= center.x() + ring; x++)
+						{
+							if (std::max(std::abs(x - center.x()), std::max(std::abs(y - center.y()), std::abs(z - center.z()))) != ring) continue;
+							if (x < 0 || y < 0 || z < 0 || x >= grid.m_dims.x() || y >= grid.m_dims.y() || z >= grid.m_dims.z()) continue;
+							std::size_t c = (std::size_t(z) * grid.m_dims.y() + y) * grid.m_dims.x() + x;
+							for (std::uint32_t k = grid.m_cell_start[c]; k < grid.m_cell_start[c + 1]; k++) visit(grid.m_points[k]);
+						}
+			}
+
+			inline Eigen::Vector3i GridCell(const ICloud::Grid& grid, const Eigen::Vector3f& p)
+			{
+				return ((p - grid.m_origin) / grid.m_cell).array().floor().cast<int>().matrix();
+			}
+		}
+
+		namespace Nodes
+		{
+			class IElement
+			{
+			public:
+				IElement() : m_id(NextResourceID()) {}
+				void Rename(const String& name) { m_name = name; }
+				const String& GetName() const { return m_name; }
+				ResourceID GetID() const { return m_id; }
+				template <typename T> T* GetData() { return dynamic_cast<T*>(m_data.get()); }
+
+				ResourceID m_id;
+				String m_name;
+				std::shared_ptr<Clouds::ICloud> m_data;
+			};
+
+			class ITransTreeNode
+			{
+			public:
+				ITransTreeNode() : m_id(NextResourceID()), m_element(nullptr), m_parent(nullptr) {}
+				ResourceID GetID() const { return m_id; }
+				void Rename(const String& name) { m_name = name; }
+				const String& GetName() const { return m_name; }
+				void SetElement(IElement* element) { m_element = element; }
+				IElement* GetElement() const { return m_element; }
+				ITransTreeNode* GetParent() const { return m_parent; }
+				ITransTreeNode* CreateChild()
+				{
+					m_children.emplace_back(new ITransTreeNode());
+					m_children.back()->m_parent = this;
+					return m_children.back().get();
+				}
+
+				ResourceID m_id;
+				String m_name;
+				IElement* m_element;
+				ITransTreeNode* m_parent;
+				std::vector<std::unique_ptr<ITransTreeNode>> m_children;
+			};
+		}
+
+		namespace Clouds
+		{
+			// Calls the function for every cloud held by the node and its descendants
+			template <typename Function>
+			inline void ForEachCloud(Nodes::ITransTreeNode& node, Function function)
+			{
+				std::vector<std::pair<ICloud*, Nodes::ITransTreeNode*>> clouds;
+				std::function<void(Nodes::ITransTreeNode&)> collect = [&](Nodes::ITransTreeNode& n)
+				{
+					if (n.GetElement())
+						if (ICloud* cloud = n.GetElement()->GetData<ICloud>()) clouds.push_back(std::make_pair(cloud, &n));
+					for (auto& child : n.m_children) collect(*child);
+				};
+				collect(node);
+				for (auto& entry : clouds) function(*entry.first, *entry.second);
+			}
+		}
+	}
+
+	namespace Execution
+	{
+		// Loosely typed algorithm parameter value
+		struct ParameterValue
+		{
+			double m_number = 0;
+			Data::ResourceID m_id;
+			String m_text;
+
+			ParameterValue& operator=(double v) { m_number = v; return *this; }
+			ParameterValue& operator=(float v) { m_number = v; return *this; }
+			ParameterValue& operator=(int v) { m_number = v; return *this; }
+			ParameterValue& operator=(bool v) { m_number = v ? 1 : 0; return *this; }
+			ParameterValue& operator=(const Data::ResourceID& v) { m_id = v; return *this; }
+			ParameterValue& operator=(const String& v) { m_text = v; return *this; }
+			ParameterValue& operator=(const wchar_t* v) { m_text = v; return *this; }
+		};
+
+		typedef std::map<String, ParameterValue> Parameters;
+
+		class IProject
+		{
+		public:
+			IProject() : m_root(new Data::Nodes::ITransTreeNode()) {}
+
+			Data::Nodes::ITransTreeNode* TransTreeFindNode(const Data::ResourceID& id)
+			{
+				std::function<Data::Nodes::ITransTreeNode*(Data::Nodes::ITransTreeNode&)> find = [&](Data::Nodes::ITransTreeNode& n) -> Data::Nodes::ITransTreeNode*
+				{
+					if (n.GetID() == id) return &n;
+					for (auto& child : n.m_children)
+						if (auto found = find(*child)) return found;
+					return nullptr;
+				};
+				return find(*m_root);
+			}
+
+			template <typename T>
+			Data::Nodes::IElement* ElementCreate()
+			{
+				m_elements.emplace_back(new Data::Nodes::IElement());
+				m_elements.back()->m_data = std::make_shared<T>();
+				return m_elements.back().get();
+			}
+
+			// Removes the element and its data, it must not be attached to a node any more
+			void ElementRemove(const Data::ResourceID& id)
+			{
+				for (auto element = m_elements.begin(); element != m_elements.end(); ++element)
+				{
+					if ((*element)->GetID() != id) continue;
+					m_elements.erase(element);
+					return;
+				}
+			}
+
+			std::unique_ptr<Data::Nodes::ITransTreeNode> m_root;
+			std::vector<std::unique_ptr<Data::Nodes::IElement>> m_elements;
+		};
+
+		class Context;
+
+		// Registry of algorithms reachable through ExecuteAlgorithmSync
+		class Executor
+		{
+		public:
+			typedef std::function<void(Context&, Parameters&)> Algorithm;
+
+			explicit Executor(Context& context) : m_context(context) {}
+			void Register(const String& name, Algorithm algorithm) { m_algorithms[name] = algorithm; }
+			bool ExecuteAlgorithmSync(const String& name, Parameters& parameters)
+			{
+				auto found = m_algorithms.find(name);
+				if (found == m_algorithms.end()) throw std::runtime_error("unknown algorithm");
+				found->second(m_context, parameters);
+				return true;
+			}
+
+		private:
+			Context& m_context;
+			std::map<String, Algorithm> m_algorithms;
+		};
+
+		// Point the host view is focused on. Not a plain vector: the plugins read it without using it, like a scope.
+		struct FocusPoint : Math::Point3D
+		{
+			FocusPoint() : Math::Point3D(Math::Point3D::Zero()) {}
+			~FocusPoint() {}
+		};
+
+		class Feedback
+		{
+		public:
+			FocusPoint GetFocusPoint() const { return FocusPoint(); }
+		};
+
+		class Context
+		{
+		public:
+			Context() : m_project(&m_project_storage), m_executor(*this) {}
+
+			IProject& Project() { return *m_project; }
+			Executor& Execution() { return m_executor; }
+			ogx::Execution::Feedback& Feedback() { return m_feedback; }
+
+			IProject* m_project;
+
+		private:
+			IProject m_project_storage;
+			Executor m_executor;
+			ogx::Execution::Feedback m_feedback;
+		};
+	}
+
+	namespace Plugin
+	{
+		// Parameter registered by a method, settable by name from the outside
+		class ParameterDef
+		{
+		public:
+			ParameterDef& Min(double value) { m_min = value; return *this; }
+			ParameterDef& Max(double value) { m_max = value; return *this; }
+			ParameterDef& AsNode() { return *this; }
+
+			double m_min = -1e300, m_max = 1e300;
+			std::function<void(double)> m_set_number;
+			std::function<void(const Data::ResourceID&)> m_set_id;
+			std::function<void(const String&)> m_set_text;
+		};
+
+		class ParameterBank
+		{
+		public:
+			ParameterDef& Add(const String& name, int& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_number = [&value](double v) { value = int(v); }; return d; }
+			ParameterDef& Add(const String& name, double& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_number = [&value](double v) { value = v; }; return d; }
+			ParameterDef& Add(const String& name, float& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_number = [&value](double v) { value = float(v); }; return d; }
+			ParameterDef& Add(const String& name, bool& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_number = [&value](double v) { value = v != 0; }; return d; }
+			ParameterDef& Add(const String& name, String& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_text = [&value](const String& v) { value = v; }; return d; }
+			ParameterDef& Add(const String& name, Data::ResourceID& value, const String& = String()) { auto& d = m_defs[name]; d.m_set_id = [&value](const Data::ResourceID& v) { value = v; }; return d; }
+
+			void Set(const String& name, double value)
+			{
+				auto& d = Find(name);
+				if (!d.m_set_number) throw std::runtime_error("parameter is not numeric");
+				d.m_set_number(std::min(std::max(value, d.m_min), d.m_max));
+			}
+			void Set(const String& name, const Data::ResourceID& value) { auto& d = Find(name); if (d.m_set_id) d.m_set_id(value); }
+			void Set(const String& name, const String& value) { auto& d = Find(name); if (d.m_set_text) d.m_set_text(value); }
+
+		private:
+			ParameterDef& Find(const String& name)
+			{
+				auto found = m_defs.find(name);
+				if (found == m_defs.end()) throw std::runtime_error("unknown parameter");
+				return found->second;
+			}
+			std::map<String, ParameterDef> m_defs;
+		};
+
+		class EasyMethod
+		{
+		public:
+			typedef Execution::Context Context;
+			typedef Plugin::ParameterBank ParameterBank;
+
+			EasyMethod(const String& author, const String& name) : m_author(author), m_name(name) {}
+			virtual ~EasyMethod() {}
+
+			virtual void DefineParameters(ParameterBank& bank) = 0;
+			virtual bool Init(Execution::Context&) { return true; }
+			virtual void Run(Context& context) = 0;
+
+			void ReportError(const String& message)
+			{
+				throw std::runtime_error(std::string(message.begin(), message.end()));
+			}
+
+			const String& GetName() const { return m_name; }
+
+		private:
+			String m_author, m_name;
+		};
+
+		// Methods exported by the plugins, looked up by class name
+		inline std::map<std::string, std::function<std::unique_ptr<EasyMethod>()>>& MethodRegistry()
+		{
+			static std::map<std::string, std::function<std::unique_ptr<EasyMethod>()>> registry;
+			return registry;
+		}
+
+		struct MethodRegistrar
+		{
+			MethodRegistrar(const char* name, std::function<std::unique_ptr<EasyMethod>()> factory) { MethodRegistry()[name] = factory; }
+		};
+	}
+}
+
+#define OGX_SCOPE(name) ogx::Log name
+#define OGX_LINE ogx::Log()
+#define OGX_EXPORT_METHOD(Method) \
+	static ogx::Plugin::MethodRegistrar s_register_##Method(#Method, [] { return std::unique_ptr<ogx::Plugin::EasyMethod>(new Method()); });
@@ -0,0 +1,92 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Seeded generator of synthetic terrain-like clouds for the benchmark: hills with snow on the tops,
+vegetation, light bare ground and flat roads. Every point depends only on the seed and its index,
+so the same cloud is generated on any machine and with any number of threads.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ThreadPool.h"
+
+struct TerrainSettings
+{
+	std::uint64_t seed = 1;
+	double density = 100;			// points per square meter
+	double road_spacing = 60;		// distance between parallel roads
+	double road_width = 6;
+	double snow_height = 10;		// snow lies above this height
+};
+
+// Counter based random numbers - value k of point i, uniform in [0, 1)
+inline double TerrainRandom(std::uint64_t seed, std::uint64_t i, int k)
+{
+	std::uint64_t z = seed + i * 0x9e3779b97f4a7c15ULL + std::uint64_t(k) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return double(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+inline double TerrainHeight(double x, double y)
+{
+	return 12 * std::sin(x / 45) * std::cos(y / 60) + 5 * std::sin((x + y) / 23);
+}
+
+// Fills xyz (points[i][0..2]) and colors (colors[i][0..3]) of 'count' points
+template <typename Points, typename Colors>
+inline void GenerateTerrain(const TerrainSettings& settings, std::size_t count, Points& points, Colors& colors)
+{
+	const double side = std::sqrt(double(count) / settings.density);
+	ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+	{
+		for (std::size_t i = begin; i < end; i++)
+		{
+			double x = TerrainRandom(settings.seed, i, 0) * side;
+			double y = TerrainRandom(settings.seed, i, 1) * side;
+			double noise = TerrainRandom(settings.seed, i, 2);
+			double shade = TerrainRandom(settings.seed, i, 3) * 20 - 10;
+			double z = TerrainHeight(x, y);
+			int r, g, b;
+
+			double road_center = (std::floor(y / settings.road_spacing) + 0.5) * settings.road_spacing;
+			if (std::fabs(y - road_center) < settings.road_width / 2)
+			{
+				// flat across the road, violet asphalt (hue about 280)
+				z = TerrainHeight(x, road_center) + 0.01 * noise;
+				r = 120; g = 95; b = 135;
+			}
+			else if (z > settings.snow_height)
+			{
+				z += 0.05 * noise;
+				r = g = b = 245;
+			}
+			else if (std::sin(x / 17) * std::sin(y / 13) > 0)
+			{
+				// rough vegetation cover
+				z += 0.4 * noise;
+				r = 50; g = 120; b = 45;
+			}
+			else
+			{
+				z += 0.03 * noise;
+				r = 190; g = 170; b = 150;
+			}
+
+			points[i][0] = float(x);
+			points[i][1] = float(y);
+			points[i][2] = float(z);
+			int s = int(shade);
+			colors[i][0] = std::uint8_t(std::min(std::max(r + s, 0), 255));
+			colors[i][1] = std::uint8_t(std::min(std::max(g + s, 0), 255));
+			colors[i][2] = std::uint8_t(std::min(std::max(b + s, 0), 255));
+			colors[i][3] = 255;
+		}
+	});
+}
@@ -0,0 +1,46 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Snow / vegetation / roads classes of AreasDetection and the counts of the points in every class.
+Points are classified by the rules of ClassificationRules.h.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+enum FeatureClass
+{
+	FEATURE_NONE = 0,
+	FEATURE_SNOW,
+	FEATURE_VEGETATION,
+	FEATURE_ROADS,
+	FEATURE_CLASS_COUNT
+};
+
+// Value written to the "features" layer for every class (displayed as red, green, blue, violet)
+inline float FeatureLayerValue(int feature_class)
+{
+	static const float values[FEATURE_CLASS_COUNT] = { 0.0f, 300.0f, 150.0f, 101.0f };
+	return values[feature_class];
+}
+
+// Number of counted points in every class, plus all counted points
+struct FeatureCounts
+{
+	std::size_t points[FEATURE_CLASS_COUNT];
+	std::size_t total;
+};
+
+inline FeatureCounts ZeroFeatureCounts()
+{
+	FeatureCounts counts = {};
+	return counts;
+}
+
+inline FeatureCounts AddFeatureCounts(const FeatureCounts& a, const FeatureCounts& b)
+{
+	FeatureCounts sum;
+	for (int c = 0; c < FEATURE_CLASS_COUNT; c++) sum.points[c] = a.points[c] + b.points[c];
+	sum.total = a.total + b.total;
+	return sum;
+}
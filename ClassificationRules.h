@@ -0,0 +1,622 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+User-defined classification rules of AreasDetection, e.g.
+	snow: L >= 0.7; vegetation: L >= 0.2 and L <= 0.6 and H < 200; roads: H >= 275 and height <= 3.7 and plane_error < 0.065
+Rules are tried in order, a point gets the class of the first rule it satisfies (none if there is no such rule).
+A rule is a class (none, snow, vegetation, roads), ':' and a condition - comparisons of H (degrees), S, L (0 - 1),
+z, height (above the ground raster), intensity (0 - 255) or plane_error with a number joined by and, or, not and
+parentheses; z may also be compared with 'mean' (the mean height) plus or minus a number. Rules are separated by ';'
+or new lines.
+The rules are compiled once into a postfix program run over blocks of points: every instruction handles the whole
+block in a tight loop (comparisons of one channel, masks combined byte by byte), so there is one dispatch per block
+and instruction instead of one per point. Like a short-circuit evaluation, a condition is evaluated only
+for the points it can still decide and skipped in blocks without such points. L is compared as its 16-bit code,
+H as its code when the codes split exactly like the float hues (< and >= a multiple of 1 / 182 degree, e.g. any whole
+degree), other hue comparisons use the float hue computed for the block.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Classification.h"
+#include "ColorKernels.h"
+#include "ColumnViews.h"
+#include "GroundRaster.h"
+#include "QuantizedChannels.h"
+#include "ThreadPool.h"
+
+// Default rules: snow by lightness, vegetation and roads by hue within a lightness range, roads also by the height
+// above the ground raster and the plane fitting error (RMS distance, see PlaneFittingErrors)
+const wchar_t* const DEFAULT_FEATURE_RULES =
+	L"snow: L >= 0.7; "
+	L"vegetation: L >= 0.2 and L <= 0.6 and H < 200; "
+	L"roads: L >= 0.2 and L <= 0.6 and H >= 275 and height <= 3.7 and plane_error < 0.065";
+
+enum RuleVariable
+{
+	RULE_H = 0,
+	RULE_S,
+	RULE_L,
+	RULE_Z,
+	RULE_INTENSITY,
+	RULE_PLANE_ERROR,
+	RULE_HEIGHT,			// z above the ground raster
+	RULE_VARIABLE_COUNT
+};
+
+// Channels the rules read. H and L are codes (HueCode, LightnessCode), S, intensity and the float hue are computed
+// from the colors of the points that need them; colors may be null if no rule uses S or intensity, x, y and the ground if no rule uses height.
+struct RuleInputs
+{
+	const std::uint16_t* H;
+	const std::uint16_t* L;
+	const std::uint8_t* colors;
+	std::size_t color_stride;		// bytes
+	ChannelView plane_error, z;
+	ChannelView x, y;
+	const GroundRaster* ground;
+	std::size_t count;
+	double mean_height;
+};
+
+enum RuleOpcode
+{
+	RULE_COMPARE,		// mask of a comparison
+	RULE_AND,			// conjunction of the two preceding conditions
+	RULE_OR,
+	RULE_NOT,			// negation of the preceding condition
+	RULE_EMIT			// points of the preceding condition without a class yet get the class of the rule
+};
+
+enum RuleComparison
+{
+	RULE_LESS,
+	RULE_LESS_EQUAL,
+	RULE_GREATER,
+	RULE_GREATER_EQUAL,
+	RULE_EQUAL,
+	RULE_NOT_EQUAL
+};
+
+struct RuleInstruction
+{
+	RuleOpcode opcode;
+	RuleVariable variable;			// of a comparison
+	RuleComparison comparison;
+	double threshold;
+	bool coded;						// threshold is a code of H or L
+	bool above_mean;				// threshold is added to the mean height
+	int feature_class;				// of RULE_EMIT
+};
+
+// Points classified by one pass of the program
+const std::size_t RULE_BLOCK = 256;
+
+// Operators above a comparison in a condition, deeper conditions are rejected by Compile
+const int RULE_NESTING_DEPTH = 32;
+
+class FeatureRules
+{
+public:
+	FeatureRules() : m_float_hue(false)
+	{
+		for (int v = 0; v < RULE_VARIABLE_COUNT; v++) m_uses[v] = false;
+	}
+
+	// Compiles the rule text, on failure the program is left empty and 'error' describes the problem
+	bool Compile(const std::wstring& text, std::wstring& error)
+	{
+		m_program.clear();
+		m_start.clear();
+		m_open.clear();
+		for (int v = 0; v < RULE_VARIABLE_COUNT; v++) m_uses[v] = false;
+		m_float_hue = false;
+		m_text = text;
+		m_position = 0;
+		m_error.clear();
+		Next();
+		while (m_error.empty() && m_token != TOKEN_END)
+		{
+			if (m_token == TOKEN_SEPARATOR)
+			{
+				Next();
+				continue;
+			}
+			ParseRule();
+		}
+		error = m_error;
+		if (!m_error.empty())
+		{
+			m_program.clear();
+			m_start.clear();
+		}
+		return m_error.empty();
+	}
+
+	bool Uses(RuleVariable variable) const { return m_uses[variable]; }
+
+	// Classes of the points [begin, begin + count), count <= RULE_BLOCK
+	void ClassifyBlock(const RuleInputs& in, std::size_t begin, std::size_t count, std::uint8_t* classes) const
+	{
+		// S, intensity and the float hue used by the rules, H and L codes are read in place, z and the plane fitting error by Compare
+		float channel[RULE_VARIABLE_COUNT][RULE_BLOCK];
+		if (m_uses[RULE_S] || m_float_hue)
+		{
+			RgbToHslChannels(in.colors + begin * in.color_stride, in.color_stride, count, m_float_hue ? channel[RULE_H] : nullptr,
+				m_uses[RULE_S] ? channel[RULE_S] : nullptr, nullptr);
+		}
+		if (m_uses[RULE_INTENSITY])
+		{
+			for (std::size_t i = 0; i < count; i++) channel[RULE_INTENSITY][i] = IntensityOfSum(IntensitySumOf(in.colors + (begin + i) * in.color_stride));
+		}
+
+		// every rule is evaluated only for the points without a class yet
+		std::uint8_t unassigned[RULE_BLOCK], mask[RULE_BLOCK];
+		for (std::size_t i = 0; i < count; i++)
+		{
+			unassigned[i] = 1;
+			classes[i] = FEATURE_NONE;
+		}
+		for (std::size_t k = 0; k < m_program.size(); k++)
+		{
+			if (m_program[k].opcode != RULE_EMIT) continue;
+			Evaluate(k - 1, in, channel, begin, count, unassigned, mask);
+			// the mask lies within the unassigned points, classes of the earlier rules are kept
+			const std::uint8_t feature_class = std::uint8_t(m_program[k].feature_class);
+			for (std::size_t i = 0; i < count; i++)
+			{
+				classes[i] = std::uint8_t(classes[i] | (mask[i] * feature_class));
+				unassigned[i] &= mask[i] ^ 1;
+			}
+		}
+	}
+
+	// Values of a float channel covering every outcome of its comparisons: the thresholds, the floats next to them,
+	// values between them and both extremes. A class that is the same for all of them does not depend on the channel.
+	std::vector<float> ProbeValues(RuleVariable variable, double mean_height) const
+	{
+		std::vector<float> thresholds;
+		for (const RuleInstruction& instruction : m_program)
+		{
+			if (instruction.opcode == RULE_COMPARE && instruction.variable == variable)
+			{
+				thresholds.push_back(float(instruction.threshold + (instruction.above_mean ? mean_height : 0)));
+			}
+		}
+		std::sort(thresholds.begin(), thresholds.end());
+		std::vector<float> probes = { -FLT_MAX, FLT_MAX };
+		for (std::size_t k = 0; k < thresholds.size(); k++)
+		{
+			probes.push_back(std::nextafter(thresholds[k], -FLT_MAX));
+			probes.push_back(thresholds[k]);
+			probes.push_back(std::nextafter(thresholds[k], FLT_MAX));
+			if (k + 1 < thresholds.size()) probes.push_back(thresholds[k] + (thresholds[k + 1] - thresholds[k]) / 2);
+		}
+		return probes;
+	}
+
+private:
+	enum Token
+	{
+		TOKEN_END,
+		TOKEN_SEPARATOR,		// ';' or a new line
+		TOKEN_NAME,
+		TOKEN_NUMBER,
+		TOKEN_SYMBOL			// operator or punctuation
+	};
+
+	// Mask of the condition ending at instruction 'last' for the 'needed' points, zero for the others. The second operand
+	// of a conjunction or alternative is evaluated only where it can change the result, so a block where no point
+	// needs it does not read its channel at all.
+	void Evaluate(std::size_t last, const RuleInputs& in, const float (*channel)[RULE_BLOCK], std::size_t begin, std::size_t count,
+		const std::uint8_t* needed, std::uint8_t* mask) const
+	{
+		if (count == 0) return;		// also shows the compiler that the blocks below are written before they are read
+		if (!std::memchr(needed, 1, count))
+		{
+			for (std::size_t i = 0; i < count; i++) mask[i] = 0;
+			return;
+		}
+		const RuleInstruction& instruction = m_program[last];
+		std::uint8_t operand[RULE_BLOCK], rest[RULE_BLOCK];
+		switch (instruction.opcode)
+		{
+		case RULE_COMPARE:
+			Compare(instruction, in, channel, begin, count, needed, mask);
+			break;
+		case RULE_AND:
+			Evaluate(m_start[last - 1] - 1, in, channel, begin, count, needed, operand);
+			Evaluate(last - 1, in, channel, begin, count, operand, mask);
+			break;
+		case RULE_OR:
+			Evaluate(m_start[last - 1] - 1, in, channel, begin, count, needed, operand);
+			for (std::size_t i = 0; i < count; i++) rest[i] = needed[i] & (operand[i] ^ 1);
+			Evaluate(last - 1, in, channel, begin, count, rest, mask);
+			for (std::size_t i = 0; i < count; i++) mask[i] |= operand[i];
+			break;
+		case RULE_NOT:
+			Evaluate(last - 1, in, channel, begin, count, needed, operand);
+			for (std::size_t i = 0; i < count; i++) mask[i] = needed[i] & (operand[i] ^ 1);
+			break;
+		case RULE_EMIT:
+			break;
+		}
+	}
+
+	void Compare(const RuleInstruction& instruction, const RuleInputs& in, const float (*channel)[RULE_BLOCK], std::size_t begin,
+		std::size_t count, const std::uint8_t* needed, std::uint8_t* mask) const
+	{
+		const double threshold = instruction.threshold + (instruction.above_mean ? in.mean_height : 0);
+		switch (instruction.variable)
+		{
+		case RULE_H:
+			if (instruction.coded) CompareBlock(in.H + begin, count, instruction.comparison, threshold, mask);
+			else CompareBlock(channel[RULE_H], 1, count, instruction.comparison, threshold, mask);
+			break;
+		case RULE_L: CompareBlock(in.L + begin, count, instruction.comparison, threshold, mask); break;
+		case RULE_Z: case RULE_PLANE_ERROR:
+		{
+			// read in place, only for blocks with points needing them
+			const ChannelView& view = instruction.variable == RULE_Z ? in.z : in.plane_error;
+			CompareBlock(view.data + begin * view.stride, view.stride, count, instruction.comparison, threshold, mask);
+			break;
+		}
+		case RULE_HEIGHT:
+		{
+			// one raster cell per point, only for blocks with points needing it
+			float height[RULE_BLOCK];
+			for (std::size_t i = begin; i < begin + count; i++) height[i - begin] = float(double(in.z[i]) - in.ground->GroundAt(in.x[i], in.y[i]));
+			CompareBlock(height, 1, count, instruction.comparison, threshold, mask);
+			break;
+		}
+		default: CompareBlock(channel[instruction.variable], 1, count, instruction.comparison, threshold, mask); break;
+		}
+		for (std::size_t i = 0; i < count; i++) mask[i] &= needed[i];
+	}
+
+	// Values every 'stride' elements, a contiguous channel gets its own loops so they are vectorized
+	template <typename Value>
+	static void CompareValues(const Value* values, std::size_t stride, std::size_t count, RuleComparison comparison, Value threshold, std::uint8_t* mask)
+	{
+		if (stride == 1) CompareStrided(values, std::integral_constant<std::size_t, 1>(), count, comparison, threshold, mask);
+		else CompareStrided(values, stride, count, comparison, threshold, mask);
+	}
+
+	template <typename Value, typename Stride>
+	static void CompareStrided(const Value* values, Stride stride, std::size_t count, RuleComparison comparison, Value threshold, std::uint8_t* mask)
+	{
+		switch (comparison)
+		{
+		case RULE_LESS: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] < threshold; break;
+		case RULE_LESS_EQUAL: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] <= threshold; break;
+		case RULE_GREATER: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] > threshold; break;
+		case RULE_GREATER_EQUAL: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] >= threshold; break;
+		case RULE_EQUAL: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] == threshold; break;
+		case RULE_NOT_EQUAL: for (std::size_t i = 0; i < count; i++) mask[i] = values[i * stride] != threshold; break;
+		}
+	}
+
+	// Codes against an integer threshold, a threshold outside the codes gives the same masks as any other beyond them
+	static void CompareBlock(const std::uint16_t* codes, std::size_t count, RuleComparison comparison, double threshold, std::uint8_t* mask)
+	{
+		std::int32_t code = std::int32_t(std::max(-1.0, std::min(65536.0, threshold)));
+		if (code < 0 || code > 65535)
+		{
+			// never equal, every code on one side
+			bool below = code < 0;
+			bool all = comparison == RULE_NOT_EQUAL || (below ? comparison == RULE_GREATER || comparison == RULE_GREATER_EQUAL : comparison == RULE_LESS || comparison == RULE_LESS_EQUAL);
+			for (std::size_t i = 0; i < count; i++) mask[i] = all;
+			return;
+		}
+		CompareValues(codes, 1, count, comparison, std::uint16_t(code), mask);
+	}
+
+	// Floats against a double threshold, compared in float with the nearest float on the right side of it,
+	// which gives the same results as comparing in double
+	static void CompareBlock(const float* values, std::size_t stride, std::size_t count, RuleComparison comparison, double threshold, std::uint8_t* mask)
+	{
+		float below = float(threshold), above = below;		// largest float <= threshold, smallest float >= threshold
+		if (double(below) > threshold) below = std::nextafter(below, -FLT_MAX);
+		if (double(above) < threshold) above = std::nextafter(above, FLT_MAX);
+		switch (comparison)
+		{
+		case RULE_LESS: case RULE_GREATER_EQUAL: CompareValues(values, stride, count, comparison, above, mask); break;
+		case RULE_LESS_EQUAL: case RULE_GREATER: CompareValues(values, stride, count, comparison, below, mask); break;
+		default:
+			if (below == above) CompareValues(values, stride, count, comparison, below, mask);
+			else for (std::size_t i = 0; i < count; i++) mask[i] = comparison == RULE_NOT_EQUAL;
+			break;
+		}
+	}
+
+	void Fail(const std::wstring& message)
+	{
+		if (m_error.empty()) m_error = message + L" at character " + std::to_wstring(m_token_start + 1);
+		m_token = TOKEN_END;
+	}
+
+	void Next()
+	{
+		while (m_position < m_text.size() && (m_text[m_position] == L' ' || m_text[m_position] == L'\t' || m_text[m_position] == L'\r')) m_position++;
+		m_token_start = m_position;
+		m_name.clear();
+		if (m_position == m_text.size())
+		{
+			m_token = TOKEN_END;
+			return;
+		}
+		wchar_t c = m_text[m_position];
+		if (c == L';' || c == L'\n')
+		{
+			m_position++;
+			m_token = TOKEN_SEPARATOR;
+		}
+		else if (std::iswalpha(c) || c == L'_')
+		{
+			while (m_position < m_text.size() && (std::iswalnum(m_text[m_position]) || m_text[m_position] == L'_'))
+			{
+				m_name += wchar_t(std::towlower(m_text[m_position++]));
+			}
+			m_token = TOKEN_NAME;
+		}
+		else if (std::iswdigit(c) || c == L'.')
+		{
+			wchar_t* end = nullptr;
+			m_number = std::wcstod(m_text.c_str() + m_position, &end);
+			m_position = std::size_t(end - m_text.c_str());
+			m_token = TOKEN_NUMBER;
+			if (m_position == m_token_start) Fail(L"invalid number");
+		}
+		else
+		{
+			static const wchar_t* const symbols[] = { L"<=", L">=", L"==", L"!=", L"&&", L"||", L"<", L">", L"!", L"(", L")", L":", L"+", L"-" };
+			for (const wchar_t* symbol : symbols)
+			{
+				std::size_t length = std::wcslen(symbol);
+				if (m_text.compare(m_position, length, symbol) == 0)
+				{
+					m_name = symbol;
+					m_position += length;
+					m_token = TOKEN_SYMBOL;
+					return;
+				}
+			}
+			Fail(std::wstring(L"unexpected '") + c + L"'");
+		}
+	}
+
+	bool Accept(const wchar_t* name)
+	{
+		if ((m_token != TOKEN_NAME && m_token != TOKEN_SYMBOL) || m_name != name) return false;
+		Next();
+		return true;
+	}
+
+	// Appends an instruction, keeping the first instruction and the depth of the conditions not consumed yet
+	void Emit(RuleInstruction instruction)
+	{
+		if (!m_error.empty()) return;
+		const std::size_t k = m_program.size();
+		OpenCondition condition = { k, 0 };
+		switch (instruction.opcode)
+		{
+		case RULE_COMPARE:
+			break;
+		case RULE_AND: case RULE_OR:
+			condition.depth = std::max(m_open[m_open.size() - 2].depth, m_open.back().depth) + 1;
+			condition.start = m_open[m_open.size() - 2].start;
+			m_open.pop_back();
+			m_open.pop_back();
+			break;
+		case RULE_NOT: case RULE_EMIT:
+			condition.depth = m_open.back().depth + 1;
+			condition.start = m_open.back().start;
+			m_open.pop_back();
+			break;
+		}
+		if (condition.depth > RULE_NESTING_DEPTH) Fail(L"condition nested too deeply");
+		if (instruction.opcode != RULE_EMIT) m_open.push_back(condition);
+		m_program.push_back(instruction);
+		m_start.push_back(condition.start);
+	}
+
+	static RuleInstruction Operation(RuleOpcode opcode)
+	{
+		RuleInstruction instruction = { opcode, RULE_H, RULE_LESS, 0, false, false, FEATURE_NONE };
+		return instruction;
+	}
+
+	// class ':' condition
+	void ParseRule()
+	{
+		static const wchar_t* const class_names[FEATURE_CLASS_COUNT] = { L"none", L"snow", L"vegetation", L"roads" };
+		int feature_class = -1;
+		for (int c = 0; c < FEATURE_CLASS_COUNT; c++)
+		{
+			if (m_token == TOKEN_NAME && m_name == class_names[c]) feature_class = c;
+		}
+		if (feature_class < 0) return Fail(L"expected a class (none, snow, vegetation or roads)");
+		Next();
+		if (!Accept(L":")) return Fail(L"expected ':'");
+		ParseOr();
+		RuleInstruction emit = Operation(RULE_EMIT);
+		emit.feature_class = feature_class;
+		Emit(emit);
+		if (m_token != TOKEN_SEPARATOR && m_token != TOKEN_END) Fail(L"expected ';' or the end of the rule");
+	}
+
+	void ParseOr()
+	{
+		ParseAnd();
+		while (Accept(L"or") || Accept(L"||"))
+		{
+			ParseAnd();
+			Emit(Operation(RULE_OR));
+		}
+	}
+
+	void ParseAnd()
+	{
+		ParseNot();
+		while (Accept(L"and") || Accept(L"&&"))
+		{
+			ParseNot();
+			Emit(Operation(RULE_AND));
+		}
+	}
+
+	void ParseNot()
+	{
+		if (Accept(L"not") || Accept(L"!"))
+		{
+			ParseNot();
+			Emit(Operation(RULE_NOT));
+		}
+		else if (Accept(L"("))
+		{
+			ParseOr();
+			if (!Accept(L")")) Fail(L"expected ')'");
+		}
+		else
+		{
+			ParseComparison();
+		}
+	}
+
+	// variable, comparison and a number, or 'mean' plus or minus a number for z
+	void ParseComparison()
+	{
+		static const wchar_t* const variable_names[RULE_VARIABLE_COUNT] = { L"h", L"s", L"l", L"z", L"intensity", L"plane_error", L"height" };
+		static const wchar_t* const comparison_names[] = { L"<", L"<=", L">", L">=", L"==", L"!=" };
+		RuleInstruction compare = Operation(RULE_COMPARE);
+		int variable = -1;
+		for (int v = 0; v < RULE_VARIABLE_COUNT; v++)
+		{
+			if (m_token == TOKEN_NAME && m_name == variable_names[v]) variable = v;
+		}
+		if (variable < 0) return Fail(L"expected a variable (H, S, L, z, height, intensity or plane_error)");
+		compare.variable = RuleVariable(variable);
+		Next();
+		int comparison = -1;
+		for (int k = 0; k < 6; k++)
+		{
+			if (m_token == TOKEN_SYMBOL && m_name == comparison_names[k]) comparison = k;
+		}
+		if (comparison < 0) return Fail(L"expected a comparison");
+		compare.comparison = RuleComparison(comparison);
+		Next();
+
+		double sign = 1;
+		if (Accept(L"mean"))
+		{
+			if (compare.variable != RULE_Z) return Fail(L"only z can be compared with the mean height");
+			compare.above_mean = true;
+			if (m_token != TOKEN_SYMBOL || (m_name != L"+" && m_name != L"-"))
+			{
+				compare.threshold = 0;
+				m_uses[compare.variable] = true;
+				return Emit(compare);
+			}
+			if (Accept(L"-")) sign = -1;
+			else if (!Accept(L"+")) return Fail(L"expected '+' or '-'");
+		}
+		else if (Accept(L"-"))
+		{
+			sign = -1;
+		}
+		if (m_token != TOKEN_NUMBER) return Fail(L"expected a number");
+		compare.threshold = sign * m_number;
+		Next();
+		if (compare.variable == RULE_H || compare.variable == RULE_L) ToCodes(compare);
+		m_uses[compare.variable] = true;
+		Emit(compare);
+	}
+
+	// Moves a hue or lightness comparison to the codes when they give the same result. Lightness codes are exact;
+	// a hue code holds 1 / 182 degree, so only < and >= a threshold on the border of two codes are exact, other hue
+	// comparisons stay in float.
+	void ToCodes(RuleInstruction& compare)
+	{
+		const double t = compare.threshold;
+		if (compare.variable == RULE_H)
+		{
+			const double code = t * HUE_CODES_PER_DEGREE;
+			if ((compare.comparison == RULE_LESS || compare.comparison == RULE_GREATER_EQUAL) && code == std::floor(code))
+			{
+				compare.threshold = HueCodeBelow(t);
+				compare.coded = true;
+			}
+			else m_float_hue = true;
+			return;
+		}
+		compare.coded = true;
+		switch (compare.comparison)
+		{
+		case RULE_LESS: case RULE_GREATER_EQUAL: compare.threshold = LightnessCodeAtLeast(t); break;
+		case RULE_LESS_EQUAL: case RULE_GREATER: compare.threshold = LightnessCodeAtMost(t); break;
+		default:
+			// a lightness between two codes equals none of them
+			compare.threshold = LightnessCodeAtLeast(t) <= LightnessCodeAtMost(t) ? LightnessCodeAtLeast(t) : -1.0;
+			break;
+		}
+	}
+
+	struct OpenCondition
+	{
+		std::size_t start;		// first instruction
+		int depth;				// operators above its deepest comparison
+	};
+
+	std::vector<RuleInstruction> m_program;
+	std::vector<std::size_t> m_start;		// first instruction of the condition ending at every instruction
+	bool m_uses[RULE_VARIABLE_COUNT];
+	bool m_float_hue;						// some hue comparison is not exact on the codes
+
+	// parser state
+	std::wstring m_text;
+	std::size_t m_position;
+	std::size_t m_token_start;
+	Token m_token;
+	std::wstring m_name;		// name (lower case) or symbol of the current token
+	double m_number;
+	std::vector<OpenCondition> m_open;
+	std::wstring m_error;
+};
+
+// Classifies every point with the rules in parallel chunks. emit(i, feature_class) is called once per point,
+// counted(i) tells whether the point takes part in the class counts.
+template <typename Emit, typename Counted>
+inline FeatureCounts ClassifyFeaturesByRules(const RuleInputs& in, const FeatureRules& rules, Emit emit, Counted counted)
+{
+	return ParallelReduce(in.count, PARALLEL_GRAIN, ZeroFeatureCounts(), [&](std::size_t begin, std::size_t end)
+	{
+		FeatureCounts chunk = ZeroFeatureCounts();
+		std::uint8_t classes[RULE_BLOCK];
+		for (std::size_t block = begin; block < end; block += RULE_BLOCK)
+		{
+			std::size_t count = std::min(RULE_BLOCK, end - block);
+			rules.ClassifyBlock(in, block, count, classes);
+			for (std::size_t k = 0; k < count; k++)
+			{
+				emit(block + k, int(classes[k]));
+				if (counted(block + k))
+				{
+					chunk.points[classes[k]]++;
+					chunk.total++;
+				}
+			}
+		}
+		return chunk;
+	}, AddFeatureCounts);
+}
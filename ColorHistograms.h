@@ -0,0 +1,165 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Histograms of the color channels of a cloud (R, G, B, intensity and optionally H, S, L) built in one pass, with the
+thresholds suggested for the range parameters of the filters. Chunks of points are counted into their own histograms
+(HSL converted by the vectorized kernel) which are merged at the end, clouds bigger than memory are added in parts.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ColorKernels.h"
+#include "Reductions.h"
+#include "ThreadPool.h"
+
+enum ColorChannel
+{
+	CHANNEL_RED = 0,
+	CHANNEL_GREEN,
+	CHANNEL_BLUE,
+	CHANNEL_INTENSITY,		// (R + G + B) / 3, binned by the exact sum
+	CHANNEL_H,
+	CHANNEL_S,
+	CHANNEL_L,
+	COLOR_CHANNEL_COUNT
+};
+
+// Bins of a channel: bin b holds the values [lo + b * width, lo + (b + 1) * width), the last one also hi
+struct ChannelBins
+{
+	const wchar_t* name;
+	std::size_t bins;
+	double lo, hi;
+
+	double Width() const { return (hi - lo) / double(bins); }
+	double ValueOf(std::size_t bin) const { return lo + double(bin) * Width(); }
+};
+
+inline const ChannelBins& BinsOf(int channel)
+{
+	static const ChannelBins bins[COLOR_CHANNEL_COUNT] =
+	{
+		{ L"red", 256, 0, 256 },
+		{ L"green", 256, 0, 256 },
+		{ L"blue", 256, 0, 256 },
+		{ L"intensity", 766, 0, 766.0 / 3.0 },
+		{ L"H", 360, 0, 360 },
+		{ L"S", 100, 0, 1 },
+		{ L"L", 100, 0, 1 }
+	};
+	return bins[channel];
+}
+
+// Threshold suggested for a channel, as a value of the channel
+struct ChannelThresholds
+{
+	double otsu;
+	double valley;
+	double below_otsu;		// part of the points below the Otsu threshold (0 - 1)
+};
+
+class ColorHistograms
+{
+public:
+	explicit ColorHistograms(bool hsl = true) : m_hsl(hsl), m_points(0)
+	{
+		for (int c = 0; c < COLOR_CHANNEL_COUNT; c++)
+		{
+			if (c < CHANNEL_H || hsl) m_counts[c].assign(BinsOf(c).bins, 0);
+		}
+	}
+
+	// Counts 'count' colors laid out every 'stride' bytes (R, G, B first), on the calling thread
+	void Add(const std::uint8_t* colors, std::size_t stride, std::size_t count)
+	{
+		const std::size_t block = 1024;
+		float H[block], S[block], L[block];
+		for (std::size_t first = 0; first < count; first += block)
+		{
+			const std::size_t n = std::min(block, count - first);
+			const std::uint8_t* c = colors + first * stride;
+			for (std::size_t i = 0; i < n; i++, c += stride)
+			{
+				m_counts[CHANNEL_RED][c[0]]++;
+				m_counts[CHANNEL_GREEN][c[1]]++;
+				m_counts[CHANNEL_BLUE][c[2]]++;
+				m_counts[CHANNEL_INTENSITY][c[0] + c[1] + c[2]]++;
+			}
+			if (!m_hsl) continue;
+			RgbToHslChannels(colors + first * stride, stride, n, H, S, L);
+			for (std::size_t i = 0; i < n; i++)
+			{
+				m_counts[CHANNEL_H][BinOf(CHANNEL_H, H[i])]++;
+				m_counts[CHANNEL_S][BinOf(CHANNEL_S, S[i])]++;
+				m_counts[CHANNEL_L][BinOf(CHANNEL_L, L[i])]++;
+			}
+		}
+		m_points += count;
+	}
+
+	// Adds the counts of histograms built from other points
+	void Merge(const ColorHistograms& other)
+	{
+		for (int c = 0; c < COLOR_CHANNEL_COUNT; c++)
+		{
+			for (std::size_t b = 0; b < m_counts[c].size() && b < other.m_counts[c].size(); b++) m_counts[c][b] += other.m_counts[c][b];
+		}
+		m_points += other.m_points;
+	}
+
+	bool HasChannel(int channel) const { return !m_counts[channel].empty(); }
+	const std::vector<std::size_t>& Counts(int channel) const { return m_counts[channel]; }
+	std::size_t Points() const { return m_points; }
+
+	ChannelThresholds Thresholds(int channel) const
+	{
+		const std::vector<std::size_t>& counts = m_counts[channel];
+		const std::size_t otsu = OtsuThreshold(counts);
+		std::size_t below = 0;
+		for (std::size_t b = 0; b < otsu; b++) below += counts[b];
+		ChannelThresholds thresholds = { BinsOf(channel).ValueOf(otsu), BinsOf(channel).ValueOf(ValleyThreshold(counts)),
+			m_points > 0 ? double(below) / double(m_points) : 0.0 };
+		return thresholds;
+	}
+
+	// Percentages of the points in 'groups' groups of consecutive bins
+	std::vector<double> Percentages(int channel, std::size_t groups) const
+	{
+		const std::vector<std::size_t>& counts = m_counts[channel];
+		std::vector<double> percentages(groups, 0.0);
+		for (std::size_t b = 0; b < counts.size(); b++) percentages[b * groups / counts.size()] += double(counts[b]);
+		for (double& percentage : percentages) percentage = m_points > 0 ? percentage / double(m_points) * 100.0 : 0.0;
+		return percentages;
+	}
+
+private:
+	static std::size_t BinOf(int channel, float value)
+	{
+		const ChannelBins& bins = BinsOf(channel);
+		const double bin = (double(value) - bins.lo) / bins.Width();
+		return bin <= 0 ? 0 : std::min(std::size_t(bin), bins.bins - 1);
+	}
+
+	bool m_hsl;
+	std::size_t m_points;
+	std::vector<std::size_t> m_counts[COLOR_CHANNEL_COUNT];
+};
+
+// Histograms of 'count' colors, chunks counted in parallel and merged in chunk order
+inline ColorHistograms ColorHistogramsOf(const std::uint8_t* colors, std::size_t stride, std::size_t count, bool hsl)
+{
+	return ParallelReduce(count, PARALLEL_GRAIN, ColorHistograms(hsl), [&](std::size_t begin, std::size_t end)
+	{
+		ColorHistograms chunk(hsl);
+		chunk.Add(colors + begin * stride, stride, end - begin);
+		return chunk;
+	}, [](ColorHistograms a, const ColorHistograms& b)
+	{
+		a.Merge(b);
+		return a;
+	});
+}
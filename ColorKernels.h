@@ -0,0 +1,308 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Color kernels shared by the plugins: per-point color tests over packed color arrays.
+Results are selection bitmasks - bit (i % 64) of word (i / 64) belongs to point i.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLOR_KERNELS_SSE2
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Number of 64-bit words needed for a mask over 'count' points
+inline std::size_t MaskWords(std::size_t count)
+{
+	return (count + 63) / 64;
+}
+
+inline int PopCount64(std::uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return int(__popcnt64(word));
+#elif defined(__GNUC__)
+	return __builtin_popcountll(word);
+#else
+	int bits = 0;
+	for (; word; word &= word - 1) bits++;
+	return bits;
+#endif
+}
+
+inline int CountTrailingZeros64(std::uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return int(index);
+#elif defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	int index = 0;
+	while (!(word & 1)) { word >>= 1; index++; }
+	return index;
+#endif
+}
+
+// Calls function(i) for every set bit i of the mask, skipping empty words
+template <typename Function>
+inline void ForEachMaskBit(const std::uint64_t* mask, std::size_t words, Function function)
+{
+	for (std::size_t w = 0; w < words; w++)
+	{
+		for (std::uint64_t word = mask[w]; word; word &= word - 1)
+		{
+			function(w * 64 + CountTrailingZeros64(word));
+		}
+	}
+}
+
+// Inclusive RGB range, one [lo, hi] interval per channel
+struct RgbBox
+{
+	std::uint8_t lo[3];
+	std::uint8_t hi[3];
+	bool empty;		// no color can pass
+};
+
+// Box equivalent to the plugins' strict test: min < c < max for every channel
+inline RgbBox StrictRgbBox(int red_min, int red_max, int green_min, int green_max, int blue_min, int blue_max)
+{
+	const int mins[3] = { red_min, green_min, blue_min };
+	const int maxs[3] = { red_max, green_max, blue_max };
+	RgbBox box;
+	box.empty = false;
+	for (int c = 0; c < 3; c++)
+	{
+		int lo = mins[c] + 1;
+		int hi = maxs[c] - 1;
+		if (lo < 0) lo = 0;
+		if (hi > 255) hi = 255;
+		if (lo > hi)
+		{
+			box.empty = true;
+			lo = hi = 0;
+		}
+		box.lo[c] = std::uint8_t(lo);
+		box.hi[c] = std::uint8_t(hi);
+	}
+	return box;
+}
+
+inline bool InRgbBox(const std::uint8_t* c, const RgbBox& box)
+{
+	return c[0] >= box.lo[0] && c[0] <= box.hi[0] && c[1] >= box.lo[1] && c[1] <= box.hi[1] && c[2] >= box.lo[2] && c[2] <= box.hi[2];
+}
+
+// Range test over 'count' colors laid out every 'stride' bytes (R, G, B first).
+// Writes MaskWords(count) words to the mask and returns the number of points inside the box.
+// Packed 4-byte colors are tested 8 (AVX2) or 4 (SSE2) at a time, any other layout falls back to scalar code.
+inline std::size_t RgbRangeMask(const std::uint8_t* colors, std::size_t stride, std::size_t count, const RgbBox& box, std::uint64_t* mask)
+{
+	const std::size_t words = MaskWords(count);
+	if (box.empty)
+	{
+		std::memset(mask, 0, words * sizeof(std::uint64_t));
+		return 0;
+	}
+
+	std::size_t found = 0;
+	std::size_t w = 0;
+
+#if defined(COLOR_KERNELS_SSE2)
+	if (stride == 4)
+	{
+		// bounds repeated for every pixel, the 4th byte is not tested
+		const int lo = box.lo[0] | (box.lo[1] << 8) | (box.lo[2] << 16);
+		const int hi = box.hi[0] | (box.hi[1] << 8) | (box.hi[2] << 16) | (0xFF << 24);
+#if defined(__AVX2__)
+		const __m256i lo_v = _mm256_set1_epi32(lo);
+		const __m256i hi_v = _mm256_set1_epi32(hi);
+		const __m256i ones = _mm256_set1_epi32(-1);
+		for (; w < count / 64; w++)
+		{
+			const std::uint8_t* block = colors + w * 64 * 4;
+			std::uint64_t word = 0;
+			for (int k = 0; k < 8; k++)
+			{
+				__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + k * 32));
+				__m256i clamped = _mm256_min_epu8(_mm256_max_epu8(c, lo_v), hi_v);
+				__m256i inside = _mm256_cmpeq_epi32(_mm256_cmpeq_epi8(c, clamped), ones);	// all 4 bytes unchanged by clamping
+				word |= std::uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(inside))) << (k * 8);
+			}
+			mask[w] = word;
+			found += PopCount64(word);
+		}
+#else
+		const __m128i lo_v = _mm_set1_epi32(lo);
+		const __m128i hi_v = _mm_set1_epi32(hi);
+		const __m128i ones = _mm_set1_epi32(-1);
+		for (; w < count / 64; w++)
+		{
+			const std::uint8_t* block = colors + w * 64 * 4;
+			std::uint64_t word = 0;
+			for (int k = 0; k < 16; k++)
+			{
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + k * 16));
+				__m128i clamped = _mm_min_epu8(_mm_max_epu8(c, lo_v), hi_v);
+				__m128i inside = _mm_cmpeq_epi32(_mm_cmpeq_epi8(c, clamped), ones);	// all 4 bytes unchanged by clamping
+				word |= std::uint64_t(_mm_movemask_ps(_mm_castsi128_ps(inside))) << (k * 4);
+			}
+			mask[w] = word;
+			found += PopCount64(word);
+		}
+#endif
+	}
+#endif
+
+	// remaining words (or every word for non-packed layouts)
+	for (; w < words; w++)
+	{
+		std::size_t first = w * 64;
+		std::size_t last = first + 64 < count ? first + 64 : count;
+		std::uint64_t word = 0;
+		for (std::size_t i = first; i < last; i++)
+		{
+			word |= std::uint64_t(InRgbBox(colors + i * stride, box)) << (i - first);
+		}
+		mask[w] = word;
+		found += PopCount64(word);
+	}
+	return found;
+}
+
+// HSL of one color: H in degrees [0, 360), S and L in [0, 1]
+inline void RgbToHsl(const std::uint8_t* c, float& H, float& S, float& L)
+{
+	float r = float(c[0]) / 255.0f, g = float(c[1]) / 255.0f, b = float(c[2]) / 255.0f;
+	float mx = r > g ? r : g;
+	mx = mx > b ? mx : b;
+	float mn = r < g ? r : g;
+	mn = mn < b ? mn : b;
+	float d = mx - mn;
+	L = (mx + mn) * 0.5f;
+	if (d == 0.0f)
+	{
+		H = S = 0.0f;	// gray
+		return;
+	}
+	S = d / (L > 0.5f ? (2.0f - mx) - mn : mx + mn);
+	float h;
+	if (mx == r) h = (g - b) / d + (g < b ? 6.0f : 0.0f);
+	else if (mx == g) h = (b - r) / d + 2.0f;
+	else h = (r - g) / d + 4.0f;
+	H = h * 60.0f;
+}
+
+#if defined(COLOR_KERNELS_SSE2)
+#if defined(__AVX2__)
+typedef __m256 HslFloats;
+typedef __m256i HslInts;
+const std::size_t HSL_LANES = 8;
+inline HslInts HslLoad(const std::uint8_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline HslInts HslAnd(HslInts a, HslInts b) { return _mm256_and_si256(a, b); }
+inline HslInts HslShift8(HslInts a) { return _mm256_srli_epi32(a, 8); }
+inline HslInts HslSetInt(int v) { return _mm256_set1_epi32(v); }
+inline HslFloats HslToFloat(HslInts a) { return _mm256_cvtepi32_ps(a); }
+inline HslFloats HslSet(float v) { return _mm256_set1_ps(v); }
+inline HslFloats HslAdd(HslFloats a, HslFloats b) { return _mm256_add_ps(a, b); }
+inline HslFloats HslSub(HslFloats a, HslFloats b) { return _mm256_sub_ps(a, b); }
+inline HslFloats HslMul(HslFloats a, HslFloats b) { return _mm256_mul_ps(a, b); }
+inline HslFloats HslDiv(HslFloats a, HslFloats b) { return _mm256_div_ps(a, b); }
+inline HslFloats HslMax(HslFloats a, HslFloats b) { return _mm256_max_ps(a, b); }
+inline HslFloats HslMin(HslFloats a, HslFloats b) { return _mm256_min_ps(a, b); }
+inline HslFloats HslEq(HslFloats a, HslFloats b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline HslFloats HslLt(HslFloats a, HslFloats b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline HslFloats HslMaskAnd(HslFloats mask, HslFloats a) { return _mm256_and_ps(mask, a); }
+inline HslFloats HslMaskAndNot(HslFloats mask, HslFloats a) { return _mm256_andnot_ps(mask, a); }
+inline HslFloats HslSelect(HslFloats mask, HslFloats a, HslFloats b) { return _mm256_blendv_ps(b, a, mask); }
+inline void HslStore(float* p, HslFloats a) { _mm256_storeu_ps(p, a); }
+#else
+typedef __m128 HslFloats;
+typedef __m128i HslInts;
+const std::size_t HSL_LANES = 4;
+inline HslInts HslLoad(const std::uint8_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline HslInts HslAnd(HslInts a, HslInts b) { return _mm_and_si128(a, b); }
+inline HslInts HslShift8(HslInts a) { return _mm_srli_epi32(a, 8); }
+inline HslInts HslSetInt(int v) { return _mm_set1_epi32(v); }
+inline HslFloats HslToFloat(HslInts a) { return _mm_cvtepi32_ps(a); }
+inline HslFloats HslSet(float v) { return _mm_set1_ps(v); }
+inline HslFloats HslAdd(HslFloats a, HslFloats b) { return _mm_add_ps(a, b); }
+inline HslFloats HslSub(HslFloats a, HslFloats b) { return _mm_sub_ps(a, b); }
+inline HslFloats HslMul(HslFloats a, HslFloats b) { return _mm_mul_ps(a, b); }
+inline HslFloats HslDiv(HslFloats a, HslFloats b) { return _mm_div_ps(a, b); }
+inline HslFloats HslMax(HslFloats a, HslFloats b) { return _mm_max_ps(a, b); }
+inline HslFloats HslMin(HslFloats a, HslFloats b) { return _mm_min_ps(a, b); }
+inline HslFloats HslEq(HslFloats a, HslFloats b) { return _mm_cmpeq_ps(a, b); }
+inline HslFloats HslLt(HslFloats a, HslFloats b) { return _mm_cmplt_ps(a, b); }
+inline HslFloats HslMaskAnd(HslFloats mask, HslFloats a) { return _mm_and_ps(mask, a); }
+inline HslFloats HslMaskAndNot(HslFloats mask, HslFloats a) { return _mm_andnot_ps(mask, a); }
+inline HslFloats HslSelect(HslFloats mask, HslFloats a, HslFloats b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline void HslStore(float* p, HslFloats a) { _mm_storeu_ps(p, a); }
+#endif
+#endif
+
+// HSL of 'count' colors laid out every 'stride' bytes. Any of H, S, L may be null when the channel is not needed.
+// Packed 4-byte colors are converted 8 (AVX2) or 4 (SSE2) at a time with the same float operations as RgbToHsl,
+// so both paths give identical values.
+inline void RgbToHslChannels(const std::uint8_t* colors, std::size_t stride, std::size_t count, float* H, float* S, float* L)
+{
+	std::size_t i = 0;
+
+#if defined(COLOR_KERNELS_SSE2)
+	if (stride == 4)
+	{
+		const HslInts byte_mask = HslSetInt(0xFF);
+		const HslFloats zero = HslSet(0.0f), half = HslSet(0.5f), one = HslSet(1.0f), two = HslSet(2.0f), four = HslSet(4.0f), six = HslSet(6.0f);
+		const HslFloats sixty = HslSet(60.0f), scale = HslSet(255.0f);
+		for (; i + HSL_LANES <= count; i += HSL_LANES)
+		{
+			HslInts px = HslLoad(colors + i * 4);
+			HslFloats r = HslDiv(HslToFloat(HslAnd(px, byte_mask)), scale);
+			HslFloats g = HslDiv(HslToFloat(HslAnd(HslShift8(px), byte_mask)), scale);
+			HslFloats b = HslDiv(HslToFloat(HslAnd(HslShift8(HslShift8(px)), byte_mask)), scale);
+			HslFloats mx = HslMax(HslMax(r, g), b);
+			HslFloats mn = HslMin(HslMin(r, g), b);
+			HslFloats d = HslSub(mx, mn);
+			HslFloats l = HslMul(HslAdd(mx, mn), half);
+			HslFloats gray = HslEq(d, zero);
+			if (L) HslStore(L + i, l);
+
+			if (H)
+			{
+				HslFloats safe_d = HslSelect(gray, one, d);
+				HslFloats h_r = HslAdd(HslDiv(HslSub(g, b), safe_d), HslMaskAnd(HslLt(g, b), six));
+				HslFloats h_g = HslAdd(HslDiv(HslSub(b, r), safe_d), two);
+				HslFloats h_b = HslAdd(HslDiv(HslSub(r, g), safe_d), four);
+				HslFloats max_r = HslEq(mx, r);
+				HslFloats max_g = HslEq(mx, g);
+				HslFloats h = HslSelect(max_r, h_r, HslSelect(max_g, h_g, h_b));
+				HslStore(H + i, HslMaskAndNot(gray, HslMul(h, sixty)));
+			}
+			if (S)
+			{
+				HslFloats denominator = HslSelect(HslLt(half, l), HslSub(HslSub(two, mx), mn), HslAdd(mx, mn));
+				denominator = HslSelect(gray, one, denominator);
+				HslStore(S + i, HslMaskAndNot(gray, HslDiv(d, denominator)));
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		float h, s, l;
+		RgbToHsl(colors + i * stride, h, s, l);
+		if (H) H[i] = h;
+		if (S) S[i] = s;
+		if (L) L[i] = l;
+	}
+}
@@ -0,0 +1,386 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Color regions (RGB boxes, HSL ranges, palettes) compiled into a lookup table of labels.
+The table has two levels: 32x32x32 bins of 8x8x8 colors, a bin lying in one region only keeps its
+label, a bin cut by a region border points to a block with the label of every color in it (identical
+blocks are stored once). The label of any color is exact and costs at most two table loads.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cwctype>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ColorKernels.h"
+#include "ThreadPool.h"
+
+// One selectable color region, label 1..255 (0 - no region)
+struct ColorRegion
+{
+	enum Kind { RGB_BOXES, HSL_RANGE };
+
+	Kind kind;
+	std::uint8_t label;
+	std::vector<RgbBox> boxes;		// RGB_BOXES: union of inclusive boxes
+	float hue_lo, hue_hi;			// HSL_RANGE: hue in degrees, hue_lo > hue_hi wraps around 360
+	float saturation_lo, saturation_hi;
+	float lightness_lo, lightness_hi;
+};
+
+inline ColorRegion RgbBoxRegion(std::uint8_t label, const RgbBox& box)
+{
+	ColorRegion region = {};
+	region.kind = ColorRegion::RGB_BOXES;
+	region.label = label;
+	if (!box.empty) region.boxes.push_back(box);
+	return region;
+}
+
+// Colors within 'tolerance' of any palette color in every channel
+inline ColorRegion PaletteRegion(std::uint8_t label, const std::vector<std::uint32_t>& rgb_colors, int tolerance)
+{
+	ColorRegion region = {};
+	region.kind = ColorRegion::RGB_BOXES;
+	region.label = label;
+	for (std::uint32_t rgb : rgb_colors)
+	{
+		RgbBox box;
+		box.empty = false;
+		for (int c = 0; c < 3; c++)
+		{
+			int value = int((rgb >> (16 - 8 * c)) & 0xff);
+			box.lo[c] = std::uint8_t(value - tolerance < 0 ? 0 : value - tolerance);
+			box.hi[c] = std::uint8_t(value + tolerance > 255 ? 255 : value + tolerance);
+		}
+		region.boxes.push_back(box);
+	}
+	return region;
+}
+
+inline ColorRegion HslRegion(std::uint8_t label, float hue_lo, float hue_hi, float saturation_lo, float saturation_hi, float lightness_lo, float lightness_hi)
+{
+	ColorRegion region = {};
+	region.kind = ColorRegion::HSL_RANGE;
+	region.label = label;
+	region.hue_lo = hue_lo; region.hue_hi = hue_hi;
+	region.saturation_lo = saturation_lo; region.saturation_hi = saturation_hi;
+	region.lightness_lo = lightness_lo; region.lightness_hi = lightness_hi;
+	return region;
+}
+
+inline bool InHslRange(const ColorRegion& region, float H, float S, float L)
+{
+	bool hue = region.hue_lo <= region.hue_hi ? (H >= region.hue_lo && H <= region.hue_hi) : (H >= region.hue_lo || H <= region.hue_hi);
+	return hue && S >= region.saturation_lo && S <= region.saturation_hi && L >= region.lightness_lo && L <= region.lightness_hi;
+}
+
+class ColorLookupTable
+{
+public:
+	static const int BIN_BITS = 3;						// 8 values of a channel per bin
+	static const int BINS = 256 >> BIN_BITS;			// per channel
+	static const int BLOCK_SIZE = 1 << (3 * BIN_BITS);	// colors of one bin
+
+	ColorLookupTable() : m_bins(std::size_t(BINS) * BINS * BINS, 0) {}
+
+	// Compiles the regions, a color gets the label of the first region which contains it
+	void Compile(const std::vector<ColorRegion>& regions)
+	{
+		std::vector<std::uint8_t> bin_blocks;		// exact labels of the mixed bins, BLOCK_SIZE per bin
+		std::vector<std::uint8_t> mixed(m_bins.size(), 0);
+		bin_blocks.resize(m_bins.size() * BLOCK_SIZE);
+		ParallelFor(m_bins.size(), 256, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t bin = begin; bin < end; bin++)
+			{
+				std::uint8_t* block = bin_blocks.data() + bin * BLOCK_SIZE;
+				LabelBlock(regions, bin, block);
+				bool uniform = true;
+				for (int k = 1; k < BLOCK_SIZE && uniform; k++) uniform = block[k] == block[0];
+				m_bins[bin] = block[0];
+				mixed[bin] = !uniform;
+			}
+		});
+
+		// identical blocks are stored once
+		std::map<std::vector<std::uint8_t>, std::uint32_t> unique_blocks;
+		m_blocks.clear();
+		for (std::size_t bin = 0; bin < m_bins.size(); bin++)
+		{
+			if (!mixed[bin]) continue;
+			std::vector<std::uint8_t> block(bin_blocks.begin() + bin * BLOCK_SIZE, bin_blocks.begin() + (bin + 1) * BLOCK_SIZE);
+			auto found = unique_blocks.find(block);
+			if (found == unique_blocks.end())
+			{
+				found = unique_blocks.insert(std::make_pair(block, std::uint32_t(m_blocks.size() / BLOCK_SIZE))).first;
+				m_blocks.insert(m_blocks.end(), block.begin(), block.end());
+			}
+			m_bins[bin] = FIRST_BLOCK + found->second;
+		}
+	}
+
+	std::uint8_t Label(const std::uint8_t* c) const
+	{
+		std::uint32_t entry = m_bins[(std::size_t(c[0] >> BIN_BITS) * BINS + (c[1] >> BIN_BITS)) * BINS + (c[2] >> BIN_BITS)];
+		if (entry < FIRST_BLOCK) return std::uint8_t(entry);
+		const int low = (1 << BIN_BITS) - 1;
+		return m_blocks[std::size_t(entry - FIRST_BLOCK) * BLOCK_SIZE + (((c[0] & low) << (2 * BIN_BITS)) | ((c[1] & low) << BIN_BITS) | (c[2] & low))];
+	}
+
+	// Labels of 'count' colors laid out every 'stride' bytes (R, G, B first)
+	void LabelColors(const std::uint8_t* colors, std::size_t stride, std::size_t count, std::uint8_t* labels) const
+	{
+		for (std::size_t i = 0; i < count; i++)
+		{
+			labels[i] = Label(colors + i * stride);
+		}
+	}
+
+	// Mask of the colors which lie in any region, same layout and result as RgbRangeMask
+	std::size_t RegionMask(const std::uint8_t* colors, std::size_t stride, std::size_t count, std::uint64_t* mask) const
+	{
+		std::size_t found = 0;
+		for (std::size_t w = 0; w < MaskWords(count); w++)
+		{
+			std::uint64_t word = 0;
+			std::size_t last = count - w * 64 < 64 ? count - w * 64 : 64;
+			for (std::size_t k = 0; k < last; k++)
+			{
+				word |= std::uint64_t(Label(colors + (w * 64 + k) * stride) != 0) << k;
+			}
+			mask[w] = word;
+			found += PopCount64(word);
+		}
+		return found;
+	}
+
+	// Memory of the table in bytes
+	std::size_t Bytes() const { return m_bins.size() * sizeof(std::uint32_t) + m_blocks.size(); }
+
+private:
+	static const std::uint32_t FIRST_BLOCK = 256;	// bin entries below are labels
+
+	// Exact labels of all colors of the bin. Boxes which contain the whole bin or miss it are decided
+	// for the whole bin at once, other regions are tested color by color.
+	static void LabelBlock(const std::vector<ColorRegion>& regions, std::size_t bin, std::uint8_t* block)
+	{
+		const int size = 1 << BIN_BITS;
+		const int lo[3] = { int(bin / (BINS * BINS)) * size, int(bin / BINS % BINS) * size, int(bin % BINS) * size };
+		std::uint8_t decided[BLOCK_SIZE] = {};
+		float H[BLOCK_SIZE], S[BLOCK_SIZE], L[BLOCK_SIZE];
+		bool hsl_ready = false;
+		int open = BLOCK_SIZE;		// colors without a label yet
+		for (int k = 0; k < BLOCK_SIZE; k++) block[k] = 0;
+
+		for (const ColorRegion& region : regions)
+		{
+			if (open == 0) break;
+			bool whole_bin = false, per_color = region.kind == ColorRegion::HSL_RANGE;
+			for (std::size_t b = 0; b < region.boxes.size() && !whole_bin; b++)
+			{
+				const RgbBox& box = region.boxes[b];
+				bool contains = true, misses = false;
+				for (int c = 0; c < 3; c++)
+				{
+					contains = contains && box.lo[c] <= lo[c] && box.hi[c] >= lo[c] + size - 1;
+					misses = misses || box.hi[c] < lo[c] || box.lo[c] > lo[c] + size - 1;
+				}
+				whole_bin = contains;
+				per_color = per_color || !misses;
+			}
+			if (!whole_bin && !per_color) continue;
+
+			if (region.kind == ColorRegion::HSL_RANGE && !hsl_ready)
+			{
+				for (int k = 0; k < BLOCK_SIZE; k++)
+				{
+					std::uint8_t c[3] = { std::uint8_t(lo[0] + (k >> (2 * BIN_BITS))), std::uint8_t(lo[1] + ((k >> BIN_BITS) & (size - 1))), std::uint8_t(lo[2] + (k & (size - 1))) };
+					RgbToHsl(c, H[k], S[k], L[k]);
+				}
+				hsl_ready = true;
+			}
+			for (int k = 0; k < BLOCK_SIZE; k++)
+			{
+				if (decided[k]) continue;
+				bool inside = whole_bin;
+				if (!inside && region.kind == ColorRegion::HSL_RANGE)
+				{
+					inside = InHslRange(region, H[k], S[k], L[k]);
+				}
+				else if (!inside)
+				{
+					std::uint8_t c[3] = { std::uint8_t(lo[0] + (k >> (2 * BIN_BITS))), std::uint8_t(lo[1] + ((k >> BIN_BITS) & (size - 1))), std::uint8_t(lo[2] + (k & (size - 1))) };
+					for (std::size_t b = 0; b < region.boxes.size() && !inside; b++) inside = InRgbBox(c, region.boxes[b]);
+				}
+				if (inside)
+				{
+					block[k] = region.label;
+					decided[k] = 1;
+					open--;
+				}
+			}
+		}
+	}
+
+	std::vector<std::uint32_t> m_bins;
+	std::vector<std::uint8_t> m_blocks;
+};
+
+// Class of colors selected by one or more regions, class k gets label k + 1
+struct ColorClass
+{
+	std::wstring name;
+	bool delete_points;		// points of the class are deleted
+};
+
+// Parses regions written as a list separated with ';', e.g.
+//   snow = rgb(230-255, 230-255, 230-255); grass = hsl(90-150, 0.2-1, 0.1-0.6); road = palette(12: #7a5f87 #6e5a80) delete
+// rgb - inclusive channel ranges, hsl - hue in degrees (from > to wraps around 360), saturation and lightness in [0, 1],
+// palette - tolerance per channel and colors. Regions with the same class name form one class, a region without
+// a name is a class of its own; 'delete' after a region deletes the points of its class.
+// Returns false and a message on error.
+inline bool ParseColorRegions(const std::wstring& text, std::vector<ColorRegion>& regions, std::vector<ColorClass>& classes, std::wstring& error)
+{
+	regions.clear();
+	classes.clear();
+	std::size_t pos = 0;
+	auto skip = [&]() { while (pos < text.size() && std::iswspace(text[pos])) pos++; };
+	auto expect = [&](wchar_t c) { skip(); if (pos < text.size() && text[pos] == c) { pos++; return true; } return false; };
+	auto number = [&](double& value)
+	{
+		skip();
+		if (pos >= text.size()) return false;
+		const wchar_t* start = text.c_str() + pos;
+		wchar_t* end = nullptr;
+		value = std::wcstod(start, &end);
+		if (end == start) return false;
+		pos += std::size_t(end - start);
+		return true;
+	};
+	auto word = [&]()
+	{
+		skip();
+		std::wstring result;
+		while (pos < text.size() && (std::iswalnum(text[pos]) || text[pos] == L'_')) result += text[pos++];
+		return result;
+	};
+	auto range = [&](double& lo, double& hi)
+	{
+		if (!number(lo)) return false;
+		skip();
+		if (pos < text.size() && text[pos] == L'-') pos++;		// numbers are unsigned, '-' separates the bounds
+		return number(hi);
+	};
+
+	while (true)
+	{
+		skip();
+		if (pos >= text.size()) break;
+		std::wstring name, keyword = word();
+		if (expect(L'='))
+		{
+			name = keyword;
+			keyword = word();
+		}
+		for (auto& c : keyword) c = wchar_t(std::towlower(c));
+		if (name.empty()) name = L"region " + std::to_wstring(regions.size() + 1);
+
+		std::size_t class_index = 0;
+		while (class_index < classes.size() && classes[class_index].name != name) class_index++;
+		if (class_index == classes.size())
+		{
+			if (classes.size() >= 255)
+			{
+				error = L"At most 255 color classes are supported";
+				return false;
+			}
+			ColorClass color_class = { name, false };
+			classes.push_back(color_class);
+		}
+		std::uint8_t label = std::uint8_t(class_index + 1);
+		if (!expect(L'('))
+		{
+			error = L"Expected '(' after region type";
+			return false;
+		}
+
+		if (keyword == L"rgb" || keyword == L"hsl")
+		{
+			double lo[3], hi[3];
+			for (int c = 0; c < 3; c++)
+			{
+				if ((c > 0 && !expect(L',')) || !range(lo[c], hi[c]))
+				{
+					error = L"Expected three ranges in " + keyword + L"(...)";
+					return false;
+				}
+			}
+			if (keyword == L"rgb")
+			{
+				RgbBox box = StrictRgbBox(int(lo[0]) - 1, int(hi[0]) + 1, int(lo[1]) - 1, int(hi[1]) + 1, int(lo[2]) - 1, int(hi[2]) + 1);
+				regions.push_back(RgbBoxRegion(label, box));
+			}
+			else
+			{
+				regions.push_back(HslRegion(label, float(lo[0]), float(hi[0]), float(lo[1]), float(hi[1]), float(lo[2]), float(hi[2])));
+			}
+		}
+		else if (keyword == L"palette")
+		{
+			double tolerance;
+			if (!number(tolerance) || !expect(L':'))
+			{
+				error = L"Expected palette(tolerance: #rrggbb ...)";
+				return false;
+			}
+			std::vector<std::uint32_t> colors;
+			while (expect(L'#'))
+			{
+				std::size_t digits = 0;
+				std::uint32_t rgb = 0;
+				while (pos < text.size() && std::iswxdigit(text[pos]) && digits < 6)
+				{
+					wchar_t d = wchar_t(std::towlower(text[pos++]));
+					rgb = rgb * 16 + std::uint32_t(d <= L'9' ? d - L'0' : d - L'a' + 10);
+					digits++;
+				}
+				if (digits != 6)
+				{
+					error = L"Palette colors must be written as #rrggbb";
+					return false;
+				}
+				colors.push_back(rgb);
+			}
+			regions.push_back(PaletteRegion(label, colors, int(tolerance)));
+		}
+		else
+		{
+			error = L"Unknown region type '" + keyword + L"', expected rgb, hsl or palette";
+			return false;
+		}
+
+		if (!expect(L')'))
+		{
+			error = L"Expected ')' at the end of " + keyword + L"(...)";
+			return false;
+		}
+		std::size_t after_region = pos;
+		std::wstring action = word();
+		for (auto& c : action) c = wchar_t(std::towlower(c));
+		if (action == L"delete") classes[class_index].delete_points = true;
+		else pos = after_region;
+		if (!expect(L';')) break;
+	}
+	skip();
+	if (pos < text.size())
+	{
+		error = L"Unexpected text after the last region";
+		return false;
+	}
+	return true;
+}
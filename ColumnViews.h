@@ -0,0 +1,58 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Read-only column views of per-point channels. A channel is read where it already lies (a loaded vector,
+one coordinate of packed xyz) instead of being copied into a vector of its own, and attribute ranges
+of a cloud are streamed in small chunks instead of being materialized for all points.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Strided read-only view of one per-point channel, e.g. a layer vector or the z of packed xyz
+struct ChannelView
+{
+	const float* data;
+	std::size_t stride;		// in floats
+
+	float operator[](std::size_t i) const { return data[i * stride]; }
+};
+
+inline ChannelView MakeChannelView(const float* data, std::size_t stride = 1)
+{
+	ChannelView view = { data, stride };
+	return view;
+}
+
+// One coordinate (0 - x, 1 - y, 2 - z) of the loaded xyz
+template <typename Point>
+inline ChannelView CoordinateView(const std::vector<Point>& xyz, int axis)
+{
+	static_assert(sizeof(Point) == 3 * sizeof(float), "xyz is expected as packed float triples");
+	return MakeChannelView(reinterpret_cast<const float*>(xyz.data()) + axis, 3);
+}
+
+// Points per chunk of a streamed column, small enough to stay in the cache
+const std::size_t COLUMN_CHUNK_POINTS = 4096;
+
+// Streams one column of an iterable range (e.g. an ogx attribute range) through a single chunk buffer.
+// read(element) gives the value of a point, chunk(begin, values, count) gets the values of points begin .. begin + count - 1.
+template <typename Value, typename Range, typename Read, typename Chunk>
+inline void ForEachColumnChunk(Range&& range, Read read, Chunk chunk)
+{
+	std::vector<Value> buffer(COLUMN_CHUNK_POINTS);
+	std::size_t begin = 0;
+	std::size_t count = 0;
+	for (auto& element : range)
+	{
+		buffer[count++] = read(element);
+		if (count == COLUMN_CHUNK_POINTS)
+		{
+			chunk(begin, static_cast<const Value*>(buffer.data()), count);
+			begin += count;
+			count = 0;
+		}
+	}
+	if (count != 0) chunk(begin, static_cast<const Value*>(buffer.data()), count);
+}
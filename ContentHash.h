@@ -0,0 +1,63 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Fast 64-bit content hash of a memory block, used to detect unchanged input data between runs.
+Not a cryptographic hash. Blocks are hashed in parallel and combined in block order, so the
+value depends only on the content and never on the number of threads.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "ThreadPool.h"
+
+inline std::uint64_t HashMix64(std::uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Sequential hash of one block
+inline std::uint64_t HashBlock(const unsigned char* data, std::size_t bytes, std::uint64_t seed)
+{
+	std::uint64_t h = seed ^ (bytes * 0x9e3779b97f4a7c15ULL);
+	std::size_t i = 0;
+	for (; i + 8 <= bytes; i += 8)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, data + i, 8);
+		h ^= word * 0x87c37b91114253d5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+	}
+	std::uint64_t tail = 0;
+	std::memcpy(&tail, data + i, bytes - i);
+	h ^= tail * 0x87c37b91114253d5ULL;
+	return HashMix64(h);
+}
+
+// Hash of the whole memory block, 1 MB blocks hashed in parallel
+inline std::uint64_t ParallelContentHash(const void* data, std::size_t bytes)
+{
+	const std::size_t block = 1 << 20;
+	const unsigned char* first = static_cast<const unsigned char*>(data);
+	std::size_t blocks = (bytes + block - 1) / block;
+	return ParallelReduce(blocks, 1, HashMix64(bytes), [&](std::size_t begin, std::size_t end)
+	{
+		std::uint64_t h = 0;
+		for (std::size_t b = begin; b < end; b++)
+		{
+			std::size_t size = b + 1 < blocks ? block : bytes - b * block;
+			h = HashMix64(h ^ HashBlock(first + b * block, size, b));
+		}
+		return h;
+	}, [](std::uint64_t a, std::uint64_t b)
+	{
+		return HashMix64(a * 0x9e3779b97f4a7c15ULL ^ b);
+	});
+}
@@ -15,9 +15,94 @@ Filtracja koloru 
 #include <ogx/Data/Clouds/SphericalSearchKernel.h>
 #include <ogx/Data/Primitives/PrimitiveHelpers.h>
 
+#include "ColorKernels.h"
+#include "ColorLookup.h"
+#include "PluginHelpers.h"
+
 using namespace ogx;
 using namespace ogx::Data;
 
+// Memory needed by one point: color, state and a label
+const std::size_t COLOR_FILTER_POINT_BYTES = sizeof(Data::Clouds::Color) + sizeof(Data::Clouds::State) + 1;
+
+// Number of points with every label, 0 - not found
+typedef std::vector<std::size_t> LabelCounts;
+
+LabelCounts AddLabelCounts(const LabelCounts &a, const LabelCounts &b)
+{
+	LabelCounts sum(a);
+	for (std::size_t l = 0; l < sum.size(); l++) sum[l] += b[l];
+	return sum;
+}
+
+//label colors: 1 for colors within the range, or the class of the compiled color regions if given (0 - not found)
+//chunks of whole mask words are labeled in parallel and their counts summed
+LabelCounts LabelColors(const std::vector<Data::Clouds::Color> &colors, const RgbBox &box, const ColorLookupTable *regions, std::vector<std::uint8_t> &labels)
+{
+	const std::uint8_t* color_bytes = reinterpret_cast<const std::uint8_t*>(colors.data());
+	const std::size_t stride = sizeof(Data::Clouds::Color);
+	labels.resize(colors.size());
+	return ParallelReduce(MaskWords(colors.size()), PARALLEL_GRAIN / 64, LabelCounts(256, 0), [&](std::size_t first_word, std::size_t last_word)
+	{
+		std::size_t first = first_word * 64;
+		std::size_t count = std::min(last_word * 64, colors.size()) - first;
+		LabelCounts counts(256, 0);
+		if (regions)
+		{
+			regions->LabelColors(color_bytes + first * stride, stride, count, labels.data() + first);
+			for (std::size_t i = first; i < first + count; i++) counts[labels[i]]++;
+		}
+		else
+		{
+			std::vector<std::uint64_t> mask(last_word - first_word);
+			counts[1] = RgbRangeMask(color_bytes + first * stride, stride, count, box, mask.data());
+			counts[0] = count - counts[1];
+			std::fill(labels.begin() + first, labels.begin() + first + count, std::uint8_t(0));
+			ForEachMaskBit(mask.data(), mask.size(), [&](std::size_t i) { labels[first + i] = 1; });
+		}
+		return counts;
+	}, AddLabelCounts);
+}
+
+// Adds the labeled points to the selections: all found points, then the points of every label from 1 up to 'classes'.
+// Points of the labels follow 'offset' in the cloud.
+void AddLabelSelections(const std::vector<std::uint8_t> &labels, std::size_t count, std::size_t offset, std::size_t classes, std::vector<SelectionBuilder> &selections)
+{
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (labels[i] == 0) continue;
+		selections[0].Add(offset + i);
+		if (labels[i] <= classes) selections[labels[i]].Add(offset + i);
+	}
+}
+
+// Finding the layer with the color class of every point, created if there is none
+Data::Layers::ILayer* ClassLayer(Clouds::ICloud & cloud)
+{
+	auto layers = cloud.FindLayers(L"color class");
+	if (!layers.empty())
+	{
+		return layers[0];
+	}
+	return cloud.CreateLayer(L"color class", 0); // 0 - no class
+}
+
+// Cloud filtered by one run: read on the calling thread, labeled on the pool and written back on the calling thread
+struct ColorFilterJob
+{
+	ColorFilterJob() : class_layer(nullptr), points(0), streamed(false) {}
+
+	ColorHistograms histograms;					// suggested thresholds only
+	Data::Layers::ILayer *class_layer;			// null without color classes
+	std::vector<Data::Clouds::Color> colors;
+	std::vector<std::uint8_t> labels;
+	LabelCounts counts;
+	std::vector<SelectionBuilder> selections;	// found points, then every class
+	std::vector<Data::Clouds::State> states;
+	std::vector<StoredReal> class_values;
+	std::size_t points;
+	bool streamed;								// labeled and written in tiles while it was loaded
+};
 
 struct ColorFilter : public ogx::Plugin::EasyMethod
 {
@@ -30,6 +115,13 @@ struct ColorFilter : public ogx::Plugin::EasyMethod
 	int green_min, green_max;	// green color range
 	int blue_min, blue_max;		// blue color range
 	bool delete_points;			// deletes points if true
+	bool suggest_thresholds;	// only histograms and suggested thresholds of the channels are logged if true
+	bool write_states;			// found points are selected in the states if true, only stored as selections otherwise
+	double memory_budget;		// MB for point data, bigger clouds are processed in tiles (0 - no limit)
+	String color_regions;		// named color classes, replace the color range if not empty
+	ColorLookupTable m_regions_table;	// color regions compiled in Init
+	std::vector<ColorClass> m_classes;
+	String trace_file;			// Chrome trace of the stages of every run (empty - not written)
 
 	//constructor
 	ColorFilter() : EasyMethod(L"Mateusz Pielach", L"Color filtration - IE4")
@@ -47,6 +139,14 @@ struct ColorFilter : public ogx::Plugin::EasyMethod
 		bank.Add(L"blue max", blue_max = 255, L"Blue channel maximum value (0-255)").Min(0).Max(255);
 		bank.Add(L"node id", m_node_id = Data::ResourceID::invalid).AsNode();	//cloud choice
 		bank.Add(L"delete points", delete_points = false, L"If set, deletes filtered points");
+		bank.Add(L"suggest thresholds", suggest_thresholds = false, L"If set, only histograms of R, G, B, H, S, L are built in one pass and logged "
+			L"with the thresholds suggested for them (Otsu's and the valley between two peaks), the cloud is not changed");
+		bank.Add(L"write states", write_states = true, L"If not set, states of the points are left as they are, found points are only stored "
+			L"as the selection 'selected-by-color' and one selection per color class (combined by the Selections method)");
+		bank.Add(L"memory budget", memory_budget = 0, L"Memory for point data in MB, bigger clouds are processed in tiles (0 - no limit)").Min(0);
+		bank.Add(L"color regions", color_regions = L"", L"Color classes separated with ';', e.g. brick = rgb(100-200, 0-80, 0-80); grass = hsl(90-150, 0.2-1, 0.1-0.6); road = palette(12: #7a5f87) delete. "
+			L"All classes are found in one pass and written to the 'color class' layer, replaces the color range if set");
+		bank.Add(L"trace file", trace_file = L"", L"If set, time of every stage is also written to this file as a Chrome trace (chrome://tracing, ui.perfetto.dev)");
 	}
 
 	bool Init(Execution::Context& context)
@@ -56,44 +156,169 @@ struct ColorFilter : public ogx::Plugin::EasyMethod
 		m_node = context.m_project->TransTreeFindNode(m_node_id);
 		if (!m_node) ReportError(L"You must define node_id");
 
+		//compile the color regions once, every point is then tested with a table lookup
+		if (!color_regions.empty())
+		{
+			std::vector<ColorRegion> regions;
+			String error;
+			if (!ParseColorRegions(color_regions, regions, m_classes, error)) ReportError(L"Invalid color regions: " + error);
+			m_regions_table.Compile(regions);
+		}
+
 		OGX_LINE.Msg(User, L"Initialization succeeded");
 		return EasyMethod::Init(context);
 	}
 
 	virtual void Run(Context& context)
 	{
-		Data::Clouds::ForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node)
+		ThreadPoolRun pool_run;
+		StageProfile profile;
+		RgbBox box = StrictRgbBox(red_min, red_max, green_min, green_max, blue_min, blue_max);
+		const ColorLookupTable *regions = color_regions.empty() ? nullptr : &m_regions_table;
+		const std::size_t classes = regions ? m_classes.size() : 0;
+		std::size_t tile_points = TilePointsForBudget(memory_budget, COLOR_FILTER_POINT_BYTES);
+
+		//bring back original state for each point, then select (and delete) points within color range / of a color class
+		Data::Clouds::State original_state;
+		original_state.reset();
+		std::vector<Data::Clouds::State> label_states(256, original_state);
+		for (std::size_t l = 1; l < label_states.size(); l++)
 		{
+			label_states[l].set(Data::Clouds::PS_SELECTED);
+			bool delete_class = regions && l <= m_classes.size() && m_classes[l - 1].delete_points;
+			if (delete_points || delete_class)
+			{
+				label_states[l].set(Data::Clouds::PS_DELETED);
+			}
+		}
+
+		ParallelForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode &)
+		{
+			ColorFilterJob job;
 			//access points in the cloud
 			Data::Clouds::PointsRange points_all;
 			cloud.GetAccess().GetAllPoints(points_all);
+			job.points = points_all.size();
+			job.streamed = false;
+
+			if (suggest_thresholds)
+			{
+				ScopedStage stage(profile, L"color histograms", points_all.size());
+				job.histograms = StreamColorHistograms(points_all, TilePointsForBudget(memory_budget, sizeof(Data::Clouds::Color)), true);
+				return job;
+			}
 
-			//get color values and states
-			std::vector<Data::Clouds::Color> colors;
-			points_all.GetColors(colors);
-			auto state_range = Data::Clouds::RangeState(points_all);
-			auto state = state_range.begin();
 			auto point = context.Feedback().GetFocusPoint();
+			job.class_layer = regions ? ClassLayer(cloud) : nullptr;	//class of every point, 0 - none
+			job.selections.assign(classes + 1, SelectionBuilder(points_all.size()));	//found points, then every class
+			job.counts.assign(256, 0);
 
-			int points_found = 0;
+			if (tile_points == 0 || points_all.size() <= tile_points)
+			{
+				//get color values, labeled on the pool
+				ScopedStage stage(profile, L"load colors", points_all.size());
+				points_all.GetColors(job.colors);
+				stage.Copied(job.colors.size() * sizeof(Data::Clouds::Color));
+				return job;
+			}
 
-			//loop which looks for points which are within color range 
-			for (auto & c : colors)
+			//cloud bigger than the memory budget - streamed in tiles of consecutive points while it is loaded,
+			//class values are written through 'write_class' (nothing without color classes)
+			job.streamed = true;
+			auto label_tiles = [&](auto write_class)
 			{
-				state->reset(); //bring back original state for each point
-				if ((c[0] > red_min) && (c[1] > green_min) && (c[2] > blue_min) && (c[0] < red_max) && (c[1] < green_max) && (c[2] < blue_max))
+				std::vector<Data::Clouds::Color> colors;
+				std::vector<std::uint8_t> labels;
+				auto color_range = Data::Clouds::RangeColorConst(points_all);
+				auto state_range = Data::Clouds::RangeState(points_all);
+				auto c = color_range.begin();
+				auto state = state_range.begin();
+				std::size_t offset = 0;		//first point of the tile
+				while (c != color_range.end())
 				{
-					state->set(Data::Clouds::PS_SELECTED); //select point
-					if (delete_points)
+					ScopedStage stage(profile, L"load tile");
+					colors.clear();
+					for (; c != color_range.end() && colors.size() < tile_points; ++c)
 					{
-						state->set(Data::Clouds::PS_DELETED);	//delete point
+						colors.push_back(*c);
 					}
-					points_found++;
+					stage.Points(colors.size());
+					stage.Copied(colors.size() * sizeof(Data::Clouds::Color));
+					stage.Next(L"color labels", colors.size());
+					job.counts = AddLabelCounts(job.counts, LabelColors(colors, box, regions, labels));
+					AddLabelSelections(labels, colors.size(), offset, classes, job.selections);
+					offset += colors.size();
+					stage.Next(L"write tile", colors.size());
+					stage.Copied(colors.size() * ((write_states ? sizeof(Data::Clouds::State) : 0) + (job.class_layer ? sizeof(StoredReal) : 0)));
+					for (std::size_t i = 0; i < colors.size(); i++, ++state)
+					{
+						if (write_states) *state = label_states[labels[i]];
+						write_class(labels[i]);
+					}
+				}
+			};
+			if (job.class_layer)
+			{
+				auto class_range = Data::Clouds::RangeLayer(points_all, *job.class_layer);
+				auto class_value = class_range.begin();
+				label_tiles([&](std::uint8_t label)
+				{
+					*class_value = label;
+					++class_value;
+				});
+			}
+			else
+			{
+				label_tiles([](std::uint8_t) {});
+			}
+			return job;
+		}, [&](ColorFilterJob & job)
+		{
+			if (suggest_thresholds || job.streamed) return;
+			ScopedStage stage(profile, L"color labels", job.colors.size());
+			job.counts = LabelColors(job.colors, box, regions, job.labels);
+			stage.Next(L"selections", job.colors.size());
+			AddLabelSelections(job.labels, job.colors.size(), 0, classes, job.selections);
+			stage.Next(L"write states", job.colors.size());
+
+			job.states.resize(write_states ? job.colors.size() : 0);
+			job.class_values.resize(job.class_layer ? job.colors.size() : 0);
+			ParallelFor(job.colors.size(), PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+			{
+				for (std::size_t i = begin; i < end; i++)
+				{
+					if (write_states) job.states[i] = label_states[job.labels[i]];
+					if (job.class_layer) job.class_values[i] = job.labels[i];
 				}
-				state++;
+			});
+		}, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node, ColorFilterJob & job)
+		{
+			if (suggest_thresholds)
+			{
+				ReportColorHistograms(job.histograms, { CHANNEL_RED, CHANNEL_GREEN, CHANNEL_BLUE, CHANNEL_H, CHANNEL_S, CHANNEL_L });
+				return;
 			}
+
+			if (!job.streamed)
+			{
+				ScopedStage stage(profile, L"write states", job.colors.size());
+				Data::Clouds::PointsRange points_all;
+				cloud.GetAccess().GetAllPoints(points_all);
+				if (write_states) points_all.SetStates(job.states);	//single write of all states
+				if (job.class_layer) points_all.SetLayerVals(job.class_values, *job.class_layer);
+				stage.Copied(job.states.size() * sizeof(Data::Clouds::State) + job.class_values.size() * sizeof(StoredReal));
+			}
+
+			int points_found = int(job.points - job.counts[0]);
 			OGX_LINE.Format(ogx::Info, L"%d points within selected range were found", points_found);
+			for (std::size_t k = 0; regions && k < m_classes.size(); k++)
+			{
+				OGX_LINE.Format(ogx::Info, L"%d points of class %ls", int(job.counts[k + 1]), m_classes[k].name.c_str());
+			}
+			StoreSelection(cloud, node, L"selected-by-color", job.selections[0].Finish(), profile);
+			for (std::size_t k = 0; k < classes; k++) StoreSelection(cloud, node, m_classes[k].name, job.selections[k + 1].Finish(), profile);
 		});
+		ReportStages(profile, trace_file);
 	}
 };
 
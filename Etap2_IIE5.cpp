@@ -18,9 +18,64 @@ Wersja: Beta_v1
 #include <ogx/Data/Clouds/SphericalSearchKernel.h>
 #include <ogx/Data/Primitives/PrimitiveHelpers.h>
 
+#include "ColumnViews.h"
+#include "ContentHash.h"
+#include "IndexStore.h"
+#include "LocalGeometry.h"
+#include "PluginHelpers.h"
+#include "QuantizedChannels.h"
+#include "SpatialIndex.h"
+
 using namespace ogx;
 using namespace ogx::Data;
 
+// Memory needed by one point of a tile: xyz, color, intensity sum, state, search tree entry and flags
+const std::size_t COLOR_INTENSITY_POINT_BYTES = sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color) + sizeof(IntensitySum) + sizeof(Data::Clouds::State) + 4 * sizeof(float) + 2;
+// Radius mode keeps the statistics source and the four statistics of every point too
+const std::size_t NEIGHBOURHOOD_STATISTICS_POINT_BYTES = COLOR_INTENSITY_POINT_BYTES + 5 * sizeof(StoredReal);
+
+// Neighbourhood statistics saved for the statistics layer, in the order NeighbourhoodStatistics writes them
+const wchar_t *STATISTICS_SUFFIXES[] = { L" mean", L" variance", L" min", L" max" };
+const int STATISTICS_COUNT = 4;
+
+// RGB to grayscale conversion
+StoredReal GrayIntensity(const Data::Clouds::Color &c)
+{
+	return StoredReal(1.0 / 3.0 * (c[0] + c[1] + c[2]));
+}
+
+// Finding the layers with the neighbourhood statistics of the source layer, created if there are none
+std::vector<Data::Layers::ILayer*> StatisticsLayers(CloudLayers & cloud_layers, const String &source)
+{
+	std::vector<Data::Layers::ILayer*> layers;
+	for (int k = 0; k < STATISTICS_COUNT; k++)
+	{
+		layers.push_back(&cloud_layers.Get(source + STATISTICS_SUFFIXES[k]));
+	}
+	return layers;
+}
+
+// Cloud searched by one run: read on the calling thread, searched on the pool and written back on the calling thread
+struct IntensityJob
+{
+	IntensityJob() : histograms(false), intensity_layer(nullptr), colors_stamp(), intensity_current(false), source_layer(false), points_found(0), iteration(0), streamed(false) {}
+
+	ColorHistograms histograms;				// suggested thresholds only
+	std::vector<Data::Clouds::Point3D> xyz_values;
+	std::vector<Data::Clouds::Color> colors;
+	Data::Layers::ILayer *intensity_layer;
+	std::vector<StoredReal> layer_values;	// intensity of every point
+	LayerStamp colors_stamp;
+	bool intensity_current;					// the stored intensity layer was computed from the same colors, it is not rewritten
+	std::vector<StoredReal> source_values;	// radius mode: copy of the source layer, empty for the heights or the intensity
+	bool source_layer;
+	std::vector<std::vector<StoredReal>> statistics;
+	std::vector<Data::Clouds::State> states;
+	int points_found;
+	int iteration;
+	bool streamed;							// searched and written in tiles while it was loaded
+};
+
 struct ColorIntensity : public ogx::Plugin::EasyMethod
 {
 	//fields
@@ -34,6 +89,14 @@ struct ColorIntensity : public ogx::Plugin::EasyMethod
 	int blue_min, blue_max;		// blue color range
 	int m_neighbours_count;			// number of neighbours
 	int intensity_min, intensity_max;
+	double memory_budget;		// MB for point data, bigger clouds are processed in tiles (0 - no limit)
+	double tile_halo;			// overlap loaded around each tile for the neighbour search
+	double neighbourhood_radius;	// radius of the neighbourhood statistics (0 - nearest neighbours are searched)
+	String statistics_layer;	// layer whose neighbourhood statistics are computed in the radius mode
+	bool suggest_thresholds;	// only the intensity histogram and suggested thresholds are logged if true
+	bool write_states;			// found points are selected in the states if true, only stored as a selection otherwise
+	String index_directory;		// spatial indexes of whole clouds are saved there for the next runs (empty - kept in memory only)
+	String trace_file;			// Chrome trace of the stages of every run (empty - not written)
 
 	//constructor
 	ColorIntensity() : EasyMethod(L"Mateusz Pielach", L"Intensity detection - IIE5")
@@ -55,6 +118,17 @@ struct ColorIntensity : public ogx::Plugin::EasyMethod
 
 		bank.Add(L"node_id", m_node_id = Data::ResourceID::invalid).AsNode();	//cloud choice
 		bank.Add(L"number of neighbours", m_neighbours_count = 10).Min(3);
+		bank.Add(L"write states", write_states = true, L"If not set, states of the points are left as they are, found points are only stored "
+			L"as the selection 'selected-by-intensity' (combined by the Selections method)");
+		bank.Add(L"memory budget", memory_budget = 0, L"Memory for point data in MB, bigger clouds are processed in tiles (0 - no limit)").Min(0);
+		bank.Add(L"tile halo", tile_halo = 1.0, L"Overlap loaded around each tile, should cover the neighbourhood of the points on tile edges").Min(0);
+		bank.Add(L"neighbourhood radius", neighbourhood_radius = 0, L"If set, mean, variance, min and max of the statistics layer within this radius are saved as layers "
+			L"and points with the mean within the intensity range are selected (0 - the nearest neighbours are searched instead)").Min(0);
+		bank.Add(L"statistics layer", statistics_layer = L"intensity layer", L"Layer whose neighbourhood statistics are computed, 'z' for the height of the points");
+		bank.Add(L"suggest thresholds", suggest_thresholds = false, L"If set, only the histogram of the color intensity is built in one pass and logged "
+			L"with the thresholds suggested for it (Otsu's and the valley between two peaks), the cloud is not changed");
+		bank.Add(L"index directory", index_directory = L"", L"If set, spatial indexes are saved in this directory and loaded by later runs on the same geometry");
+		bank.Add(L"trace file", trace_file = L"", L"If set, time of every stage is also written to this file as a Chrome trace (chrome://tracing, ui.perfetto.dev)");
 
 	}
 
@@ -69,34 +143,269 @@ struct ColorIntensity : public ogx::Plugin::EasyMethod
 		return EasyMethod::Init(context);
 	}
 
-	virtual void Run(Context& context)
+	// Checks if intensity of any of the nearest neighbours of the query point is within the range
+	template <typename Value>
+	bool NeighbourhoodInRange(const KdTree &search_tree, const float *query, const Value *values, std::uint32_t *neighbours, float *neighbours_distances) const
+	{
+		int neighbours_found = search_tree.FindNearest(query, m_neighbours_count, neighbours, neighbours_distances);
+		for (int n = 0; n < neighbours_found; n++)
+		{
+			if (IntensityInRange(values[neighbours[n]])) return true;
+		}
+		return false;
+	}
+
+	bool IntensityInRange(StoredReal value) const
+	{
+		return (value > intensity_min) && (value < intensity_max);
+	}
+
+	// the same test on R + G + B, without the division
+	bool IntensityInRange(IntensitySum sum) const
+	{
+		return IntensitySumInRange(sum, intensity_min, intensity_max);
+	}
+
+	// Source layer of the neighbourhood statistics, null for the intensity computed from the colors or the heights
+	Data::Layers::ILayer* StatisticsSourceLayer(CloudLayers & cloud_layers)
+	{
+		if (statistics_layer == L"z" || statistics_layer == L"intensity layer") return nullptr;
+		Data::Layers::ILayer *layer = cloud_layers.Find(statistics_layer);
+		if (!layer) ReportError(L"No layer " + statistics_layer + L" in the cloud");
+		return layer;
+	}
+
+	// Reports an error if the points span too many cells of the grid of the neighbourhood statistics
+	void CheckGridExtent(const std::vector<Data::Clouds::Point3D> &xyz)
+	{
+		String error = VoxelGridError(LargestExtent(xyz, xyz.size()), neighbourhood_radius / STATISTICS_CELLS_PER_RADIUS, L"neighbourhood radius");
+		if (!error.empty()) ReportError(error);
+	}
+
+	// Radius mode on the pool: statistics of the source values within the radius of every point (values are read in cell order)
+	void ComputeStatistics(IntensityJob &job, StageProfile &profile)
+	{
+		const std::vector<Data::Clouds::Point3D> &xyz_values = job.xyz_values;
+		ChannelView values = job.source_layer ? MakeChannelView(job.source_values.data()) :
+			(statistics_layer == L"z" ? CoordinateView(xyz_values, 2) : MakeChannelView(job.layer_values.data()));
+
+		// per voxel sums, a query adds up the voxels around the point instead of searching for its neighbours
+		ScopedStage stage(profile, L"voxel grid", xyz_values.size());
+		std::shared_ptr<const VoxelHashGrid> grid = SharedSpatialIndexes().VoxelGridOf(xyz_values, GeometryVersionOf(xyz_values),
+			float(neighbourhood_radius / STATISTICS_CELLS_PER_RADIUS), index_directory);
+
+		stage.Next(L"neighbourhood statistics", xyz_values.size());
+		std::vector<std::vector<StoredReal>> &statistics = job.statistics;
+		statistics.assign(STATISTICS_COUNT, std::vector<StoredReal>(xyz_values.size()));
+		NeighbourhoodStatistics(*grid, neighbourhood_radius, values, statistics[0].data(), statistics[1].data(), statistics[2].data(), statistics[3].data());
+
+		stage.Next(L"write states", xyz_values.size());
+		std::vector<Data::Clouds::State> &states = job.states;
+		states.resize(xyz_values.size());
+		job.points_found = ParallelReduce(states.size(), PARALLEL_GRAIN, 0, [&](std::size_t begin, std::size_t end)
+		{
+			int found = 0;
+			for (std::size_t i = begin; i < end; i++)
+			{
+				states[i].reset();
+				if (IntensityInRange(statistics[0][i]))
+				{
+					states[i].set(Data::Clouds::PS_SELECTED);
+					found++;
+				}
+			}
+			return found;
+		}, std::plus<int>());
+	}
+
+	// Radius mode, written back on the calling thread
+	void WriteStatistics(CloudLayers & cloud_layers, Data::Clouds::PointsRange &points_all, const IntensityJob &job, StageProfile &profile)
 	{
-		Data::Clouds::ForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node)
+		ScopedStage stage(profile, L"write statistics", job.xyz_values.size());
+		auto layers = StatisticsLayers(cloud_layers, statistics_layer);
+		for (int k = 0; k < STATISTICS_COUNT; k++) points_all.SetLayerVals(job.statistics[k], *layers[k]);
+		stage.Copied(STATISTICS_COUNT * job.xyz_values.size() * sizeof(StoredReal));
+	}
+
+	// Cloud bigger than the memory budget: spatial tiles are loaded together with a halo around them, searched
+	// and written back one by one. Neighbours are exact as long as they lie within the halo of the tile.
+	// The points of every tile are sorted into lists in one pass, each tile then visits only its own points.
+	int RunTiled(Clouds::ICloud & cloud, const Nodes::ITransTreeNode & node, CloudLayers & cloud_layers, Data::Clouds::PointsRange &points_all, Data::Layers::ILayer &layer, std::size_t tile_points, StageProfile &profile)
+	{
+		ScopedStage stage(profile, L"tile planning", 3 * points_all.size());
+		// the statistics are exact when the halo covers their radius
+		const bool radius_mode = neighbourhood_radius > 0;
+		TilePlan plan;
+		PlanTiles(points_all, tile_points, radius_mode ? std::max(tile_halo, neighbourhood_radius) : tile_halo, plan);
+		TileMembers tiles(plan);
+		SortTilePoints(points_all, tiles);
+		OGX_LINE.Format(ogx::Info, L"Cloud processed in %d tiles", int(plan.TileCount()));
+
+		auto xyz_range = Data::Clouds::RangeLocalXYZConst(points_all);
+		auto color_range = Data::Clouds::RangeColorConst(points_all);
+		auto state_range = Data::Clouds::RangeState(points_all);
+		auto layer_range = Data::Clouds::RangeLayer(points_all, layer);
+
+		// radius mode: source of the statistics and the layers they are written to
+		Data::Layers::ILayer *source_layer = radius_mode ? StatisticsSourceLayer(cloud_layers) : nullptr;
+		const bool gray_source = radius_mode && !source_layer && statistics_layer != L"z";
+		std::vector<Data::Layers::ILayer*> statistics_layers;
+		if (radius_mode) statistics_layers = StatisticsLayers(cloud_layers, statistics_layer);
+
+		int points_found = 0;
+		std::vector<std::uint64_t> selected(MaskWords(points_all.size()), 0);		// found points of all tiles
+		std::vector<Data::Clouds::Point3D> tile_xyz;
+		std::vector<IntensitySum> tile_intensity;
+		std::vector<StoredReal> tile_source;
+		std::vector<std::vector<StoredReal>> tile_statistics(statistics_layers.size());
+		std::vector<std::uint8_t> tile_selected;
+		for (std::size_t t = 0; t < plan.TileCount(); t++)
 		{
+			// load the tile with its halo, intensity straight from the colors
+			const std::vector<std::uint32_t> &members = tiles.Points(t);
+			const std::vector<std::uint8_t> &tile_core = tiles.Core(t);		// point belongs to the tile, not to the halo
+			stage.Next(L"load tile", members.size());
+			tile_xyz.resize(members.size());
+			tile_intensity.resize(members.size());
+			tile_source.clear();
+			{
+				auto xyz = CursorOf(xyz_range);
+				auto c = CursorOf(color_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					tile_xyz[i] = xyz.At(members[i]);
+					const Data::Clouds::Color &color = c.At(members[i]);
+					tile_intensity[i] = IntensitySumOf(reinterpret_cast<const std::uint8_t*>(&color));
+					if (gray_source) tile_source.push_back(GrayIntensity(color));
+				}
+			}
+			if (source_layer)
+			{
+				auto source_range = Data::Clouds::RangeLayer(points_all, *source_layer);
+				auto source = CursorOf(source_range);
+				for (std::uint32_t point : members) tile_source.push_back(source.At(point));
+			}
+			else if (radius_mode && statistics_layer == L"z")
+			{
+				for (auto& xyz : tile_xyz) tile_source.push_back(StoredReal(xyz.z()));
+			}
+
+			stage.Copied(tile_xyz.size() * (sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color)) + tile_source.size() * sizeof(StoredReal));
+			if (radius_mode) CheckGridExtent(tile_xyz);
+
+			tile_selected.assign(tile_xyz.size(), 0);
+			if (radius_mode)
+			{
+				stage.Next(L"neighbourhood statistics", tile_xyz.size());
+				VoxelHashGrid grid;
+				grid.Build(tile_xyz, tile_xyz.size(), float(neighbourhood_radius / STATISTICS_CELLS_PER_RADIUS));
+				for (auto& values : tile_statistics) values.resize(tile_xyz.size());
+				NeighbourhoodStatistics(grid, neighbourhood_radius, tile_source.data(),
+					tile_statistics[0].data(), tile_statistics[1].data(), tile_statistics[2].data(), tile_statistics[3].data());
+				for (std::size_t i = 0; i < tile_xyz.size(); i++)
+				{
+					if (tile_core[i] && IntensityInRange(tile_statistics[0][i]))
+					{
+						tile_selected[i] = 1;
+						points_found++;
+					}
+				}
+			}
+			else
+			{
+				stage.Next(L"kd-tree build", tile_xyz.size());
+				KdTree search_tree;
+				search_tree.Build(tile_xyz, tile_xyz.size());
+				stage.Next(L"nearest neighbours", plan.TilePoints(t));
+				points_found += ParallelReduce(search_tree.Size(), PARALLEL_GRAIN / 16, 0, [&](std::size_t begin, std::size_t end)
+				{
+					int found = 0;
+					std::vector<std::uint32_t> neighbours(m_neighbours_count);
+					std::vector<float> neighbours_distances(m_neighbours_count);
+					for (std::size_t pos = begin; pos < end; pos++)
+					{
+						std::size_t i = search_tree.IndexAt(pos);
+						if (!tile_core[i]) continue;
+						if (NeighbourhoodInRange(search_tree, search_tree.PointAt(pos), tile_intensity.data(), neighbours.data(), neighbours_distances.data()))
+						{
+							tile_selected[i] = 1;
+							found++;
+						}
+					}
+					return found;
+				}, std::plus<int>());
+			}
+
+			// write states, intensity and statistics of the points of the tile back
+			stage.Next(L"write tile", members.size());
+			stage.Copied(plan.TilePoints(t) * (sizeof(Data::Clouds::State) + (1 + statistics_layers.size()) * sizeof(StoredReal)));
+			{
+				auto state = CursorOf(state_range);
+				auto value = CursorOf(layer_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					if (!tile_core[i]) continue;
+					const std::size_t point = members[i];
+					if (tile_selected[i]) selected[point / 64] |= std::uint64_t(1) << (point % 64);
+					if (write_states)
+					{
+						Data::Clouds::State &point_state = state.At(point);
+						point_state.reset();
+						if (tile_selected[i]) point_state.set(Data::Clouds::PS_SELECTED);
+					}
+					value.At(point) = IntensityOfSum(tile_intensity[i]);
+				}
+			}
+			for (std::size_t k = 0; k < statistics_layers.size(); k++)
+			{
+				auto statistics_range = Data::Clouds::RangeLayer(points_all, *statistics_layers[k]);
+				auto value = CursorOf(statistics_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					if (tile_core[i]) value.At(members[i]) = tile_statistics[k][i];
+				}
+			}
+			tiles.Release(t);
+		}
+		StoreSelection(cloud, node, L"selected-by-intensity", PointSelection::OfMask(selected.data(), points_all.size()), profile);
+		return points_found;
+	}
 
+	virtual void Run(Context& context)
+	{
+		ThreadPoolRun pool_run;
+		SpatialIndexRun index_run;
+		StageProfile profile;
+		ParallelForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node)
+		{
+			IntensityJob job;
 			//access points in the cloud
 			Data::Clouds::PointsRange points_all;
 			cloud.GetAccess().GetAllPoints(points_all);
+			CloudLayers layers(cloud);
 
-			//get xyz values, color
-			std::vector<Data::Clouds::Point3D> xyz_values;
-			points_all.GetXYZ(xyz_values);
-			std::vector<Data::Clouds::Color> color_original;
-			points_all.GetColors(color_original);
-			auto point = context.Feedback().GetFocusPoint();
+			if (suggest_thresholds)
+			{
+				ScopedStage stage(profile, L"intensity histogram", points_all.size());
+				job.histograms = StreamColorHistograms(points_all, TilePointsForBudget(memory_budget, sizeof(Data::Clouds::Color)), false);
+				return job;
+			}
 
-			auto xyz_r = Data::Clouds::RangeLocalXYZConst(points_all);
-			auto color_r = Data::Clouds::RangeColorConst(points_all);
-			auto normal_r = Data::Clouds::RangeLocalNormalConst(points_all);
-			auto state_r = Data::Clouds::RangeState(points_all);
-			auto xyz = xyz_r.begin();
-			auto state = state_r.begin();
-			auto normal = normal_r.begin();
-			auto color = color_r.begin();
+			std::size_t tile_points = TilePointsForBudget(memory_budget, neighbourhood_radius > 0 ? NEIGHBOURHOOD_STATISTICS_POINT_BYTES : COLOR_INTENSITY_POINT_BYTES);
+			if (tile_points != 0 && points_all.size() > tile_points)
+			{
+				// tiles are loaded, searched and written back one by one while the cloud is loaded
+				job.streamed = true;
+				job.points_found = RunTiled(cloud, node, layers, points_all, layers.Get(L"intensity layer"), tile_points, profile);
+				return job;
+			}
 
-			// initialize buffer for the output xyz coordinates
-			std::vector<StoredPoint3D> buff_out;
-			buff_out.reserve(points_all.size());
+			//get xyz values, color
+			ScopedStage stage(profile, L"load points", points_all.size());
+			points_all.GetXYZ(job.xyz_values);
+			points_all.GetColors(job.colors);
+			stage.Copied(job.xyz_values.size() * (sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color)));
+			auto point = context.Feedback().GetFocusPoint();
 
 
 			////Layers processing
@@ -104,126 +413,183 @@ struct ColorIntensity : public ogx::Plugin::EasyMethod
 			//auto layer_list = cloud.FindLayers(L"layer_name");
 			//if (layer_list.empty()) ReportError(L"No layers found");
 
-			std::vector<StoredReal> layer_values; // store values
+			stage.Next(L"intensity", job.colors.size());
+			job.intensity_layer = &layers.Get(L"intensity layer");
 
-			for (auto & c : color_original)
+			// the layer is computed only from colors - if they did not change since the last run, the stored layer need not be written again
+			job.colors_stamp.source_hash = ParallelContentHash(job.colors.data(), job.colors.size() * sizeof(Data::Clouds::Color));
+			job.colors_stamp.points = job.colors.size();
+			if (SharedLayerCache().IsCurrent(&cloud, job.intensity_layer, job.colors_stamp))
 			{
-				layer_values.push_back(double(1.0 / 3.0 * (c[0] + c[1] + c[2])));	// RGB to grayscale conversion
+				job.intensity_current = true;
+				OGX_LINE.Msg(ogx::Debug, L"Colors unchanged, intensity layer is not rewritten");
 			}
 
-			auto v_sLayerName = L"intensity layer";
-			Data::Layers::ILayer *layer;
-			auto layers = cloud.FindLayers(v_sLayerName);
-			// check if already exist layer
-			if (!layers.empty())
+			if (neighbourhood_radius > 0)
 			{
-				layer = layers[0];
+				CheckGridExtent(job.xyz_values);
+				// heights and intensity are read in place, only a source layer is copied
+				stage.Next(L"statistics source", points_all.size());
+				Data::Layers::ILayer *source_layer = StatisticsSourceLayer(layers);
+				job.source_layer = source_layer != nullptr;
+				if (source_layer) points_all.GetLayerVals(job.source_values, *source_layer);
+				stage.Copied(job.source_values.size() * sizeof(StoredReal));
 			}
-			else
+			return job;
+		}, [&](IntensityJob & job)
+		{
+			if (suggest_thresholds || job.streamed) return;
+			const std::vector<Data::Clouds::Point3D> &xyz_values = job.xyz_values;
+			const std::vector<Data::Clouds::Color> &color_original = job.colors;
+			std::vector<StoredReal> &layer_values = job.layer_values; // store values
 			{
-				layer = cloud.CreateLayer(v_sLayerName, 0); // 0 - default value
+				// computed even if the stored layer is current - cheaper than reading it back
+				ScopedStage stage(profile, L"intensity", color_original.size());
+				layer_values.resize(color_original.size());
+				ParallelFor(color_original.size(), PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+				{
+					for (std::size_t i = begin; i < end; i++)
+					{
+						layer_values[i] = GrayIntensity(color_original[i]);
+					}
+				});
 			}
 
-			points_all.SetLayerVals(layer_values, *layer); // saving layer to cloud
-
+			if (neighbourhood_radius > 0)
+			{
+				ComputeStatistics(job, profile);
+				return;
+			}
 
 			////Neighbours
-			int points_found = 0;
-
-
-
 
 			//auto sphere = Math::CalcBestSphere3D(xyz_values.begin(), xyz_values.end());
 
 
 			////////////////////////////////Neighbour search
 
-			// initialize search over neighboring points (spherical kernel can be used instead Data::Clouds::SphericalSearchKernel)
-			Data::Clouds::KNNSearchKernel search_knn(Math::Point3D::Zero(), m_neighbours_count);
+			// new states of all points, written back to the cloud once
+			std::vector<Data::Clouds::State> &states = job.states;
+			states.resize(xyz_values.size());
 
-			int iteration = 0;
-
-			// search for N points around the current point
-			Data::Clouds::PointsRange neighbours;	//points from neighbourhood
-			std::vector<Data::Clouds::Point3D> neighbours_xyz_values;
-			std::vector<Data::Clouds::Color> neighbours_color;		//color values 
+			// points and iterations found by each chunk, merged in chunk order
+			struct SearchTally
+			{
+				int points_found;
+				int iteration;
+			};
+			SearchTally tally = { 0, 0 };
+
+			// spatial index of the cloud, built only if no run has one for this geometry - neighbours come back
+			// as indices into xyz_values and layer_values
+			ScopedStage stage(profile, L"kd-tree", xyz_values.size());
+			std::shared_ptr<const KdTree> shared_tree = SharedSpatialIndexes().KdTreeOf(xyz_values, GeometryVersionOf(xyz_values), index_directory);
+			const KdTree &search_tree = *shared_tree;
+
+			// queries are answered in batches of consecutive points in tree order (neighbouring points share tree leaves)
+			stage.Next(L"nearest neighbours", search_tree.Size());
+			tally = ParallelReduce(search_tree.Size(), PARALLEL_GRAIN / 16, tally, [&](std::size_t begin, std::size_t end)
+			{
+				SearchTally chunk = { 0, 0 };
 
-			auto neighbours_state_range = Data::Clouds::RangeState(points_all);
-			auto neighbour_state = neighbours_state_range.begin();
+				// search for N points around the current point
+				std::vector<std::uint32_t> neighbours(m_neighbours_count);	//points from neighbourhood
+				std::vector<float> neighbours_distances(m_neighbours_count);
 
-			std::vector<StoredReal> intensity_values;		//store gray values
-			auto intensity = intensity_values.begin();
+				for (std::size_t pos = begin; pos < end; pos++)
+				{
+					std::size_t i = search_tree.IndexAt(pos);
+					auto & state = states[i];
+					state.reset();
 
-			for (auto& xyz : Data::Clouds::RangeLocalXYZConst(points_all)) 
-			{
-				// clear parameters from last iteration
-				state->reset();
-				neighbours.clear();
-				neighbours_xyz_values.clear();
-				neighbours_color.clear();
-				intensity_values.clear();
+					chunk.iteration++; // debug
 
-				iteration++; // debug
-				// update the center of the search
-				search_knn.GetPoint() = xyz.cast<Math::Point3D::Scalar>();
+					// search for N points around the current point and check their intensity
+					bool selected = NeighbourhoodInRange(search_tree, search_tree.PointAt(pos), layer_values.data(), neighbours.data(), neighbours_distances.data());
 
-				// search for N points around the current point
-				cloud.GetAccess().FindPoints(search_knn, neighbours);
-				//now I can access points from neighbourhood
+					//debug
+					//OGX_LINE.Format(ogx::Debug, L"%d Ejej", points_found);
 
+					//OGX_LINE.Format(ogx::Info, L"%d iteracja", iteration);
 
-				////get neighbours' xyz and colors
-				neighbours.GetXYZ(neighbours_xyz_values);
-				neighbours.GetColors(neighbours_color);
-				neighbours.GetLayerVals(intensity_values, *layer);	//get layer values to vector intensity_values
+					//Trzeba zrobi tak e liczy w skali szarosci srednia z otoczenia i wstawia t warto w ten nowy punkt!
 
-				//debug
-				//OGX_LINE.Format(ogx::Debug, L"%d Ejej", points_found);
+					if (selected)
+					{
+						state.set(Data::Clouds::PS_SELECTED); //select point (from original cloud)
+						chunk.points_found++;
+					}
 
-				//OGX_LINE.Format(ogx::Info, L"%d iteracja", iteration);
+					//////loop which looks for points which are within color range 
+					//for (auto & c : neighbours_color)
+					//{
+					//	//state->reset(); //reset states (bring back original state for each point)
+					//	if ((c[0] > red_min) && (c[1] > green_min) && (c[2] > blue_min) && (c[0] < red_max) && (c[1] < green_max) && (c[2] < blue_max))
+					//	{
+					//		state->set(Data::Clouds::PS_SELECTED); //select point (from original cloud)
+					//		points_found++;
+					//	}
+					//	neighbour_state++; //move to next point (neighbourhood)
+					//}
 
-				intensity_values.reserve(neighbours.size());
 
-				//Trzeba zrobi tak e liczy w skali szarosci srednia z otoczenia i wstawia t warto w ten nowy punkt!
+					//debug
+					//OGX_LINE.Format(ogx::Debug, L"%d points were found", points_found);
 
-				// For all points included in the neighbourhood
-				for (auto & value : Data::Clouds::RangeLayer(neighbours, *layer))
-				{
-					if((value > intensity_min) && (value < intensity_max))
-					state->set(Data::Clouds::PS_SELECTED); //select point (from original cloud)
+					//// fit a plane to the neighboring points and calculate projection of the current point on the plane
+					//Math::Point3D proj_xyz = Math::ProjectPointOntoPlane(Math::CalcBestPlane3D(neighbor_xyz.begin(), neighbor_xyz.end()), xyz.cast<Math::Point3D::Scalar>());
+					//buff_out.push_back(proj_xyz.cast<StoredPoint3D::Scalar>());
 				}
+				return chunk;
+			}, [](SearchTally a, SearchTally b)
+			{
+				SearchTally sum = { a.points_found + b.points_found, a.iteration + b.iteration };
+				return sum;
+			});
 
-				//////loop which looks for points which are within color range 
-				//for (auto & c : neighbours_color)
-				//{
-				//	//state->reset(); //reset states (bring back original state for each point)
-				//	if ((c[0] > red_min) && (c[1] > green_min) && (c[2] > blue_min) && (c[0] < red_max) && (c[1] < green_max) && (c[2] < blue_max))
-				//	{
-				//		state->set(Data::Clouds::PS_SELECTED); //select point (from original cloud)
-				//		points_found++;
-				//	}
-				//	neighbour_state++; //move to next point (neighbourhood)
-				//}
-
-
-				//debug
-				//OGX_LINE.Format(ogx::Debug, L"%d points were found", points_found);
+			job.points_found = tally.points_found;
+			job.iteration = tally.iteration;
+		}, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node, IntensityJob & job)
+		{
+			if (suggest_thresholds)
+			{
+				ReportColorHistograms(job.histograms, { CHANNEL_INTENSITY });
+				return;
+			}
+			if (job.streamed)
+			{
+				OGX_LINE.Format(ogx::Debug, L"%d points were found", job.points_found);
+				return;
+			}
 
-				//// fit a plane to the neighboring points and calculate projection of the current point on the plane
-				//Math::Point3D proj_xyz = Math::ProjectPointOntoPlane(Math::CalcBestPlane3D(neighbor_xyz.begin(), neighbor_xyz.end()), xyz.cast<Math::Point3D::Scalar>());
-				//buff_out.push_back(proj_xyz.cast<StoredPoint3D::Scalar>());
-				state++;
+			Data::Clouds::PointsRange points_all;
+			cloud.GetAccess().GetAllPoints(points_all);
+			CloudLayers layers(cloud);
+			if (!job.intensity_current)
+			{
+				ScopedStage stage(profile, L"intensity", job.layer_values.size());
+				points_all.SetLayerVals(job.layer_values, *job.intensity_layer); // saving layer to cloud
+				stage.Copied(job.layer_values.size() * sizeof(StoredReal));
+				SharedLayerCache().Store(&cloud, job.intensity_layer, job.colors_stamp);
 			}
+			if (neighbourhood_radius > 0) WriteStatistics(layers, points_all, job, profile);
+
+			const std::vector<Data::Clouds::State> &states = job.states;
+			ScopedStage stage(profile, L"write states", states.size());
+			if (write_states) points_all.SetStates(states);
+			stage.Copied(write_states ? states.size() * sizeof(Data::Clouds::State) : 0);
+			StoreSelection(cloud, node, L"selected-by-intensity", PointSelection::Of(states.size(), [&](std::size_t i) { return states[i].test(Data::Clouds::PS_SELECTED); }), profile);
 
-			OGX_LINE.Format(ogx::Debug, L"%d points were found", points_found);
+			OGX_LINE.Format(ogx::Debug, L"%d points were found", job.points_found);
 
 			// replace the cloud xyz coordinates with the smoothed ones
 			//points_all.SetXYZ(buff_out);
 
 
 			//debug
-			OGX_LINE.Format(ogx::Debug, L"%d iteracji", iteration);
+			if (neighbourhood_radius <= 0) OGX_LINE.Format(ogx::Debug, L"%d iteracji", job.iteration);
 		});
+		ReportStages(profile, trace_file);
 	}
 
 };
@@ -17,9 +17,34 @@ Wersja: v3
 #include <ogx/Data/Clouds/SphericalSearchKernel.h>
 #include <ogx/Data/Primitives/PrimitiveHelpers.h>
 
+#include <cstring>
+#include <map>
+#include <memory>
+
+#include "AreaPreview.h"
+#include "AreaRaster.h"
+#include "Classification.h"
+#include "ClassificationRules.h"
+#include "ColorKernels.h"
+#include "ColumnViews.h"
+#include "ContentHash.h"
+#include "IndexStore.h"
+#include "LocalGeometry.h"
+#include "PluginHelpers.h"
+#include "QuantizedChannels.h"
+#include "Reductions.h"
+#include "Simplification.h"
+#include "StageGraph.h"
+#include "ThreadPool.h"
+
 using namespace ogx;
 using namespace ogx::Data;
 
+// Memory needed by one point of a tile: xyz, color, H and L codes, plane error, state, grid entry, feature class and flag
+const std::size_t AREAS_DETECTION_POINT_BYTES = sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color) + 2 * sizeof(std::uint16_t) + sizeof(StoredReal) + sizeof(Data::Clouds::State) + 8 * sizeof(float) + 2;
+// H, S, L values kept for the layers, only when they are saved
+const std::size_t HSL_LAYERS_POINT_BYTES = 3 * sizeof(StoredReal);
+
 // Homogeneous simplification: gives quasi-constant distance between points
 void CloudSimplification(Execution::Context& context, Data::ResourceID &m_node_id, double &minimal_distance)
 {
@@ -29,57 +54,95 @@ void CloudSimplification(Execution::Context& context, Data::ResourceID &m_node_i
 	context.Execution().ExecuteAlgorithmSync(L"Clouds_Simplification.HomogeneousSimplification", in);
 }
 
-// Converting RGB to HSL, output as data layers H, S, L.
-void RGB2HSL(Execution::Context& context, Data::ResourceID &m_node_id)
+// Homogeneous simplification in place: bitmask of the representative points, nothing is copied.
+// The grid must have cells of the minimal distance.
+std::vector<std::uint64_t> SimplifiedRepresentatives(const VoxelHashGrid &grid, double minimal_distance)
 {
-	ogx::Execution::Parameters in;
-	in[L"node_id"] = m_node_id;
-	context.Execution().ExecuteAlgorithmSync(L"Clouds_ColorProcessing.RGBtoHSL", in);
+	std::vector<std::uint64_t> representatives;
+	HomogeneousRepresentatives(grid, minimal_distance, representatives);
+	return representatives;
 }
 
-// Calculating plane fitting error
-void PlaneFittingError(Execution::Context& context, Data::ResourceID &m_node_id)
+std::vector<std::uint64_t> SimplifiedRepresentatives(std::vector<Data::Clouds::Point3D> &xyz, double minimal_distance)
 {
-	float radius = 1.000000;		// Arbitrary value, set a priori
-	ogx::Execution::Parameters in;
-	in[L"node_id"] = m_node_id;
-	in[L"radius"] = radius;
-	in[L"layer_name_contains_radius"] = false;
-	context.Execution().ExecuteAlgorithmSync(L"Clouds_LocalApproximation.PlaneErr", in);
+	VoxelHashGrid grid;
+	grid.Build(xyz, xyz.size(), float(minimal_distance));
+	return SimplifiedRepresentatives(grid, minimal_distance);
 }
 
-// Creating a new layer
-Data::Layers::ILayer* CreateLayer(Clouds::ICloud & cloud, const wchar_t *v_sLayerName)
+// Converting RGB to HSL straight from the loaded colors, in parallel chunks.
+// Only the channels with an output (not null) are computed.
+void RGB2HSL(std::vector<Data::Clouds::Color> &color, StoredReal *H, StoredReal *S, StoredReal *L)
 {
-	Data::Layers::ILayer *layer;
-	auto layers = cloud.FindLayers(v_sLayerName);
-	// Check if there is a layer
-	if (!layers.empty())
+	static_assert(sizeof(StoredReal) == sizeof(float), "HSL kernel writes float channels");
+	const std::uint8_t *color_bytes = reinterpret_cast<const std::uint8_t*>(color.data());
+	const std::size_t stride = sizeof(Data::Clouds::Color);
+	ParallelFor(color.size(), PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
 	{
-		layer = layers[0];
-	}
-	else
+		RgbToHslChannels(color_bytes + begin * stride, stride, end - begin, H ? H + begin : nullptr, S ? S + begin : nullptr, L ? L + begin : nullptr);
+	});
+}
+
+// 16-bit H and L codes of the loaded colors, used by the classification instead of the float channels
+void RGB2HLCodes(std::vector<Data::Clouds::Color> &color, std::vector<std::uint16_t> &H, std::vector<std::uint16_t> &L)
+{
+	const std::uint8_t *color_bytes = reinterpret_cast<const std::uint8_t*>(color.data());
+	const std::size_t stride = sizeof(Data::Clouds::Color);
+	H.resize(color.size());
+	L.resize(color.size());
+	ParallelFor(color.size(), PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
 	{
-		layer = cloud.CreateLayer(v_sLayerName, 0); // 0 - default value
-	}
-	return layer;
+		RgbToHlCodes(color_bytes + begin * stride, stride, end - begin, H.data() + begin, L.data() + begin);
+	});
 }
 
-// Creating a new layer in simplified cloud
-Data::Layers::ILayer* CreateLayerSimplified(Clouds::ICloud * cloud, const wchar_t *v_sLayerName)
+// Inputs of the classification rules, read in place from the loaded channels (xyz straight from the loaded points)
+RuleInputs ClassificationInputs(const std::vector<std::uint16_t> &H, const std::vector<std::uint16_t> &L, const std::vector<Data::Clouds::Color> &color,
+	ChannelView plane_error, const std::vector<Data::Clouds::Point3D> &xyz, const GroundRaster *ground, double mean_height)
 {
-	Data::Layers::ILayer *layer;
-	layer = cloud->CreateLayer(v_sLayerName, 0); // 0 - default value
-	return layer;
+	RuleInputs inputs;
+	inputs.H = H.data();
+	inputs.L = L.data();
+	inputs.colors = reinterpret_cast<const std::uint8_t*>(color.data());
+	inputs.color_stride = sizeof(Data::Clouds::Color);
+	inputs.plane_error = plane_error;
+	inputs.x = CoordinateView(xyz, 0);
+	inputs.y = CoordinateView(xyz, 1);
+	inputs.z = CoordinateView(xyz, 2);
+	inputs.ground = ground;
+	inputs.count = color.size();
+	inputs.mean_height = mean_height;
+	return inputs;
 }
 
-// Creating a new cloud
-Data::Clouds::ICloud * CreateCloud(Nodes::ITransTreeNode* m_node, Execution::Context& context, const wchar_t *CloudName, const wchar_t *NodeName, Data::ResourceID &child_id)
+// Calculating plane fitting error: RMS distance of the points within the radius to their best fitting plane.
+// The grid must have cells of radius / PLANE_FIT_CELLS_PER_RADIUS.
+std::vector<StoredReal> PlaneFittingError(const VoxelHashGrid &grid, double radius)
+{
+	std::vector<StoredReal> PlaneError(grid.Size());
+	PlaneFittingErrors(grid, radius, PlaneError.data());
+	return PlaneError;
+}
+
+std::vector<StoredReal> PlaneFittingError(std::vector<Data::Clouds::Point3D> &xyz, double radius)
+{
+	VoxelHashGrid grid;		// neighbourhood index, built once for all points
+	grid.Build(xyz, xyz.size(), float(radius / PLANE_FIT_CELLS_PER_RADIUS));
+	return PlaneFittingError(grid, radius);
+}
+
+// Creating a new cloud element
+Nodes::IElement * CreateCloudElement(Execution::Context& context, const wchar_t *CloudName)
 {
 	auto created_elem = context.Project().ElementCreate<Data::Clouds::ICloud>();
 	created_elem->Rename(CloudName);
+	return created_elem;
+}
 
-	Data::ResourceID m_cloud_id = created_elem->GetID();
+// Creating a new cloud
+Data::Clouds::ICloud * CreateCloud(Nodes::ITransTreeNode* m_node, Execution::Context& context, const wchar_t *CloudName, const wchar_t *NodeName, Data::ResourceID &child_id)
+{
+	auto created_elem = CreateCloudElement(context, CloudName);
 	Data::Clouds::ICloud * new_cloud = created_elem->GetData<Data::Clouds::ICloud>();
 
 	// Attach cloud element to tree node
@@ -90,157 +153,131 @@ Data::Clouds::ICloud * CreateCloud(Nodes::ITransTreeNode* m_node, Execution::Con
 	return new_cloud;
 }
 
-// Get values from H channel
-std::vector<StoredReal> GetHValues(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number)
-{
-	auto H_layer = cloud.FindLayers(L"H");
-	std::vector<StoredReal> H_values;
-	H_values.reserve(points_number);
-	points_all.GetLayerVals(H_values, *H_layer[0]);
-	return H_values;
-}
-
-// Get values from S channel
-std::vector<StoredReal> GetSValues(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number)
-{
-	auto S_layer = cloud.FindLayers(L"S");
-	std::vector<StoredReal> S_values;
-	S_values.reserve(points_number);
-	points_all.GetLayerVals(S_values, *S_layer[0]);
-	return S_values;
-}
+// Name of the node of the simplified cloud, a child of the node of its source cloud
+const wchar_t* const SIMPLIFIED_CLOUD_NAME = L"Simplified cloud";
 
-// Get values from L channel
-std::vector<StoredReal> GetLValues(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number)
+// Versions of the data the simplified clouds were made from, by the ID of their nodes
+std::map<Data::ResourceID, LayerStamp>& SimplifiedStamps()
 {
-	auto L_layer = cloud.FindLayers(L"L");
-	std::vector<StoredReal> L_values;
-	L_values.reserve(points_number);
-	points_all.GetLayerVals(L_values, *L_layer[0]);
-	return L_values;
+	static std::map<Data::ResourceID, LayerStamp> stamps;
+	return stamps;
 }
 
-// Get plane fitting error values
-std::vector<StoredReal> GetPlaneErrorValues(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number)
+// Checking if the node holds a simplified cloud made by this method - found by its name under a cloud node,
+// so also after the project is reloaded
+bool IsSimplifiedCloudNode(Nodes::ITransTreeNode & node)
 {
-	auto PlaneFitError_layer = cloud.FindLayers(L"plane_fitting_err");
-	std::vector<StoredReal> PlaneError;
-	PlaneError.reserve(points_number);
-	points_all.GetLayerVals(PlaneError, *PlaneFitError_layer[0]);
-	return PlaneError;
+	Nodes::ITransTreeNode *parent = node.GetParent();
+	return node.GetName() == SIMPLIFIED_CLOUD_NAME && parent && parent->GetElement() && parent->GetElement()->GetData<Clouds::ICloud>();
 }
 
-// Creating a layer with height values (z)
-std::vector<StoredReal> GetHeightValues(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number, std::vector<Data::Clouds::Point3D> &xyz)
+// Node of the simplified cloud made for the cloud of the node by a previous run, null if there is none
+Nodes::ITransTreeNode * FindSimplifiedCloudNode(Nodes::ITransTreeNode & source_node)
 {
-	Data::Layers::ILayer *z_layer = CreateLayer(cloud, L"z value"); // Z values
-	std::vector<StoredReal> z_layer_values;
-	z_layer_values.reserve(points_number);
-	for (int i = 0; i < points_number; i++)
+	Nodes::ITransTreeNode *found = nullptr;
+	Data::Clouds::ForEachCloud(source_node, [&](Clouds::ICloud &, Nodes::ITransTreeNode & node)
 	{
-		z_layer_values.push_back(xyz[i].z());
-	}
-	points_all.SetLayerVals(z_layer_values, *z_layer);
-
-	return z_layer_values;
+		if (!found && node.GetParent() == &source_node && IsSimplifiedCloudNode(node)) found = &node;
+	});
+	return found;
 }
 
-// Calculating mean z value (height)
-float MeanHeightValue(Clouds::ICloud & cloud, Data::Clouds::PointsRange &points_all, int points_number, std::vector<Data::Clouds::Point3D> &xyz)
+// Version of the simplification input: content of xyz and colors, and the minimal distance
+LayerStamp SimplificationStamp(std::vector<Data::Clouds::Color> &color, std::vector<Data::Clouds::Point3D> &xyz, double minimal_distance)
 {
-	float mean_height_value = 0;
-	for (int i = 0; i < points_number; i++)
-	{
-		mean_height_value = mean_height_value + xyz[i].z();		// Sum of 'z'
-	}
-	mean_height_value = mean_height_value / points_number;	// Calculate mean value of z
-
-	return mean_height_value;
+	std::uint64_t distance_bits;
+	std::memcpy(&distance_bits, &minimal_distance, sizeof(distance_bits));
+	std::uint64_t xyz_hash = ParallelContentHash(xyz.data(), xyz.size() * sizeof(Data::Clouds::Point3D));
+	std::uint64_t color_hash = ParallelContentHash(color.data(), color.size() * sizeof(Data::Clouds::Color));
+	LayerStamp stamp = { HashMix64(HashMix64(xyz_hash ^ distance_bits) ^ color_hash), xyz.size() };
+	return stamp;
 }
 
-// Marking snow points
-void FindSnow(std::vector<StoredReal> L_values, std::vector<Data::Clouds::State> &states, std::vector<Data::Clouds::State> &states_simplified, int points_number)
+// Getting the simplified copy of the cloud of the node. The child made by a previous run is reused - as it is when the
+// input is unchanged, otherwise refilled and simplified again; when the number of points changed, the child node gets
+// a new cloud of the right size. A new child is created only if there is none.
+Data::Clouds::ICloud * GetSimplifiedCloud(Nodes::ITransTreeNode & source_node, Execution::Context& context, std::vector<Data::Clouds::Color> &color, std::vector<Data::Clouds::Point3D> &xyz, double minimal_distance, Data::Clouds::PointsRange &simplified_range)
 {
-	for (int i = 0; i < points_number; i++)
+	LayerStamp stamp = SimplificationStamp(color, xyz, minimal_distance);
+	Data::ResourceID simplified_cloud_id;
+	Data::Clouds::ICloud *simplified_cloud = nullptr;
+
+	Nodes::ITransTreeNode *child = FindSimplifiedCloudNode(source_node);
+	if (child)
 	{
-		if (L_values[i] >= 0.7)					// Very high lightness (white color)
+		simplified_cloud_id = child->GetID();
+		simplified_cloud = child->GetElement()->GetData<Data::Clouds::ICloud>();
+		simplified_cloud->GetAccess().GetAllPoints(simplified_range);
+		auto previous = SimplifiedStamps().find(simplified_cloud_id);
+		if (simplified_range.size() != xyz.size())
+		{
+			// size changed - the cloud can't be refilled, the node gets a new one and the old one is removed from the project
+			Data::ResourceID old_element_id = child->GetElement()->GetID();
+			Nodes::IElement *element = CreateCloudElement(context, SIMPLIFIED_CLOUD_NAME);
+			child->SetElement(element);
+			context.Project().ElementRemove(old_element_id);
+			simplified_cloud = element->GetData<Data::Clouds::ICloud>();
+			simplified_cloud->GetAccess().AllocPoints(xyz.size(), &simplified_range);
+		}
+		else if (previous != SimplifiedStamps().end() && previous->second.source_hash == stamp.source_hash && previous->second.points == stamp.points)
+		{
+			return simplified_cloud;		// unchanged - no copy, no simplification
+		}
+		else
 		{
-			states[i][10] = 1;					// Index number 10 is arbitrary
-			states_simplified[i][10] = 1;		// Treated as 'snow point'
+			std::vector<Data::Clouds::State> restored_states(xyz.size());		// undelete points of the previous simplification
+			simplified_range.SetStates(restored_states);
 		}
 	}
+	else
+	{
+		simplified_cloud = CreateCloud(&source_node, context, SIMPLIFIED_CLOUD_NAME, SIMPLIFIED_CLOUD_NAME, simplified_cloud_id);
+		simplified_cloud->GetAccess().AllocPoints(xyz.size(), &simplified_range);
+	}
+	simplified_range.SetColors(color);
+	simplified_range.SetXYZ(xyz);
+
+	CloudSimplification(context, simplified_cloud_id, minimal_distance);	// Simplification
+
+	SimplifiedStamps()[simplified_cloud_id] = stamp;
+	return simplified_cloud;
 }
 
-// Marking vegetation points
-void FindVegetation(std::vector<StoredReal> H_values, std::vector<StoredReal> L_values, std::vector<Data::Clouds::State> &states, std::vector<Data::Clouds::State> &states_simplified, int points_number)
+// Saving HSL values as data layers H, S, L
+void SaveHSLLayers(CloudLayers &layers, Data::Clouds::PointsRange &range, std::vector<StoredReal> &H_values, std::vector<StoredReal> &S_values, std::vector<StoredReal> &L_values)
 {
-	for (int i = 0; i < points_number; i++)
-	{
-		if (H_values[i] < 200 && L_values[i] >= 0.2 && L_values[i] <= 0.6)		// Green color and limited lightness
-		{
-			states[i][11] = 1;					// Index number 11 is arbitrary
-			states_simplified[i][11] = 1;		// Treated as 'vegetation point'
-		}
-	}
+	range.SetLayerVals(H_values, layers.Get(L"H"));
+	range.SetLayerVals(S_values, layers.Get(L"S"));
+	range.SetLayerVals(L_values, layers.Get(L"L"));
 }
 
-// Marking roads points
-void FindRoads(std::vector<StoredReal> H_values, std::vector<StoredReal> L_values, std::vector<StoredReal> PlaneError, std::vector<StoredReal> z_layer_values,
-	std::vector<Data::Clouds::State> &states, std::vector<Data::Clouds::State> &states_simplified, float mean_height_value, int points_number)
+// Calculating mean z value (height), the same for any number of threads and for the tiled run
+float MeanHeightValue(const std::vector<Data::Clouds::Point3D> &xyz)
 {
-	for (int i = 0; i < points_number; i++)
-	{
-		if (H_values[i] >= 275 && L_values[i] >= 0.2 && L_values[i] <= 0.6 && z_layer_values[i] <= (mean_height_value + 3.7) && PlaneError[i] < 0.065)
-		{
-			states[i][12] = 1;
-			states_simplified[i][12] = 1;
-		}
-	}
+	return float(ReduceChannel(CoordinateView(xyz, 2), xyz.size()).Mean());
 }
 
-// Marking each feature with different value (color)
-void SetFeaturesLayerValues(std::vector<StoredReal> &features_layer_values, std::vector<Data::Clouds::State> &states, int points_number)
+// State bits marking the features, index numbers are arbitrary
+const int FEATURE_STATE_BITS[FEATURE_CLASS_COUNT] = { -1, 10, 11, 12 };
+
+// Marking a point with the state bit of its feature (bits of other features are cleared)
+void SetFeatureStateBits(Data::Clouds::State &state, int feature_class)
 {
-	for (int i = 0; i < points_number; i++)
+	for (int c = FEATURE_SNOW; c < FEATURE_CLASS_COUNT; c++)
 	{
-		if (states[i][10] == 1)
-		{
-			features_layer_values.push_back(300);	// Snow points will be displayed as red
-		}
-		else if (states[i][11] == 1)
-		{
-			features_layer_values.push_back(150);	// Vegetation points will be displayed as green
-		}
-		else if (states[i][12] == 1)
-		{
-			features_layer_values.push_back(101);	// Roads will be displayed as blue
-		}
-		else
-			features_layer_values.push_back(0);		// Undefinied points will remain violet
+		state[FEATURE_STATE_BITS[c]] = (c == feature_class);
 	}
 }
 
-// Counting snow, vegetation and roads points
-void CountFeaturePoints(std::vector<Data::Clouds::State> &states_simplified, int &points_after_simplification, int &snow_points, int &vegetation_points, int &roads_points)
+// Names of the selections of the points of every feature
+const wchar_t* const FEATURE_SELECTION_NAMES[FEATURE_CLASS_COUNT] = { L"none", L"snow", L"vegetation", L"roads" };
+
+// Stores the selections of the points of every feature, classes of all points of the cloud given
+void StoreFeatureSelections(Clouds::ICloud &cloud, const Nodes::ITransTreeNode &node, const std::vector<std::uint8_t> &feature_classes, StageProfile &profile)
 {
-	for (auto & state : states_simplified)
+	for (int c = FEATURE_SNOW; c < FEATURE_CLASS_COUNT; c++)
 	{
-		if (state[31] == 0)					// Is visible
-		{
-			points_after_simplification++;
-			if (state[10] == 1)
-			{
-				snow_points++;
-			}
-			if (state[11] == 1)
-			{
-				vegetation_points++;
-			}
-			if (state[12] == 1)
-			{
-				roads_points++;
-			}
-		}
+		StoreSelection(cloud, node, FEATURE_SELECTION_NAMES[c], PointSelection::Of(feature_classes.size(), [&](std::size_t i) { return feature_classes[i] == c; }), profile);
 	}
 }
 
@@ -255,12 +292,25 @@ struct AreasDetection : public ogx::Plugin::EasyMethod
 {
 	//fields
 	Nodes::ITransTreeNode* m_node;
+	FeatureRules m_rules;			// classification rules compiled by Init
 
 	//parameters
 	Data::ResourceID m_node_id;
 
 	int m_neighbours_count;			// number of neighbours
 	double minimal_distance;
+	double plane_fitting_radius;	// neighbourhood radius of the plane fitting error
+	double ground_cell_size;		// cell of the ground raster the height of points is measured from
+	double ground_percentile;		// ground of a cell: percentile of the z of its points (0 - the lowest point)
+	bool save_hsl_layers;			// saves H, S, L data layers if true
+	bool write_states;				// state bits of the features are written if true, only selections are stored otherwise
+	double area_cell_size;			// cell of the occupancy rasters areas are measured on (0 - measured by points after simplification)
+	bool create_simplified_cloud;	// simplified copy of the cloud is made if true, points are selected in place otherwise (only without area rasters)
+	double memory_budget;			// MB for point data, bigger clouds are processed in tiles (0 - no limit)
+	double preview_precision;		// half width of the confidence intervals of a preview in percentage points (0 - full run)
+	String classification_rules;	// class of every point: 'class: condition' rules, the first satisfied one wins
+	String index_directory;			// spatial indexes of whole clouds are saved there for the next runs (empty - kept in memory only)
+	String trace_file;				// Chrome trace of the stages of every run (empty - not written)
 
 	//constructor
 	AreasDetection() : EasyMethod(L"Mateusz Pielach", L"Snow, vegetation, roads detection - IIIE4")
@@ -272,6 +322,23 @@ struct AreasDetection : public ogx::Plugin::EasyMethod
 	{
 		bank.Add(L"node_id", m_node_id = Data::ResourceID::invalid).AsNode();	//cloud choice
 		bank.Add(L"minimal distance", minimal_distance = 0.1).Min(0.1);
+		bank.Add(L"plane fitting radius", plane_fitting_radius = 1.0, L"Neighbourhood radius used to calculate plane fitting error").Min(0.01);
+		bank.Add(L"ground cell size", ground_cell_size = 5.0, L"Cell size of the ground raster, height of a point is measured from the ground of its cell").Min(0.1);
+		bank.Add(L"ground percentile", ground_percentile = 5.0, L"Ground of a raster cell as a percentile of the heights of its points (0 - the lowest point)").Min(0).Max(100);
+		bank.Add(L"save HSL layers", save_hsl_layers = false, L"If set, H, S, L values are saved as data layers");
+		bank.Add(L"write states", write_states = true, L"If not set, state bits of the features are not written, points of every feature are only stored "
+			L"as the selections 'snow', 'vegetation' and 'roads' (combined by the Selections method)");
+		bank.Add(L"area cell size", area_cell_size = 0.5, L"Cell size of the occupancy rasters areas are measured on, areas are reported in m2 "
+			L"(0 - only area ratios, measured by the number of points after the homogeneous simplification)").Min(0);
+		bank.Add(L"create simplified cloud", create_simplified_cloud = true, L"If set, a simplified copy of the cloud is made, otherwise points used to measure areas "
+			L"by the number of points are selected in place (unused when areas are measured on rasters)");
+		bank.Add(L"memory budget", memory_budget = 0, L"Memory for point data in MB, bigger clouds are processed in tiles (0 - no limit)").Min(0);
+		bank.Add(L"preview precision", preview_precision = 0, L"If above 0, area ratios are only estimated from a growing spatial sample until their 95% confidence intervals are this narrow (in percentage points), nothing is written to the cloud").Min(0);
+		bank.Add(L"classification rules", classification_rules = DEFAULT_FEATURE_RULES, L"Rules 'class: condition' separated by ';', a point gets the class (none, snow, vegetation, roads) "
+			L"of the first rule it satisfies. Conditions compare H, S, L, z, height (above the ground raster), intensity or plane_error with numbers (z also with mean + number), "
+			L"joined by and, or, not");
+		bank.Add(L"index directory", index_directory = L"", L"If set, spatial indexes are saved in this directory and loaded by later runs on the same geometry");
+		bank.Add(L"trace file", trace_file = L"", L"If set, time of every stage is also written to this file as a Chrome trace (chrome://tracing, ui.perfetto.dev)");
 	}
 
 	bool Init(Execution::Context& context)
@@ -281,92 +348,542 @@ struct AreasDetection : public ogx::Plugin::EasyMethod
 		m_node = context.m_project->TransTreeFindNode(m_node_id);
 		if (!m_node) ReportError(L"You must define node_id");
 
+		// rules are compiled once, runs only execute the program
+		std::wstring rules_error;
+		if (!m_rules.Compile(classification_rules, rules_error)) ReportError(L"Invalid classification rules: " + rules_error);
+
 		OGX_LINE.Msg(User, L"Initialization succeeded");
 		return EasyMethod::Init(context);
 	}
 
+	// Cloud bigger than the memory budget: spatial tiles are loaded together with a halo covering the plane fitting
+	// radius and the minimal distance, classified and written back one by one. Points of every tile are marked in the
+	// area rasters of the whole cloud, or (areas null) points used to measure areas are selected in place in every tile -
+	// representatives on both sides of a tile edge may lie closer than the minimal distance.
+	// The points of every tile are sorted into lists in one pass, each tile then visits only its own points.
+	FeatureCounts RunTiled(Clouds::ICloud &cloud, const Nodes::ITransTreeNode &node, CloudLayers &cloud_layers, Data::Clouds::PointsRange &points_all, std::size_t tile_points, FeatureAreaRaster *areas, StageProfile &profile)
+	{
+		// mean height of all points, streamed in chunks before the tiles (equal to MeanHeightValue of the whole cloud)
+		ScopedStage stage(profile, L"mean height", points_all.size());
+		auto xyz_range = Data::Clouds::RangeLocalXYZConst(points_all);
+		ChannelStatistics heights;
+		ForEachColumnChunk<float>(xyz_range, [](const Data::Clouds::Point3D &xyz) { return xyz.z(); }, [&](std::size_t, const float *z, std::size_t count)
+		{
+			heights.Add(z, count);
+		});
+		float mean_height_value = float(heights.Mean());
+
+		// ground raster of all points, streamed before the tiles (equal to the raster of the whole cloud)
+		GroundRaster ground;
+		if (m_rules.Uses(RULE_HEIGHT))
+		{
+			stage.Next(L"ground raster", 3 * points_all.size());
+			StreamGroundRaster(points_all, ground_cell_size, ground_percentile, ground);
+		}
+
+		stage.Next(L"tile planning", 3 * points_all.size());
+		TilePlan plan;
+		PlanTiles(points_all, tile_points, std::max(plane_fitting_radius, minimal_distance), plan);
+		TileMembers tiles(plan);
+		SortTilePoints(points_all, tiles);
+		OGX_LINE.Format(ogx::Info, L"Cloud processed in %d tiles", int(plan.TileCount()));
+		if (areas)
+		{
+			double lo[2], hi[2];
+			plan.Extent(lo, hi);
+			areas->SetExtent(lo, hi, area_cell_size);		// same cells as for the whole cloud
+		}
+
+		// layers written for the points of every tile, in the order of the tile value vectors below
+		// (features are decoded from the 8-bit classes when they are written)
+		std::vector<StoredReal> PlaneError, H_values, S_values, L_values;
+		std::vector<Data::Layers::ILayer*> layers = { &cloud_layers.Get(L"plane_fitting_err") };
+		std::vector<std::vector<StoredReal>*> tile_values = { &PlaneError };
+		if (save_hsl_layers)
+		{
+			layers.push_back(&cloud_layers.Get(L"H"));
+			layers.push_back(&cloud_layers.Get(L"S"));
+			layers.push_back(&cloud_layers.Get(L"L"));
+			tile_values.push_back(&H_values);
+			tile_values.push_back(&S_values);
+			tile_values.push_back(&L_values);
+		}
+		auto features_range = Data::Clouds::RangeLayer(points_all, cloud_layers.Get(L"features"));
+		auto color_range = Data::Clouds::RangeColorConst(points_all);
+		auto state_range = Data::Clouds::RangeState(points_all);
+
+		FeatureCounts counts = ZeroFeatureCounts();
+		std::vector<std::vector<std::uint64_t>> selected(FEATURE_CLASS_COUNT, std::vector<std::uint64_t>(MaskWords(points_all.size()), 0));	// features of all tiles
+		std::vector<Data::Clouds::Point3D> xyz;
+		std::vector<Data::Clouds::Color> color;
+		std::vector<std::uint8_t> feature_classes;
+		std::vector<std::uint16_t> H_codes, L_codes;
+		for (std::size_t t = 0; t < plan.TileCount(); t++)
+		{
+			// load the tile with its halo
+			const std::vector<std::uint32_t> &members = tiles.Points(t);
+			const std::vector<std::uint8_t> &tile_core = tiles.Core(t);		// point belongs to the tile, not to the halo
+			stage.Next(L"load tile", members.size());
+			xyz.resize(members.size());
+			color.resize(members.size());
+			{
+				auto p = CursorOf(xyz_range);
+				auto c = CursorOf(color_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					xyz[i] = p.At(members[i]);
+					color[i] = c.At(members[i]);
+				}
+			}
+			std::size_t points_number = xyz.size();
+			CheckGridExtent(xyz, !areas);
+			stage.Copied(points_number * (sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color)));
+
+			// H and L codes, plane fitting error and representatives of the tile are independent of each other,
+			// the classification starts when all of them are ready (representatives only if areas are measured by them)
+			stage.Next(L"tile stages", points_number);
+			StageGraph graph;
+			StageGraph::Stage codes = graph.Add([&]
+			{
+				ScopedStage tile_stage(profile, L"rgb to hsl", points_number);
+				RGB2HLCodes(color, H_codes, L_codes);
+				if (save_hsl_layers)
+				{
+					H_values.resize(points_number);
+					S_values.resize(points_number);
+					L_values.resize(points_number);
+					RGB2HSL(color, H_values.data(), S_values.data(), L_values.data());
+				}
+			});
+			StageGraph::Stage plane_error = graph.Add([&]
+			{
+				ScopedStage tile_stage(profile, L"plane fitting error", points_number);
+				PlaneError = PlaneFittingError(xyz, plane_fitting_radius);
+			});
+			std::vector<std::uint64_t> representatives;
+			std::vector<StageGraph::Stage> classification_inputs = { codes, plane_error };
+			if (!areas)
+			{
+				classification_inputs.push_back(graph.Add([&]
+				{
+					ScopedStage tile_stage(profile, L"simplification", points_number);
+					representatives = SimplifiedRepresentatives(xyz, minimal_distance);
+				}));
+			}
+			StageGraph::Stage classification = graph.Add([&]
+			{
+				ScopedStage tile_stage(profile, L"classification", points_number);
+				RuleInputs inputs = ClassificationInputs(H_codes, L_codes, color, MakeChannelView(PlaneError.data()), xyz, &ground, mean_height_value);
+
+				feature_classes.resize(points_number);
+				counts = AddFeatureCounts(counts, ClassifyFeaturesByRules(inputs, m_rules, [&](std::size_t i, int feature_class)
+				{
+					feature_classes[i] = std::uint8_t(feature_class);
+				}, [&](std::size_t i)
+				{
+					return tile_core[i] && (areas || ((representatives[i / 64] >> (i % 64)) & 1) != 0);
+				}));
+			}, classification_inputs);
+			if (areas)
+			{
+				graph.Add([&]
+				{
+					ScopedStage tile_stage(profile, L"area rasters", points_number);
+					areas->MarkAll(xyz, points_number, [&](std::size_t i) { return tile_core[i] ? int(feature_classes[i]) : -1; });
+				}, { classification });
+			}
+			graph.Run();
+
+			// write states and layers of the points of the tile back
+			stage.Next(L"write tile", members.size());
+			{
+				auto state = CursorOf(state_range);
+				auto feature = CursorOf(features_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					if (!tile_core[i]) continue;
+					const std::size_t point = members[i];
+					if (feature_classes[i] != FEATURE_NONE) selected[feature_classes[i]][point / 64] |= std::uint64_t(1) << (point % 64);
+					if (write_states) SetFeatureStateBits(state.At(point), feature_classes[i]);
+					feature.At(point) = FeatureLayerValue(feature_classes[i]);
+				}
+			}
+			for (std::size_t k = 0; k < layers.size(); k++)
+			{
+				auto layer_range = Data::Clouds::RangeLayer(points_all, *layers[k]);
+				auto value = CursorOf(layer_range);
+				for (std::size_t i = 0; i < members.size(); i++)
+				{
+					if (tile_core[i]) value.At(members[i]) = (*tile_values[k])[i];
+				}
+			}
+			stage.Copied(plan.TilePoints(t) * (sizeof(Data::Clouds::State) + (layers.size() + 1) * sizeof(StoredReal)));
+			tiles.Release(t);
+		}
+		for (int f = FEATURE_SNOW; f < FEATURE_CLASS_COUNT; f++) StoreSelection(cloud, node, FEATURE_SELECTION_NAMES[f], PointSelection::OfMask(selected[f].data(), points_all.size()), profile);
+		return counts;
+	}
+
+	// Reports an error if the points span too many cells of the grids of the plane fitting and of the simplification
+	void CheckGridExtent(const std::vector<Data::Clouds::Point3D> &xyz, bool simplification)
+	{
+		const double extent = LargestExtent(xyz, xyz.size());
+		String error = VoxelGridError(extent, plane_fitting_radius / PLANE_FIT_CELLS_PER_RADIUS, L"plane fitting radius");
+		if (error.empty() && simplification) error = VoxelGridError(extent, minimal_distance, L"minimal distance");
+		if (!error.empty()) ReportError(error);
+	}
+
+	// Grid over all points of the cloud from the shared index store - built only if no run has one for this geometry
+	std::shared_ptr<const VoxelHashGrid> CloudGrid(std::vector<Data::Clouds::Point3D> &xyz, const GeometryVersion &geometry, double cell_size)
+	{
+		return SharedSpatialIndexes().VoxelGridOf(xyz, geometry, float(cell_size), index_directory);
+	}
+
+	// Ground raster of the cloud from the shared index store, null if no rule measures the height above the ground
+	std::shared_ptr<const GroundRaster> CloudGround(std::vector<Data::Clouds::Point3D> &xyz, const GeometryVersion &geometry)
+	{
+		if (!m_rules.Uses(RULE_HEIGHT)) return nullptr;
+		return SharedSpatialIndexes().GroundRasterOf(xyz, geometry, ground_cell_size, ground_percentile, index_directory);
+	}
+
+	// Preview: area ratios estimated from a stratified sample of the units the full run measures - the covered cells of
+	// the occupancy raster, or the representatives when areas are measured by points - nothing is written to the cloud.
+	// Sampled points are classified by the same rules, the plane fitting error only where the class depends on it.
+	AreaRatioEstimate RunPreview(Data::Clouds::PointsRange &points_all, StageProfile &profile)
+	{
+		ScopedStage stage(profile, L"load points", points_all.size());
+		std::vector<Data::Clouds::Color> color;
+		points_all.GetColors(color);
+		std::vector<Data::Clouds::Point3D> xyz;
+		points_all.GetXYZ(xyz);
+		stage.Copied(xyz.size() * (sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color)));
+		int points_number = xyz.size();
+		CheckGridExtent(xyz, area_cell_size <= 0);
+		stage.Next(L"geometry version", points_number);
+		const GeometryVersion geometry = GeometryVersionOf(xyz);
+
+		stage.Next(L"preview inputs", points_number);
+		std::shared_ptr<const VoxelHashGrid> grid = CloudGrid(xyz, geometry, plane_fitting_radius / PLANE_FIT_CELLS_PER_RADIUS);		// same as the full run
+		float mean_height_value = MeanHeightValue(xyz);
+		std::shared_ptr<const GroundRaster> ground = CloudGround(xyz, geometry);
+
+		// the plane fitting error is computed only for the points whose class depends on it
+		const std::vector<float> plane_error_probes = m_rules.Uses(RULE_PLANE_ERROR) ? m_rules.ProbeValues(RULE_PLANE_ERROR, mean_height_value) : std::vector<float>(1, 0.0f);
+		const std::uint8_t *color_bytes = reinterpret_cast<const std::uint8_t*>(color.data());
+		auto classify_point = [&](std::size_t i)
+		{
+			std::uint16_t H, L;
+			RgbToHlCodes(color_bytes + i * sizeof(Data::Clouds::Color), sizeof(Data::Clouds::Color), 1, &H, &L);
+			const float q[3] = { xyz[i].x(), xyz[i].y(), xyz[i].z() };
+			float plane_error = plane_error_probes[0];
+			RuleInputs inputs;
+			inputs.H = &H;
+			inputs.L = &L;
+			inputs.colors = color_bytes + i * sizeof(Data::Clouds::Color);
+			inputs.color_stride = sizeof(Data::Clouds::Color);
+			inputs.plane_error = MakeChannelView(&plane_error);
+			inputs.x = MakeChannelView(q);
+			inputs.y = MakeChannelView(q + 1);
+			inputs.z = MakeChannelView(q + 2);
+			inputs.ground = ground.get();
+			inputs.count = 1;
+			inputs.mean_height = mean_height_value;
+			std::uint8_t feature_class, probed_class;
+			m_rules.ClassifyBlock(inputs, 0, 1, &feature_class);
+			for (std::size_t p = 1; p < plane_error_probes.size(); p++)
+			{
+				plane_error = plane_error_probes[p];
+				m_rules.ClassifyBlock(inputs, 0, 1, &probed_class);
+				if (probed_class != feature_class)
+				{
+					plane_error = PlaneFittingErrorAt(*grid, plane_fitting_radius, q);
+					m_rules.ClassifyBlock(inputs, 0, 1, &feature_class);
+					break;
+				}
+			}
+			return int(feature_class);
+		};
+		const wchar_t *units = area_cell_size > 0 ? L"cells" : L"points";
+		auto report_round = [&](const AreaRatioEstimate &round)
+		{
+			OGX_LINE.Format(ogx::Info, L"Preview of %d %ls: %f +- %f %% snow, %f +- %f %% vegetation, %f +- %f %% roads", int(round.sampled), units,
+				round.percentage[FEATURE_SNOW], round.half_width[FEATURE_SNOW], round.percentage[FEATURE_VEGETATION], round.half_width[FEATURE_VEGETATION],
+				round.percentage[FEATURE_ROADS], round.half_width[FEATURE_ROADS]);
+		};
+
+		StratifiedSample sample;
+		AreaRatioEstimate estimate;
+		if (area_cell_size > 0)
+		{
+			// Cells of the occupancy rasters of the full run covered by the points, a cell belongs to every class of its points
+			stage.Next(L"covered cells", points_number);
+			AreaCells cells;
+			const XyExtent extent = XyExtentOf(xyz, xyz.size());
+			cells.Set(extent.lo, extent.hi, area_cell_size);
+			CoveredCells covered;
+			covered.Build(cells, xyz, xyz.size());
+			stage.Next(L"preview strata", covered.Count());
+			sample.Build(covered.Centers(), covered.Count(), PREVIEW_STRATA_PER_AXIS, 1);
+			stage.Next(L"preview sample");
+			estimate = PreviewAreaRatios(sample, preview_precision, [&](std::size_t k) { return covered.ClassesOf(k, classify_point); }, report_round);
+		}
+		else
+		{
+			// Points measured by the full run - the representatives of the homogeneous simplification
+			stage.Next(L"representatives", points_number);
+			std::vector<std::uint64_t> representatives = SimplifiedRepresentatives(*CloudGrid(xyz, geometry, minimal_distance), minimal_distance);
+			std::vector<std::uint32_t> representative_index;
+			std::vector<Data::Clouds::Point3D> representative_xyz;
+			ForEachMaskBit(representatives.data(), representatives.size(), [&](std::size_t i)
+			{
+				representative_index.push_back(std::uint32_t(i));
+				representative_xyz.push_back(xyz[i]);
+			});
+			stage.Next(L"preview strata", representative_xyz.size());
+			sample.Build(representative_xyz, representative_xyz.size(), PREVIEW_STRATA_PER_AXIS, 1);
+			stage.Next(L"preview sample");
+			estimate = PreviewAreaRatios(sample, preview_precision, [&](std::size_t k) { return 1u << classify_point(representative_index[k]); }, report_round);
+		}
+		stage.Points(estimate.sampled);
+		return estimate;
+	}
+
+	// Reporting estimated area ratio of every feature with its 95% confidence interval
+	void ReportPreview(const AreaRatioEstimate &estimate)
+	{
+		OGX_LINE.Format(ogx::Info, L"%d %ls sampled from %d squares", int(estimate.sampled), area_cell_size > 0 ? L"cells" : L"points", int(estimate.strata));
+		OGX_LINE.Format(ogx::Info, L"%f %% snow (+- %f)", estimate.percentage[FEATURE_SNOW], estimate.half_width[FEATURE_SNOW]);
+		OGX_LINE.Format(ogx::Info, L"%f %% vegetation (+- %f)", estimate.percentage[FEATURE_VEGETATION], estimate.half_width[FEATURE_VEGETATION]);
+		OGX_LINE.Format(ogx::Info, L"%f %% roads (+- %f)", estimate.percentage[FEATURE_ROADS], estimate.half_width[FEATURE_ROADS]);
+	}
+
+	// Reporting number of points and area ratio of every feature
+	void ReportAreas(const FeatureCounts &counts)
+	{
+		int points_after_simplification = int(counts.total);
+		int snow_points = int(counts.points[FEATURE_SNOW]);
+		int vegetation_points = int(counts.points[FEATURE_VEGETATION]);
+		int roads_points = int(counts.points[FEATURE_ROADS]);
+
+		OGX_LINE.Format(ogx::Info, L"%d points after simplification", points_after_simplification);
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as snow", snow_points);
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as vegetation", vegetation_points);
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as roads", roads_points);
+
+		double snow_percentage = CalculateAreaRatio(snow_points, points_after_simplification);
+		double vegetation_percentage = CalculateAreaRatio(vegetation_points, points_after_simplification);
+		double roads_percentage = CalculateAreaRatio(roads_points, points_after_simplification);
+
+		OGX_LINE.Format(ogx::Info, L"%f %% snow", snow_percentage);
+		OGX_LINE.Format(ogx::Info, L"%f %% vegetation", vegetation_percentage);
+		OGX_LINE.Format(ogx::Info, L"%f %% roads", roads_percentage);
+	}
+
+	// Reporting number of points and area of every feature, in m2 and as a part of the area covered by the cloud
+	void ReportAreas(const FeatureCounts &counts, const FeatureAreas &areas)
+	{
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as snow", int(counts.points[FEATURE_SNOW]));
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as vegetation", int(counts.points[FEATURE_VEGETATION]));
+		OGX_LINE.Format(ogx::Info, L"%d points are treated as roads", int(counts.points[FEATURE_ROADS]));
+		if (areas.cell_size != area_cell_size) OGX_LINE.Format(ogx::Info, L"Area cell size enlarged to %f", areas.cell_size);
+		OGX_LINE.Format(ogx::Info, L"%f m2 covered by the cloud", areas.covered);
+		OGX_LINE.Format(ogx::Info, L"%f m2 of snow (%f %%)", areas.area[FEATURE_SNOW], areas.Ratio(FEATURE_SNOW));
+		OGX_LINE.Format(ogx::Info, L"%f m2 of vegetation (%f %%)", areas.area[FEATURE_VEGETATION], areas.Ratio(FEATURE_VEGETATION));
+		OGX_LINE.Format(ogx::Info, L"%f m2 of roads (%f %%)", areas.area[FEATURE_ROADS], areas.Ratio(FEATURE_ROADS));
+	}
+
 	virtual void Run(Context& context)
 	{
+		ThreadPoolRun pool_run;
+		SpatialIndexRun index_run;
+		StageProfile profile;
 		Data::Clouds::ForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node)
 		{
+			if (IsSimplifiedCloudNode(node)) return;	// made by a previous run, not an input
+			CloudLayers layers(cloud);
+
 			// Access points in the cloud
 			Data::Clouds::PointsRange points_all;
 			cloud.GetAccess().GetAllPoints(points_all);
 
+			if (preview_precision > 0)
+			{
+				ReportPreview(RunPreview(points_all, profile));
+				return;
+			}
+
+			std::size_t tile_points = TilePointsForBudget(memory_budget, AREAS_DETECTION_POINT_BYTES + (save_hsl_layers ? HSL_LAYERS_POINT_BYTES : 0));
+			if (tile_points != 0 && points_all.size() > tile_points)
+			{
+				if (area_cell_size > 0)
+				{
+					FeatureAreaRaster areas;
+					FeatureCounts counts = RunTiled(cloud, node, layers, points_all, tile_points, &areas, profile);
+					ReportAreas(counts, areas.Areas());
+					return;
+				}
+				if (create_simplified_cloud) OGX_LINE.Msg(ogx::Info, L"Cloud bigger than the memory budget, points used to measure areas are selected in place");
+				ReportAreas(RunTiled(cloud, node, layers, points_all, tile_points, nullptr, profile));
+				return;
+			}
+
 			// Get color and xyz
 			std::vector<Data::Clouds::Color> color;
-			points_all.GetColors(color);
 			std::vector<Data::Clouds::Point3D> xyz;
-			points_all.GetXYZ(xyz);
+			GeometryVersion geometry;		// key of the spatial indexes
+			{
+				ScopedStage stage(profile, L"load points", points_all.size());
+				points_all.GetColors(color);
+				points_all.GetXYZ(xyz);
+				stage.Copied(xyz.size() * (sizeof(Data::Clouds::Point3D) + sizeof(Data::Clouds::Color)));
+				stage.Next(L"geometry version", points_all.size());
+				geometry = GeometryVersionOf(xyz);
+			}
 			auto point = context.Feedback().GetFocusPoint();
+			CheckGridExtent(xyz, area_cell_size <= 0);
 
 			// Count all points
 			int points_number = xyz.size();
 
-			// Create new cloud which will be simplificated
-			Data::ResourceID simplified_cloud_id;
-			Data::Clouds::ICloud *simplified_cloud = CreateCloud(m_node, context, L"Simplified cloud", L"Simplified cloud", simplified_cloud_id);
+			// Stages start as soon as their inputs are ready - simplification, H and L codes, plane fitting error and
+			// mean height and ground raster do not depend on each other. Project changes and writes to the cloud stay on this thread.
+			StageGraph graph;
+			const bool raster_areas = area_cell_size > 0;
+
+			// Points used to measure areas - quasi-constant distance between them, kept in a simplified cloud or selected in place.
+			// Areas measured on rasters use all points, so there is no simplification and no simplified copy.
+			Data::Clouds::ICloud *simplified_cloud = nullptr;
+			std::unique_ptr<CloudLayers> simplified_layers;
 			Clouds::PointsRange simplified_range;
-			simplified_cloud->GetAccess().AllocPoints(points_all.size(), &simplified_range);
-			simplified_range.SetColors(color);
-			simplified_range.SetXYZ(xyz);
+			std::vector<Data::Clouds::State> states_simplified;
+			std::vector<std::uint64_t> representatives;
+			std::vector<StageGraph::Stage> simplification;
+			if (create_simplified_cloud && !raster_areas)
+			{
+				simplification.push_back(graph.AddOnCaller([&]
+				{
+					ScopedStage stage(profile, L"simplification", points_number);
+					simplified_cloud = GetSimplifiedCloud(node, context, color, xyz, minimal_distance, simplified_range);
+					simplified_layers.reset(new CloudLayers(*simplified_cloud));
+					simplified_range.GetStates(states_simplified);
+					stage.Copied(states_simplified.size() * sizeof(Data::Clouds::State));
+				}));
+			}
+			else if (!raster_areas)
+			{
+				simplification.push_back(graph.Add([&]
+				{
+					ScopedStage stage(profile, L"simplification", points_number);
+					representatives = SimplifiedRepresentatives(*CloudGrid(xyz, geometry, minimal_distance), minimal_distance);
+				}));
+			}
 
-			CloudSimplification(context, simplified_cloud_id, minimal_distance);	// Simplification
-			RGB2HSL(context, simplified_cloud_id);									// HSL values - will be used to clasify features
-			RGB2HSL(context, m_node_id);
-			PlaneFittingError(context, m_node_id);									// PFE - will be used to detect roads
+			// H and L codes - will be used to clasify features (float H, S, L are needed only when the layers are saved)
+			std::vector<std::uint16_t> H_codes, L_codes;
+			StageGraph::Stage codes = graph.Add([&]
+			{
+				ScopedStage stage(profile, L"rgb to hsl", points_number);
+				RGB2HLCodes(color, H_codes, L_codes);
+			});
+			if (save_hsl_layers)
+			{
+				graph.AddOnCaller([&]
+				{
+					ScopedStage stage(profile, L"save HSL layers", points_number);
+					std::vector<StoredReal> H_values(points_number), S_values(points_number), L_values(points_number);
+					RGB2HSL(color, H_values.data(), S_values.data(), L_values.data());
+					SaveHSLLayers(layers, points_all, H_values, S_values, L_values);
+					if (simplified_cloud) SaveHSLLayers(*simplified_layers, simplified_range, H_values, S_values, L_values);
+					stage.Copied((simplified_cloud ? 2 : 1) * 3 * points_number * sizeof(StoredReal));
+				}, simplification);
+			}
 
-			// Store states of points in original and simplified cloud
+			// Store states of points in original cloud, feature bits are set in them unless only selections are stored
 			std::vector<Data::Clouds::State> states;
-			points_all.GetStates(states);
-			std::vector<Data::Clouds::State> states_simplified;
-			simplified_range.GetStates(states_simplified);
-
-			// Create feature layers
-			Data::Layers::ILayer *features_layer = CreateLayer(cloud, L"features"); 
-			Data::Layers::ILayer *features_layer_simplified = CreateLayerSimplified(simplified_cloud, L"features");
-			std::vector<StoredReal> features_layer_values;
-			features_layer_values.reserve(xyz.size());
-
-			std::vector<StoredReal> H_values = GetHValues(cloud, points_all, points_number);
-			std::vector<StoredReal> S_values = GetSValues(cloud, points_all, points_number);
-			std::vector<StoredReal> L_values = GetLValues(cloud, points_all, points_number);
-			std::vector<StoredReal> PlaneError = GetPlaneErrorValues(cloud, points_all, points_number);
-
-			// Find snow, vegetation and roads
-			FindSnow(L_values, states, states_simplified, points_number);										
-			FindVegetation(H_values, L_values, states, states_simplified, points_number);
-			std::vector<StoredReal> z_layer_values = GetHeightValues(cloud, points_all, points_number, xyz);	// Store 'z' values (height)
-			float mean_height_value = MeanHeightValue(cloud, points_all, points_number, xyz);					// Calculate mean height value
-			FindRoads(H_values, L_values, PlaneError, z_layer_values, states, states_simplified, mean_height_value, points_number);
-
-			// Set an original value for each feature
-			SetFeaturesLayerValues(features_layer_values, states, points_number);
-			points_all.SetLayerVals(features_layer_values, *features_layer);
-			simplified_range.SetLayerVals(features_layer_values, *features_layer_simplified);
-
-			// Area measure = number of points after cloud simplification
-			int points_after_simplification = 0;
-			int snow_points = 0;
-			int vegetation_points = 0;
-			int roads_points = 0;
-
-			CountFeaturePoints(states_simplified, points_after_simplification, snow_points, vegetation_points, roads_points);
-			points_all.SetStates(states);	// Update cloud states
-
-			OGX_LINE.Format(ogx::Info, L"%d points in simplified cloud", points_after_simplification);
-			OGX_LINE.Format(ogx::Info, L"%d points are treated as snow", snow_points);
-			OGX_LINE.Format(ogx::Info, L"%d points are treated as vegetation", vegetation_points);
-			OGX_LINE.Format(ogx::Info, L"%d points are treated as roads", roads_points);
-
-			double snow_percentage = CalculateAreaRatio(snow_points, points_after_simplification);
-			double vegetation_percentage = CalculateAreaRatio(vegetation_points, points_after_simplification);
-			double roads_percentage = CalculateAreaRatio(roads_points, points_after_simplification);
-
-			OGX_LINE.Format(ogx::Info, L"%f %% snow", snow_percentage);
-			OGX_LINE.Format(ogx::Info, L"%f %% vegetation", vegetation_percentage);
-			OGX_LINE.Format(ogx::Info, L"%f %% roads", roads_percentage);
+			std::vector<StageGraph::Stage> classification_inputs;
+			if (write_states)
+			{
+				classification_inputs.push_back(graph.AddOnCaller([&]
+				{
+					ScopedStage stage(profile, L"read states", points_number);
+					points_all.GetStates(states);
+					stage.Copied(states.size() * sizeof(Data::Clouds::State));
+				}));
+			}
+
+			std::vector<StoredReal> PlaneError;			// PFE - will be used to detect roads
+			StageGraph::Stage plane_error = graph.Add([&]
+			{
+				ScopedStage stage(profile, L"plane fitting error", points_number);
+				PlaneError = PlaneFittingError(*CloudGrid(xyz, geometry, plane_fitting_radius / PLANE_FIT_CELLS_PER_RADIUS), plane_fitting_radius);
+			});
+			graph.AddOnCaller([&]
+			{
+				ScopedStage stage(profile, L"write plane fitting error", points_number);
+				points_all.SetLayerVals(PlaneError, layers.Get(L"plane_fitting_err"));
+				stage.Copied(PlaneError.size() * sizeof(StoredReal));
+			}, { plane_error });
+			float mean_height_value = 0;
+			StageGraph::Stage mean_height = graph.Add([&]
+			{
+				ScopedStage stage(profile, L"mean height", points_number);
+				mean_height_value = MeanHeightValue(xyz);		// Calculate mean height value
+			});
+			std::shared_ptr<const GroundRaster> ground;
+			StageGraph::Stage ground_raster = graph.Add([&]
+			{
+				ScopedStage stage(profile, L"ground raster", points_number);
+				ground = CloudGround(xyz, geometry);
+			});
+
+			// Find snow, vegetation and roads - inputs are read in place, xyz straight from the loaded points
+			// Single pass: state bits and an original layer value for each feature, area measure = cells of the area rasters
+			// or number of points after cloud simplification
+			std::vector<StoredReal> features_layer_values(xyz.size());
+			std::vector<std::uint8_t> feature_classes(xyz.size());
+			FeatureCounts counts = ZeroFeatureCounts();
+			classification_inputs.insert(classification_inputs.end(), { codes, plane_error, mean_height, ground_raster });
+			classification_inputs.insert(classification_inputs.end(), simplification.begin(), simplification.end());		// none with area rasters
+			StageGraph::Stage classification = graph.Add([&]
+			{
+				ScopedStage stage(profile, L"classification", points_number);
+				RuleInputs inputs = ClassificationInputs(H_codes, L_codes, color, MakeChannelView(PlaneError.data()), xyz, ground.get(), mean_height_value);
+				counts = ClassifyFeaturesByRules(inputs, m_rules, [&](std::size_t i, int feature_class)
+				{
+					if (write_states) SetFeatureStateBits(states[i], feature_class);
+					features_layer_values[i] = FeatureLayerValue(feature_class);
+					feature_classes[i] = std::uint8_t(feature_class);
+				}, [&](std::size_t i)
+				{
+					if (raster_areas) return true;		// all points counted, areas measured on the rasters
+					if (!simplified_cloud) return ((representatives[i / 64] >> (i % 64)) & 1) != 0;
+					return states_simplified[i][31] == 0;		// Is visible
+				});
+			}, classification_inputs);
+			FeatureAreaRaster areas;
+			if (raster_areas)
+			{
+				graph.Add([&]
+				{
+					ScopedStage stage(profile, L"area rasters", points_number);
+					areas.SetExtentOf(xyz, xyz.size(), area_cell_size);
+					areas.MarkAll(xyz, xyz.size(), [&](std::size_t i) { return int(feature_classes[i]); });
+				}, { classification });
+			}
+			graph.Run();
+
+			ScopedStage stage(profile, L"write layers and states", points_number);
+			points_all.SetLayerVals(features_layer_values, layers.Get(L"features"));
+			if (simplified_cloud) simplified_range.SetLayerVals(features_layer_values, simplified_layers->Get(L"features"));
+			if (write_states) points_all.SetStates(states);	// Update cloud states
+			stage.Copied(points_number * (simplified_cloud ? 2 : 1) * sizeof(StoredReal) + states.size() * sizeof(Data::Clouds::State));
+			stage.Next(L"selections", points_number);
+			StoreFeatureSelections(cloud, node, feature_classes, profile);
+
+			if (raster_areas) ReportAreas(counts, areas.Areas());
+			else ReportAreas(counts);
 		});
+		ReportStages(profile, trace_file);
 	}
 };
 
@@ -0,0 +1,196 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Ground height raster: the xy extent of a cloud is covered by square cells, the ground of a cell is a low percentile
+(or the minimum) of the z of its points. The height of a point above the ground is read in O(1), so features on
+slopes are not compared with a single mean height of the whole cloud.
+The raster is built from the loaded xyz in parallel, or streamed in three passes over the cloud for clouds processed
+in tiles (memory for the lowest values of every cell only). Both ways give exactly the same ground.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Reductions.h"
+#include "ThreadPool.h"
+
+// Cells of a raster at most, a cell size giving more of them is enlarged
+const std::size_t GROUND_MAX_CELLS = std::size_t(1) << 24;
+
+class GroundRaster
+{
+public:
+	GroundRaster() : m_cell_size(1), m_percentile(0), m_columns(0), m_rows(0)
+	{
+		m_origin[0] = m_origin[1] = std::numeric_limits<double>::max();
+		m_max[0] = m_max[1] = -std::numeric_limits<double>::max();
+	}
+
+	// Ground of the loaded points: cells of 'cell_size', ground at 'percentile' (0 - 100, 0 is the minimum) of their z
+	template <typename Points>
+	void Build(const Points& points, std::size_t count, double cell_size, double percentile)
+	{
+		*this = GroundRaster();
+		m_cell_size = cell_size;
+		m_percentile = percentile;
+		const XyExtent extent = XyExtentOf(points, count);
+		AddBounds(extent.lo[0], extent.lo[1]);
+		AddBounds(extent.hi[0], extent.hi[1]);
+		BeginCounting();
+
+		// z sorted by cell (counting sort), then the value of the percentile rank is selected in every cell
+		std::vector<std::uint32_t> cell(count);
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++) cell[i] = std::uint32_t(CellOf(points[i][0], points[i][1]));
+		});
+		std::vector<std::size_t> start(m_counts.size() + 1, 0);
+		for (std::size_t i = 0; i < count; i++) start[cell[i] + 1]++;
+		for (std::size_t c = 0; c < m_counts.size(); c++) start[c + 1] += start[c];
+		std::vector<float> z(count);
+		std::vector<std::size_t> cursor(start.begin(), start.end() - 1);
+		for (std::size_t i = 0; i < count; i++) z[cursor[cell[i]]++] = float(points[i][2]);
+		m_counts.clear();
+		m_ground.assign(start.size() - 1, std::numeric_limits<float>::quiet_NaN());
+		ParallelFor(m_ground.size(), 1024, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t c = begin; c < end; c++)
+			{
+				const std::size_t n = start[c + 1] - start[c];
+				if (n == 0) continue;
+				float* values = z.data() + start[c];
+				std::nth_element(values, values + Rank(n), values + n);
+				m_ground[c] = values[Rank(n)];
+			}
+		});
+	}
+
+	// Streamed build: SetCells, AddBounds for all points, BeginCounting, Count for all points, BeginSelecting,
+	// Select for all points in any order, Finish
+	void SetCells(double cell_size, double percentile)
+	{
+		*this = GroundRaster();
+		m_cell_size = cell_size;
+		m_percentile = percentile;
+	}
+
+	void AddBounds(double x, double y)
+	{
+		m_origin[0] = std::min(m_origin[0], x); m_max[0] = std::max(m_max[0], x);
+		m_origin[1] = std::min(m_origin[1], y); m_max[1] = std::max(m_max[1], y);
+	}
+
+	void BeginCounting()
+	{
+		if (m_origin[0] > m_max[0]) m_origin[0] = m_origin[1] = m_max[0] = m_max[1] = 0;		// no points
+		const double width = m_max[0] - m_origin[0], height = m_max[1] - m_origin[1];
+		if (!(m_cell_size > 0)) m_cell_size = 1;
+		m_cell_size = std::max(m_cell_size, std::sqrt(width * height / double(GROUND_MAX_CELLS)));
+		while ((std::floor(width / m_cell_size) + 1) * (std::floor(height / m_cell_size) + 1) > double(GROUND_MAX_CELLS)) m_cell_size *= 1.25;
+		m_columns = std::size_t(width / m_cell_size) + 1;
+		m_rows = std::size_t(height / m_cell_size) + 1;
+		m_counts.assign(m_columns * m_rows, 0);
+	}
+
+	void Count(double x, double y)
+	{
+		m_counts[CellOf(x, y)]++;
+	}
+
+	// Every cell keeps the lowest values up to its percentile rank in a max-heap
+	void BeginSelecting()
+	{
+		m_heap_start.assign(m_counts.size() + 1, 0);
+		for (std::size_t c = 0; c < m_counts.size(); c++)
+		{
+			m_heap_start[c + 1] = m_heap_start[c] + (m_counts[c] ? Rank(m_counts[c]) + 1 : 0);
+		}
+		m_heap.resize(m_heap_start.back());
+		m_counts.assign(m_counts.size(), 0);		// now the number of values in every heap
+	}
+
+	void Select(double x, double y, float z)
+	{
+		const std::size_t c = CellOf(x, y);
+		float* heap = m_heap.data() + m_heap_start[c];
+		const std::size_t capacity = m_heap_start[c + 1] - m_heap_start[c];
+		if (m_counts[c] < capacity)
+		{
+			heap[m_counts[c]++] = z;
+			std::push_heap(heap, heap + m_counts[c]);
+		}
+		else if (z < heap[0])
+		{
+			std::pop_heap(heap, heap + capacity);
+			heap[capacity - 1] = z;
+			std::push_heap(heap, heap + capacity);
+		}
+	}
+
+	void Finish()
+	{
+		m_ground.assign(m_counts.size(), std::numeric_limits<float>::quiet_NaN());
+		for (std::size_t c = 0; c < m_ground.size(); c++)
+		{
+			if (m_counts[c]) m_ground[c] = m_heap[m_heap_start[c]];		// the largest of the lowest values
+		}
+		std::vector<std::uint32_t>().swap(m_counts);
+		std::vector<std::size_t>().swap(m_heap_start);
+		std::vector<float>().swap(m_heap);
+	}
+
+	// Ground of the cell of the point, NaN in a cell without points (points outside the extent use the nearest cell)
+	float GroundAt(double x, double y) const
+	{
+		return m_ground[CellOf(x, y)];
+	}
+
+	double CellSize() const { return m_cell_size; }
+	std::size_t CellCount() const { return m_ground.size(); }
+
+	template <typename Archive>
+	bool Serialize(Archive& archive)
+	{
+		return archive.Scalar(m_cell_size) && archive.Scalar(m_percentile) && archive.Scalar(m_origin[0]) && archive.Scalar(m_origin[1])
+			&& archive.Scalar(m_max[0]) && archive.Scalar(m_max[1]) && archive.Count(m_columns) && archive.Count(m_rows) && archive.Array(m_ground);
+	}
+
+	// Checks the sizes of a raster read from a file
+	bool Consistent(std::size_t) const
+	{
+		return m_cell_size > 0 && m_columns > 0 && m_rows > 0 && m_columns <= GROUND_MAX_CELLS && m_rows <= GROUND_MAX_CELLS
+			&& m_ground.size() == m_columns * m_rows;
+	}
+
+private:
+	// 0-based rank of the percentile among n values
+	std::size_t Rank(std::size_t n) const
+	{
+		const double rank = std::floor(std::min(std::max(m_percentile, 0.0), 100.0) / 100.0 * double(n - 1));
+		return std::min(std::size_t(rank), n - 1);
+	}
+
+	std::size_t CellOf(double x, double y) const
+	{
+		const double column = std::floor((x - m_origin[0]) / m_cell_size), row = std::floor((y - m_origin[1]) / m_cell_size);
+		const std::size_t c = column < 0 ? 0 : std::min(std::size_t(column), m_columns - 1);
+		const std::size_t r = row < 0 ? 0 : std::min(std::size_t(row), m_rows - 1);
+		return r * m_columns + c;
+	}
+
+	double m_cell_size;
+	double m_percentile;
+	double m_origin[2], m_max[2];
+	std::size_t m_columns, m_rows;
+	std::vector<float> m_ground;
+
+	// streamed build
+	std::vector<std::uint32_t> m_counts;
+	std::vector<std::size_t> m_heap_start;
+	std::vector<float> m_heap;
+};
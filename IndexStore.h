@@ -0,0 +1,480 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Spatial indexes reused between runs and shared by all methods. An index is identified by its kind, its parameters
+and the version of the geometry it was built from (content hash and number of the xyz coordinates). The last
+indexes stay in memory while method runs are in progress (SpatialIndexRun) and are released when the last one ends;
+with an index directory they are also saved there as sidecar files, loaded by later runs.
+An index file is a fixed header followed by the arrays of the index, each at a 64-byte aligned offset in native
+byte order, so the file is mapped into memory and read without parsing.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ContentHash.h"
+#include "GroundRaster.h"
+#include "SpatialIndex.h"
+
+// Version of the geometry an index is built from
+struct GeometryVersion
+{
+	std::uint64_t hash;		// content hash of the xyz coordinates
+	std::uint64_t points;
+};
+
+template <typename Point>
+inline GeometryVersion GeometryVersionOf(const std::vector<Point>& xyz)
+{
+	GeometryVersion version = { ParallelContentHash(xyz.data(), xyz.size() * sizeof(Point)), xyz.size() };
+	return version;
+}
+
+enum SpatialIndexKind
+{
+	INDEX_KD_TREE = 1,
+	INDEX_VOXEL_GRID = 2,
+	INDEX_GROUND_RASTER = 3
+};
+
+// How an index was obtained
+enum IndexOrigin
+{
+	INDEX_BUILT,
+	INDEX_FROM_MEMORY,
+	INDEX_FROM_FILE
+};
+
+const std::uint32_t INDEX_FILE_FORMAT = 2;
+const std::uint32_t INDEX_BYTE_ORDER = 0x01020304;
+const std::size_t INDEX_FILE_ALIGNMENT = 64;
+
+// Header of an index file, also the key of an index
+struct IndexFileHeader
+{
+	char magic[8];					// "OGXSIDX"
+	std::uint32_t format;			// INDEX_FILE_FORMAT
+	std::uint32_t byte_order;		// INDEX_BYTE_ORDER as written
+	std::uint32_t kind;				// SpatialIndexKind
+	std::uint32_t reserved;
+	std::uint64_t geometry_hash;
+	std::uint64_t points;
+	double parameter;				// cell size of a grid or raster, 0 for a tree
+	double second_parameter;		// ground percentile of a raster, 0 otherwise
+	std::uint64_t payload_bytes;	// bytes after the header
+	std::uint64_t payload_hash;		// hash of the members, checked when the file is read
+};
+
+inline IndexFileHeader IndexKey(SpatialIndexKind kind, const GeometryVersion& geometry, double parameter, double second_parameter = 0)
+{
+	IndexFileHeader key;
+	std::memset(&key, 0, sizeof(key));
+	std::memcpy(key.magic, "OGXSIDX", 8);
+	key.format = INDEX_FILE_FORMAT;
+	key.byte_order = INDEX_BYTE_ORDER;
+	key.kind = std::uint32_t(kind);
+	key.geometry_hash = geometry.hash;
+	key.points = geometry.points;
+	key.parameter = parameter;
+	key.second_parameter = second_parameter;
+	return key;
+}
+
+inline bool SameIndex(const IndexFileHeader& a, const IndexFileHeader& b)
+{
+	return std::memcmp(a.magic, b.magic, sizeof(a.magic)) == 0 && a.format == b.format && a.byte_order == b.byte_order
+		&& a.kind == b.kind && a.geometry_hash == b.geometry_hash && a.points == b.points && a.parameter == b.parameter
+		&& a.second_parameter == b.second_parameter;
+}
+
+// Sidecar file of an index: <geometry hash>_<points>.kdtree, <geometry hash>_<points>_<cell size>.voxelgrid
+// or <geometry hash>_<points>_<cell size>_<percentile>.ground
+inline std::wstring IndexFilePath(const std::wstring& directory, const IndexFileHeader& key)
+{
+	wchar_t name[128];
+	if (key.kind == INDEX_KD_TREE) std::swprintf(name, 128, L"%016llx_%llu.kdtree", (unsigned long long)key.geometry_hash, (unsigned long long)key.points);
+	else if (key.kind == INDEX_GROUND_RASTER) std::swprintf(name, 128, L"%016llx_%llu_%.9g_%.9g.ground", (unsigned long long)key.geometry_hash, (unsigned long long)key.points,
+		key.parameter, key.second_parameter);
+	else std::swprintf(name, 128, L"%016llx_%llu_%.9g.voxelgrid", (unsigned long long)key.geometry_hash, (unsigned long long)key.points, key.parameter);
+	std::wstring path = directory;
+	if (!path.empty() && path.back() != L'/' && path.back() != L'\\') path += L'/';
+	return path + name;
+}
+
+inline std::FILE* OpenIndexFile(const std::wstring& path, const wchar_t* mode)
+{
+#ifdef _WIN32
+	return _wfopen(path.c_str(), mode);
+#else
+	return std::fopen(std::string(path.begin(), path.end()).c_str(), std::string(mode, mode + std::wcslen(mode)).c_str());	// plain ASCII paths outside Windows
+#endif
+}
+
+// Writes the members of an index after the header, arrays aligned to INDEX_FILE_ALIGNMENT
+class IndexFileWriter
+{
+public:
+	explicit IndexFileWriter(std::FILE* file) : m_file(file), m_offset(sizeof(IndexFileHeader)), m_hash(0), m_ok(true) {}
+
+	template <typename T>
+	bool Scalar(const T& value)
+	{
+		m_hash = HashMix64(m_hash ^ HashBlock(reinterpret_cast<const unsigned char*>(&value), sizeof(T), m_offset));
+		return Write(&value, sizeof(T));
+	}
+
+	bool Count(const std::size_t& count)
+	{
+		return Scalar(std::uint64_t(count));
+	}
+
+	template <typename T>
+	bool Array(const std::vector<T>& values)
+	{
+		if (!Count(values.size())) return false;
+		static const unsigned char zeros[INDEX_FILE_ALIGNMENT] = {};
+		if (!Write(zeros, (INDEX_FILE_ALIGNMENT - m_offset % INDEX_FILE_ALIGNMENT) % INDEX_FILE_ALIGNMENT)) return false;
+		m_hash = HashMix64(m_hash ^ ParallelContentHash(values.data(), values.size() * sizeof(T)));
+		return Write(values.data(), values.size() * sizeof(T));
+	}
+
+	std::uint64_t PayloadBytes() const { return m_offset - sizeof(IndexFileHeader); }
+	std::uint64_t PayloadHash() const { return m_hash; }
+
+private:
+	bool Write(const void* data, std::size_t bytes)
+	{
+		m_ok = m_ok && (bytes == 0 || std::fwrite(data, 1, bytes, m_file) == bytes);
+		m_offset += bytes;
+		return m_ok;
+	}
+
+	std::FILE* m_file;
+	std::uint64_t m_offset;
+	std::uint64_t m_hash;
+	bool m_ok;
+};
+
+// Reads the members of an index from a mapped file, checking every size against the file
+class IndexFileReader
+{
+public:
+	IndexFileReader(const unsigned char* data, std::size_t bytes) : m_data(data), m_bytes(bytes), m_offset(sizeof(IndexFileHeader)), m_hash(0) {}
+
+	template <typename T>
+	bool Scalar(T& value)
+	{
+		if (m_bytes - m_offset < sizeof(T)) return false;
+		m_hash = HashMix64(m_hash ^ HashBlock(m_data + m_offset, sizeof(T), m_offset));
+		std::memcpy(&value, m_data + m_offset, sizeof(T));
+		m_offset += sizeof(T);
+		return true;
+	}
+
+	bool Count(std::size_t& count)
+	{
+		std::uint64_t value;
+		if (!Scalar(value) || value > std::uint64_t(std::size_t(-1))) return false;
+		count = std::size_t(value);
+		return true;
+	}
+
+	template <typename T>
+	bool Array(std::vector<T>& values)
+	{
+		std::size_t count;
+		if (!Count(count)) return false;
+		m_offset += (INDEX_FILE_ALIGNMENT - m_offset % INDEX_FILE_ALIGNMENT) % INDEX_FILE_ALIGNMENT;
+		if (m_offset > m_bytes || count > (m_bytes - m_offset) / sizeof(T)) return false;
+		const std::size_t bytes = count * sizeof(T);
+		m_hash = HashMix64(m_hash ^ ParallelContentHash(m_data + m_offset, bytes));
+		values.resize(count);
+		if (bytes) std::memcpy(values.data(), m_data + m_offset, bytes);
+		m_offset += bytes;
+		return true;
+	}
+
+	std::uint64_t PayloadBytes() const { return m_offset - sizeof(IndexFileHeader); }
+	std::uint64_t PayloadHash() const { return m_hash; }
+
+private:
+	const unsigned char* m_data;
+	std::size_t m_bytes;
+	std::size_t m_offset;
+	std::uint64_t m_hash;
+};
+
+// Read-only mapping of a whole file, empty if the file cannot be opened
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::wstring& path) : m_data(nullptr), m_bytes(0)
+	{
+#ifdef _WIN32
+		m_mapping = nullptr;
+		m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return;
+		m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!m_mapping) return;
+		m_data = static_cast<const unsigned char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		if (m_data) m_bytes = std::size_t(size.QuadPart);
+#else
+		m_descriptor = open(std::string(path.begin(), path.end()).c_str(), O_RDONLY);
+		if (m_descriptor < 0) return;
+		struct stat status;
+		if (fstat(m_descriptor, &status) != 0 || status.st_size == 0) return;
+		void* data = mmap(nullptr, std::size_t(status.st_size), PROT_READ, MAP_PRIVATE, m_descriptor, 0);
+		if (data == MAP_FAILED) return;
+		m_data = static_cast<const unsigned char*>(data);
+		m_bytes = std::size_t(status.st_size);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (m_data) UnmapViewOfFile(m_data);
+		if (m_mapping) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+		if (m_data) munmap(const_cast<unsigned char*>(m_data), m_bytes);
+		if (m_descriptor >= 0) close(m_descriptor);
+#endif
+	}
+
+	const unsigned char* Data() const { return m_data; }
+	std::size_t Size() const { return m_bytes; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* m_data;
+	std::size_t m_bytes;
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_descriptor;
+#endif
+};
+
+// Reads the index saved for the key, false if there is no such file or it does not match the key
+template <typename Index>
+inline bool ReadIndexFile(const std::wstring& path, const IndexFileHeader& key, Index& index)
+{
+	MappedFile file(path);
+	if (file.Size() < sizeof(IndexFileHeader)) return false;
+	IndexFileHeader header;
+	std::memcpy(&header, file.Data(), sizeof(header));
+	if (!SameIndex(header, key) || header.payload_bytes != file.Size() - sizeof(IndexFileHeader)) return false;
+	IndexFileReader reader(file.Data(), file.Size());
+	return index.Serialize(reader) && reader.PayloadBytes() == header.payload_bytes && reader.PayloadHash() == header.payload_hash
+		&& index.Consistent(std::size_t(key.points));
+}
+
+// Saves the index under a temporary name and renames it, so a reader never sees a partly written file
+template <typename Index>
+inline bool WriteIndexFile(const std::wstring& path, const IndexFileHeader& key, Index& index)
+{
+	const std::wstring temporary = path + L".tmp";
+	std::FILE* file = OpenIndexFile(temporary, L"wb");
+	if (!file) return false;
+	IndexFileHeader header = key;
+	bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	IndexFileWriter writer(file);
+	written = written && index.Serialize(writer);
+	header.payload_bytes = writer.PayloadBytes();
+	header.payload_hash = writer.PayloadHash();
+	written = written && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+	written = std::fclose(file) == 0 && written;
+#ifdef _WIN32
+	written = written && MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+	if (!written) _wremove(temporary.c_str());
+#else
+	const std::string narrow_temporary(temporary.begin(), temporary.end());
+	written = written && std::rename(narrow_temporary.c_str(), std::string(path.begin(), path.end()).c_str()) == 0;
+	if (!written) std::remove(narrow_temporary.c_str());
+#endif
+	return written;
+}
+
+// Number of indexes kept in memory during runs, the least recently used one is dropped first
+const std::size_t MEMORY_SPATIAL_INDEXES = 4;
+
+// Indexes of the process: looked up in memory, then in the index directory (if given), built only when neither has
+// them. A built index is saved to the directory. Safe to call from several stages at once; an index requested
+// while another caller is loading or building it is waited for, not built twice.
+class SpatialIndexStore
+{
+public:
+	SpatialIndexStore() : m_runs(0) {}
+
+	template <typename Point>
+	std::shared_ptr<const KdTree> KdTreeOf(const std::vector<Point>& xyz, const GeometryVersion& geometry, const std::wstring& directory, IndexOrigin* origin = nullptr)
+	{
+		return Get<KdTree>(IndexKey(INDEX_KD_TREE, geometry, 0), directory, [&](KdTree& tree) { tree.Build(xyz, xyz.size()); }, origin);
+	}
+
+	template <typename Point>
+	std::shared_ptr<const VoxelHashGrid> VoxelGridOf(const std::vector<Point>& xyz, const GeometryVersion& geometry, float cell_size, const std::wstring& directory,
+		IndexOrigin* origin = nullptr)
+	{
+		return Get<VoxelHashGrid>(IndexKey(INDEX_VOXEL_GRID, geometry, cell_size), directory, [&](VoxelHashGrid& grid) { grid.Build(xyz, xyz.size(), cell_size); }, origin);
+	}
+
+	template <typename Point>
+	std::shared_ptr<const GroundRaster> GroundRasterOf(const std::vector<Point>& xyz, const GeometryVersion& geometry, double cell_size, double percentile,
+		const std::wstring& directory, IndexOrigin* origin = nullptr)
+	{
+		return Get<GroundRaster>(IndexKey(INDEX_GROUND_RASTER, geometry, cell_size, percentile), directory,
+			[&](GroundRaster& raster) { raster.Build(xyz, xyz.size(), cell_size, percentile); }, origin);
+	}
+
+	// Drops the indexes kept in memory, the files stay
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.clear();
+	}
+
+	void BeginRun()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_runs++;
+	}
+
+	// The indexes are released when the last run in progress ends, the files keep them for later runs
+	void EndRun()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_runs == 0) m_entries.clear();
+	}
+
+private:
+	struct Entry
+	{
+		IndexFileHeader key;
+		std::shared_ptr<const void> index;
+	};
+
+	// Index being loaded or built by one caller, the others wait for it
+	struct Pending
+	{
+		IndexFileHeader key;
+		std::shared_future<std::shared_ptr<const void>> index;
+	};
+
+	template <typename Index, typename Build>
+	std::shared_ptr<const Index> Get(const IndexFileHeader& key, const std::wstring& directory, Build build, IndexOrigin* origin)
+	{
+		std::promise<std::shared_ptr<const void>> promise;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (std::size_t e = 0; e < m_entries.size(); e++)
+			{
+				if (!SameIndex(m_entries[e].key, key)) continue;
+				Entry entry = m_entries[e];
+				m_entries.erase(m_entries.begin() + e);
+				m_entries.insert(m_entries.begin(), entry);
+				if (origin) *origin = INDEX_FROM_MEMORY;
+				return std::static_pointer_cast<const Index>(entry.index);
+			}
+			for (auto& pending : m_pending)
+			{
+				if (!SameIndex(pending.key, key)) continue;
+				std::shared_future<std::shared_ptr<const void>> index = pending.index;
+				lock.unlock();
+				if (origin) *origin = INDEX_FROM_MEMORY;
+				return std::static_pointer_cast<const Index>(index.get());		// rethrows if the build failed
+			}
+			Pending pending = { key, promise.get_future().share() };
+			m_pending.push_back(pending);
+		}
+
+		std::shared_ptr<Index> index = std::make_shared<Index>();
+		IndexOrigin found = INDEX_FROM_FILE;
+		try
+		{
+			const std::wstring path = directory.empty() ? std::wstring() : IndexFilePath(directory, key);
+			if (path.empty() || !ReadIndexFile(path, key, *index))
+			{
+				*index = Index();
+				build(*index);
+				found = INDEX_BUILT;
+				if (!path.empty()) WriteIndexFile(path, key, *index);
+			}
+		}
+		catch (...)
+		{
+			Finish(key, nullptr);
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+		if (origin) *origin = found;
+		Finish(key, index);
+		promise.set_value(index);
+		return index;
+	}
+
+	// Ends the pending load of the index, keeping it in memory if there is one and a run is in progress
+	void Finish(const IndexFileHeader& key, const std::shared_ptr<const void>& index)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (std::size_t p = 0; p < m_pending.size(); p++)
+		{
+			if (!SameIndex(m_pending[p].key, key)) continue;
+			m_pending.erase(m_pending.begin() + p);
+			break;
+		}
+		if (!index || m_runs == 0) return;
+		Entry entry = { key, index };
+		m_entries.insert(m_entries.begin(), entry);
+		if (m_entries.size() > MEMORY_SPATIAL_INDEXES) m_entries.pop_back();
+	}
+
+	std::mutex m_mutex;
+	std::vector<Entry> m_entries;		// most recently used first
+	std::vector<Pending> m_pending;
+	std::size_t m_runs;					// method runs in progress
+};
+
+inline SpatialIndexStore& SharedSpatialIndexes()
+{
+	static SpatialIndexStore store;
+	return store;
+}
+
+// Keeps the shared indexes in memory for a method run, also when it ends with an exception
+class SpatialIndexRun
+{
+public:
+	SpatialIndexRun() { SharedSpatialIndexes().BeginRun(); }
+	~SpatialIndexRun() { SharedSpatialIndexes().EndRun(); }
+};
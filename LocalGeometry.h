@@ -0,0 +1,411 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Local geometry and value statistics of point neighbourhoods computed from a VoxelHashGrid.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "SpatialIndex.h"
+#include "ThreadPool.h"
+
+// First and second order moments of a set of points, relative to some origin
+struct PointMoments
+{
+	double n;
+	double s[3];		// sum of coordinates
+	double m[6];		// sum of products: xx, xy, xz, yy, yz, zz
+
+	void Clear()
+	{
+		n = 0;
+		for (int k = 0; k < 3; k++) s[k] = 0;
+		for (int k = 0; k < 6; k++) m[k] = 0;
+	}
+
+	void Add(double x, double y, double z)
+	{
+		n += 1;
+		s[0] += x; s[1] += y; s[2] += z;
+		m[0] += x * x; m[1] += x * y; m[2] += x * z;
+		m[3] += y * y; m[4] += y * z; m[5] += z * z;
+	}
+
+	// Adds moments taken relative to an origin which lies at 't' in this set's frame
+	void AddShifted(const PointMoments& other, const double t[3])
+	{
+		n += other.n;
+		for (int k = 0; k < 3; k++) s[k] += other.s[k] + other.n * t[k];
+		const int row[6] = { 0, 0, 0, 1, 1, 2 };
+		const int col[6] = { 0, 1, 2, 1, 2, 2 };
+		for (int k = 0; k < 6; k++)
+		{
+			int i = row[k], j = col[k];
+			m[k] += other.m[k] + other.s[i] * t[j] + t[i] * other.s[j] + other.n * t[i] * t[j];
+		}
+	}
+
+	// Smallest eigenvalue of the covariance matrix = mean squared distance to the best fitting plane
+	double SmallestVariance() const
+	{
+		if (n < 1) return 0;
+		double mean[3] = { s[0] / n, s[1] / n, s[2] / n };
+		double a00 = m[0] / n - mean[0] * mean[0], a01 = m[1] / n - mean[0] * mean[1], a02 = m[2] / n - mean[0] * mean[2];
+		double a11 = m[3] / n - mean[1] * mean[1], a12 = m[4] / n - mean[1] * mean[2], a22 = m[5] / n - mean[2] * mean[2];
+
+		// closed form eigenvalues of a symmetric 3x3 matrix
+		double q = (a00 + a11 + a22) / 3;
+		double p1 = a01 * a01 + a02 * a02 + a12 * a12;
+		double p2 = (a00 - q) * (a00 - q) + (a11 - q) * (a11 - q) + (a22 - q) * (a22 - q) + 2 * p1;
+		if (p2 <= 0) return q > 0 ? q : 0;
+		double p = std::sqrt(p2 / 6);
+		double b00 = (a00 - q) / p, b11 = (a11 - q) / p, b22 = (a22 - q) / p, b01 = a01 / p, b02 = a02 / p, b12 = a12 / p;
+		double r = (b00 * (b11 * b22 - b12 * b12) - b01 * (b01 * b22 - b12 * b02) + b02 * (b01 * b12 - b11 * b02)) / 2;
+		r = r < -1 ? -1 : (r > 1 ? 1 : r);
+		double smallest = q + 2 * p * std::cos(std::acos(r) / 3 + 2.0943951023931957);	// + 2 pi / 3
+		return smallest > 0 ? smallest : 0;
+	}
+};
+
+// Count, sum, sum of squares and extremes of a set of values, taken relative to a common shift
+struct ValueAggregate
+{
+	double n;
+	double sum;
+	double sum_sq;
+	float min, max;
+
+	void Clear()
+	{
+		n = sum = sum_sq = 0;
+		min = std::numeric_limits<float>::infinity();
+		max = -std::numeric_limits<float>::infinity();
+	}
+
+	void Add(float value, double shifted)
+	{
+		n += 1;
+		sum += shifted;
+		sum_sq += shifted * shifted;
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+
+	void Add(const ValueAggregate& other)
+	{
+		n += other.n;
+		sum += other.sum;
+		sum_sq += other.sum_sq;
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+	}
+};
+
+// Visits the cells within 'radius' of the cells of a grid. Cells lying within the radius of every point of the
+// query cell go to inner(other, t), where t is the offset of their center from the query cell center; cells only
+// partly within the radius go to boundary(other), their points have to be tested one by one.
+// Every row of cells along x around the query cell is found with a cursor into the sorted cell keys, which only
+// moves forward as long as the query cells are visited in increasing order.
+class CellRadiusWalker
+{
+public:
+	CellRadiusWalker(const VoxelHashGrid& grid, double radius) : m_grid(grid)
+	{
+		const double cell = grid.CellSize();
+		const double r2 = radius * radius;
+		m_reach = int(std::ceil(radius / cell));
+		const int width = 2 * m_reach + 1;
+
+		// kind of every offset: 0 - out of the radius, 1 - inner, 2 - boundary
+		m_kind.assign(std::size_t(width) * width * width, 0);
+		for (int dz = -m_reach; dz <= m_reach; dz++)
+			for (int dy = -m_reach; dy <= m_reach; dy++)
+			{
+				bool row_used = false;
+				for (int dx = -m_reach; dx <= m_reach; dx++)
+				{
+					const int d[3] = { dx, dy, dz };
+					double nearest = 0, farthest = 0;	// between any two points of the two cells
+					for (int a = 0; a < 3; a++)
+					{
+						int k = d[a] < 0 ? -d[a] : d[a];
+						nearest += (k > 1 ? (k - 1) * cell : 0) * (k > 1 ? (k - 1) * cell : 0);
+						farthest += ((k + 1) * cell) * ((k + 1) * cell);
+					}
+					if (nearest > r2) continue;
+					m_kind[Offset(dx, dy, dz)] = farthest <= r2 ? 1 : 2;
+					row_used = true;
+				}
+				if (row_used)
+				{
+					m_row_dy.push_back(dy);
+					m_row_dz.push_back(dz);
+				}
+			}
+		m_cursor.assign(m_row_dy.size(), std::size_t(NO_CURSOR));
+	}
+
+	template <typename Inner, typename Boundary>
+	void Visit(std::size_t c, Inner inner, Boundary boundary)
+	{
+		const double cell = m_grid.CellSize();
+		const int max_coord = VoxelHashGrid::MaxCoord();
+		int coords[3];
+		m_grid.CellCoords(c, coords);
+		const int x0 = std::max(coords[0] - m_reach, 0);
+		const int x1 = std::min(coords[0] + m_reach, max_coord);
+		for (std::size_t r = 0; r < m_row_dy.size(); r++)
+		{
+			const int y = coords[1] + m_row_dy[r], z = coords[2] + m_row_dz[r];
+			if (y < 0 || z < 0 || y > max_coord || z > max_coord) continue;
+
+			// first cell of the row segment [x0, x1]
+			const std::uint64_t first = VoxelHashGrid::KeyOf(x0, y, z);
+			const std::uint64_t last = VoxelHashGrid::KeyOf(x1, y, z);
+			std::size_t& cursor = m_cursor[r];
+			if (cursor == NO_CURSOR || (cursor > 0 && m_grid.CellKey(cursor - 1) >= first)) cursor = 0;	// query cells out of order
+			cursor = LowerBound(cursor, first);
+
+			for (std::size_t other = cursor; other < m_grid.CellCount() && m_grid.CellKey(other) <= last; other++)
+			{
+				const int dx = int(m_grid.CellKey(other) & std::uint64_t(max_coord)) - coords[0];
+				const int kind = m_kind[Offset(dx, m_row_dy[r], m_row_dz[r])];
+				if (kind == 1)
+				{
+					const double t[3] = { dx * cell, m_row_dy[r] * cell, m_row_dz[r] * cell };
+					inner(other, t);
+				}
+				else if (kind == 2)
+				{
+					boundary(other);
+				}
+			}
+		}
+	}
+
+private:
+	static const std::size_t NO_CURSOR = ~std::size_t(0);
+
+	std::size_t Offset(int dx, int dy, int dz) const
+	{
+		const int width = 2 * m_reach + 1;
+		return (std::size_t(dz + m_reach) * width + std::size_t(dy + m_reach)) * width + std::size_t(dx + m_reach);
+	}
+
+	// First cell from 'from' on with a key not less than 'key': a few steps forward, then a binary search
+	std::size_t LowerBound(std::size_t from, std::uint64_t key) const
+	{
+		const std::size_t count = m_grid.CellCount();
+		for (int step = 0; step < 8; step++, from++)
+		{
+			if (from == count || m_grid.CellKey(from) >= key) return from;
+		}
+		std::size_t lo = from, hi = count;
+		while (lo < hi)
+		{
+			std::size_t mid = lo + (hi - lo) / 2;
+			if (m_grid.CellKey(mid) < key) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	const VoxelHashGrid& m_grid;
+	int m_reach;
+	std::vector<std::uint8_t> m_kind;
+	std::vector<int> m_row_dy, m_row_dz;	// rows of cells along x within the radius
+	std::vector<std::size_t> m_cursor;		// first cell of every row at the last visit
+};
+
+// Grid cell size used for plane fitting, as a fraction of the radius
+const double PLANE_FIT_CELLS_PER_RADIUS = 4;
+
+// Plane fitting error of every point: RMS distance of the points within 'radius' to their least squares plane.
+// The grid must be built with cell size radius / PLANE_FIT_CELLS_PER_RADIUS. Cells are processed in parallel;
+// all points of a cell share one neighbourhood pass - cells lying within the radius of the whole cell
+// contribute precomputed moments, only points of the boundary cells are tested one by one.
+// errors[i] is written for the original index i of every point.
+inline void PlaneFittingErrors(const VoxelHashGrid& grid, double radius, float* errors)
+{
+	const double r2 = radius * radius;
+
+	// moments of every cell relative to its center
+	std::vector<PointMoments> cell_moments(grid.CellCount());
+	ParallelFor(grid.CellCount(), 256, [&](std::size_t begin, std::size_t end)
+	{
+		for (std::size_t c = begin; c < end; c++)
+		{
+			double center[3];
+			grid.CellCenter(c, center);
+			cell_moments[c].Clear();
+			for (std::size_t pos = grid.CellBegin(c); pos < grid.CellEnd(c); pos++)
+			{
+				const float* p = grid.PointAt(pos);
+				cell_moments[c].Add(p[0] - center[0], p[1] - center[1], p[2] - center[2]);
+			}
+		}
+	});
+
+	ParallelFor(grid.CellCount(), 64, [&](std::size_t begin, std::size_t end)
+	{
+		CellRadiusWalker walker(grid, radius);
+		std::vector<double> boundary;	// points of boundary cells relative to the query cell center
+		for (std::size_t c = begin; c < end; c++)
+		{
+			double center[3];
+			grid.CellCenter(c, center);
+
+			PointMoments shared;
+			shared.Clear();
+			boundary.clear();
+			walker.Visit(c, [&](std::size_t other, const double t[3])
+			{
+				shared.AddShifted(cell_moments[other], t);
+			}, [&](std::size_t other)
+			{
+				for (std::size_t pos = grid.CellBegin(other); pos < grid.CellEnd(other); pos++)
+				{
+					const float* p = grid.PointAt(pos);
+					for (int a = 0; a < 3; a++) boundary.push_back(p[a] - center[a]);
+				}
+			});
+
+			for (std::size_t pos = grid.CellBegin(c); pos < grid.CellEnd(c); pos++)
+			{
+				const float* p = grid.PointAt(pos);
+				const double q[3] = { p[0] - center[0], p[1] - center[1], p[2] - center[2] };
+				PointMoments neighbourhood = shared;
+				for (std::size_t b = 0; b < boundary.size(); b += 3)
+				{
+					double x = boundary[b] - q[0], y = boundary[b + 1] - q[1], z = boundary[b + 2] - q[2];
+					if (x * x + y * y + z * z <= r2) neighbourhood.Add(boundary[b], boundary[b + 1], boundary[b + 2]);
+				}
+				errors[grid.IndexAt(pos)] = float(std::sqrt(neighbourhood.SmallestVariance()));
+			}
+		}
+	});
+}
+
+// Plane fitting error of a single query point from the points within 'radius' around it, for a grid of any cell size.
+// Meant for a few points (e.g. a sample), PlaneFittingErrors is much faster for all points of a cloud.
+inline float PlaneFittingErrorAt(const VoxelHashGrid& grid, double radius, const float q[3])
+{
+	PointMoments neighbourhood;
+	neighbourhood.Clear();
+	grid.ForEachPointWithin(q, radius, [&](double dx, double dy, double dz) { neighbourhood.Add(dx, dy, dz); });
+	return float(std::sqrt(neighbourhood.SmallestVariance()));
+}
+
+// Grid cell size used for neighbourhood statistics, as a fraction of the radius
+const double STATISTICS_CELLS_PER_RADIUS = 4;
+
+// Mean, variance, minimum and maximum of values[i] over the points within 'radius' of every point.
+// The grid must be built with cell size radius / STATISTICS_CELLS_PER_RADIUS. Aggregates of every cell are
+// summed up once, so a query costs one pass over the nearby cells plus the points of the boundary cells,
+// independent of the number of points in the radius. Outputs are written for the original index i of every point.
+// Values are any indexable channel (a pointer or a strided view), every value is read once.
+template <typename Values>
+inline void NeighbourhoodStatistics(const VoxelHashGrid& grid, double radius, const Values& values,
+	float* mean, float* variance, float* minimum, float* maximum)
+{
+	if (grid.Size() == 0) return;
+	const double r2 = radius * radius;
+	const double shift = values[grid.IndexAt(0)];	// keeps the sums of squares small for values far from 0
+
+	// values in cell order, next to the coordinates of their points
+	std::vector<float> ordered(grid.Size());
+	std::vector<ValueAggregate> cell_values(grid.CellCount());
+	ParallelFor(grid.CellCount(), 256, [&](std::size_t begin, std::size_t end)
+	{
+		for (std::size_t c = begin; c < end; c++)
+		{
+			cell_values[c].Clear();
+			for (std::size_t pos = grid.CellBegin(c); pos < grid.CellEnd(c); pos++)
+			{
+				float value = ordered[pos] = values[grid.IndexAt(pos)];
+				cell_values[c].Add(value, value - shift);
+			}
+		}
+	});
+
+	// a boundary cell lying wholly within the radius of the query point adds its aggregate too,
+	// only points of the cells crossed by the sphere around the point are tested one by one
+	const double half = grid.CellSize() / 2;
+	struct BoundaryCell
+	{
+		std::size_t cell;
+		double t[3];		// offset of its center from the query cell center
+	};
+	ParallelFor(grid.CellCount(), 64, [&](std::size_t begin, std::size_t end)
+	{
+		CellRadiusWalker walker(grid, radius);
+		std::vector<BoundaryCell> boundary;
+		for (std::size_t c = begin; c < end; c++)
+		{
+			double center[3];
+			grid.CellCenter(c, center);
+
+			ValueAggregate shared;
+			shared.Clear();
+			boundary.clear();
+			walker.Visit(c, [&](std::size_t other, const double*)
+			{
+				shared.Add(cell_values[other]);
+			}, [&](std::size_t other)
+			{
+				BoundaryCell cell;
+				cell.cell = other;
+				grid.CellCenter(other, cell.t);
+				for (int a = 0; a < 3; a++) cell.t[a] -= center[a];
+				boundary.push_back(cell);
+			});
+
+			for (std::size_t pos = grid.CellBegin(c); pos < grid.CellEnd(c); pos++)
+			{
+				const float* q = grid.PointAt(pos);
+				const double rq[3] = { q[0] - center[0], q[1] - center[1], q[2] - center[2] };
+				ValueAggregate neighbourhood = shared;
+				for (const BoundaryCell& cell : boundary)
+				{
+					double nearest = 0, farthest = 0;	// between the query point and any point of the cell
+					for (int a = 0; a < 3; a++)
+					{
+						double d = std::fabs(cell.t[a] - rq[a]);
+						nearest += d > half ? (d - half) * (d - half) : 0;
+						farthest += (d + half) * (d + half);
+					}
+					if (nearest > r2) continue;
+					if (farthest <= r2)
+					{
+						neighbourhood.Add(cell_values[cell.cell]);
+						continue;
+					}
+					for (std::size_t b = grid.CellBegin(cell.cell); b < grid.CellEnd(cell.cell); b++)
+					{
+						const float* p = grid.PointAt(b);
+						double x = p[0] - q[0], y = p[1] - q[1], z = p[2] - q[2];
+						if (x * x + y * y + z * z <= r2)
+						{
+							float value = ordered[b];
+							neighbourhood.Add(value, value - shift);
+						}
+					}
+				}
+
+				// the point itself is always in its neighbourhood, n >= 1
+				std::size_t i = grid.IndexAt(pos);
+				double m = neighbourhood.sum / neighbourhood.n;
+				mean[i] = float(shift + m);
+				variance[i] = float(std::max(0.0, neighbourhood.sum_sq / neighbourhood.n - m * m));
+				minimum[i] = neighbourhood.min;
+				maximum[i] = neighbourhood.max;
+			}
+		}
+	});
+}
@@ -0,0 +1,392 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Helpers shared by the plugins which work on ogx clouds.
+*/
+
+#pragma once
+
+#include <ogx/Plugins/EasyPlugin.h>
+#include <ogx/Data/Clouds/CloudHelpers.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cwchar>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ColorHistograms.h"
+#include "ContentHash.h"
+#include "GroundRaster.h"
+#include "SelectionSets.h"
+#include "SpatialIndex.h"
+#include "StageProfile.h"
+#include "ThreadPool.h"
+#include "Tiling.h"
+
+// Processes every cloud under the node in three steps: load(cloud, node) reads the cloud and returns its job,
+// work(job) computes on the pool and store(cloud, node, job) writes the results back. Loading and storing - every call
+// of the host, the project and the log - run on the calling thread in the order of the clouds; the work of up to one
+// cloud per pool thread overlaps with them. An exception thrown by work is rethrown when its cloud would be stored.
+template <typename Load, typename Work, typename Store>
+inline void ParallelForEachCloud(ogx::Data::Nodes::ITransTreeNode& node, Load load, Work work, Store store)
+{
+	typedef decltype(load(std::declval<ogx::Data::Clouds::ICloud&>(), std::declval<ogx::Data::Nodes::ITransTreeNode&>())) Job;
+	std::vector<std::pair<ogx::Data::Clouds::ICloud*, ogx::Data::Nodes::ITransTreeNode*>> clouds;
+	ogx::Data::Clouds::ForEachCloud(node, [&](ogx::Data::Clouds::ICloud& cloud, ogx::Data::Nodes::ITransTreeNode& cloud_node)
+	{
+		clouds.push_back(std::make_pair(&cloud, &cloud_node));
+	});
+	const std::size_t in_flight = SharedThreadPool().Concurrency();
+	std::vector<std::unique_ptr<Job>> jobs(clouds.size());
+	std::vector<std::unique_ptr<TaskGroup>> groups(clouds.size());		// destroyed first, waiting for the work on the jobs
+	auto store_cloud = [&](std::size_t i)
+	{
+		groups[i]->Wait();
+		store(*clouds[i].first, *clouds[i].second, *jobs[i]);
+		groups[i].reset();
+		jobs[i].reset();
+	};
+	for (std::size_t i = 0; i < clouds.size(); i++)
+	{
+		if (i >= in_flight) store_cloud(i - in_flight);
+		jobs[i].reset(new Job(load(*clouds[i].first, *clouds[i].second)));
+		groups[i].reset(new TaskGroup());
+		Job& job = *jobs[i];
+		groups[i]->Run([&work, &job] { work(job); });
+	}
+	for (std::size_t i = clouds.size() > in_flight ? clouds.size() - in_flight : 0; i < clouds.size(); i++) store_cloud(i);
+}
+
+// Describes the source data a derived layer was computed from
+struct LayerStamp
+{
+	std::uint64_t source_hash;	// content hash of the source channel
+	std::size_t points;
+};
+
+// Remembers the derived layer written to every cloud by the plugin together with the stamp of its source data,
+// so a rerun on an unchanged cloud can skip rewriting the layer. Kept for the lifetime of the plugin.
+class DerivedLayerCache
+{
+public:
+	// True if 'layer' of the cloud was written by the plugin from source data with the same stamp
+	bool IsCurrent(const ogx::Data::Clouds::ICloud* cloud, const ogx::Data::Layers::ILayer* layer, const LayerStamp& stamp) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto found = m_entries.find(cloud);
+		if (found == m_entries.end()) return false;
+		const Entry& entry = found->second;
+		return entry.layer == layer && entry.stamp.source_hash == stamp.source_hash && entry.stamp.points == stamp.points;
+	}
+
+	void Store(const ogx::Data::Clouds::ICloud* cloud, const ogx::Data::Layers::ILayer* layer, const LayerStamp& stamp)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Entry entry = { layer, stamp };
+		m_entries[cloud] = entry;
+	}
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.clear();
+	}
+
+private:
+	struct Entry
+	{
+		const ogx::Data::Layers::ILayer* layer;
+		LayerStamp stamp;
+	};
+
+	mutable std::mutex m_mutex;
+	std::map<const ogx::Data::Clouds::ICloud*, Entry> m_entries;
+};
+
+inline DerivedLayerCache& SharedLayerCache()
+{
+	static DerivedLayerCache cache;
+	return cache;
+}
+
+// Name of the layer of the cloud a named selection is stored in
+inline ogx::String SelectionLayerName(const std::wstring& name)
+{
+	return L"selection " + name;
+}
+
+// Stamp of the values of a selection layer
+inline LayerStamp SelectionStampOf(const std::vector<ogx::StoredReal>& values)
+{
+	LayerStamp stamp = { ParallelContentHash(values.data(), values.size() * sizeof(ogx::StoredReal)), values.size() };
+	return stamp;
+}
+
+// Selections are stored with the cloud, in its layers (1 - selected, 0 - not), so they are saved with the project and
+// read by methods of any module. This store only keeps the compressed selections already read or written, by the
+// node and the name, together with the stamp of the layer values they match: a layer changed since (by the user, by
+// another module or by a change of the points) has another stamp and is read again.
+class SelectionStore
+{
+public:
+	void Store(const ogx::Data::ResourceID& node, const std::wstring& name, const LayerStamp& stamp, std::shared_ptr<const PointSelection> selection)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Entry entry = { stamp, std::move(selection) };
+		m_selections[std::make_pair(node, name)] = std::move(entry);
+	}
+
+	// Selection of the node and the name read from layer values with the stamp, null if there is none
+	std::shared_ptr<const PointSelection> Find(const ogx::Data::ResourceID& node, const std::wstring& name, const LayerStamp& stamp) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto found = m_selections.find(std::make_pair(node, name));
+		if (found == m_selections.end()) return nullptr;
+		const Entry& entry = found->second;
+		if (entry.stamp.source_hash != stamp.source_hash || entry.stamp.points != stamp.points) return nullptr;
+		return entry.selection;
+	}
+
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_selections.clear();
+	}
+
+private:
+	struct Entry
+	{
+		LayerStamp stamp;
+		std::shared_ptr<const PointSelection> selection;
+	};
+
+	mutable std::mutex m_mutex;
+	std::map<std::pair<ogx::Data::ResourceID, std::wstring>, Entry> m_selections;
+};
+
+inline SelectionStore& SharedSelections()
+{
+	static SelectionStore store;
+	return store;
+}
+
+// Selection of the values of its layer, taken from the store while the values are unchanged
+inline std::shared_ptr<const PointSelection> SelectionOfLayer(const ogx::Data::ResourceID& node, const std::wstring& name, const std::vector<ogx::StoredReal>& values)
+{
+	const LayerStamp stamp = SelectionStampOf(values);
+	std::shared_ptr<const PointSelection> selection = SharedSelections().Find(node, name, stamp);
+	if (selection) return selection;
+	selection = std::make_shared<const PointSelection>(PointSelection::Of(values.size(), [&](std::size_t i) { return values[i] != 0; }));
+	SharedSelections().Store(node, name, stamp, selection);
+	return selection;
+}
+
+// Writes the selection to its layer of the cloud of the node, keeps it in the store and writes its size to the log
+inline void StoreSelection(ogx::Data::Clouds::ICloud& cloud, const ogx::Data::Nodes::ITransTreeNode& node, const std::wstring& name, PointSelection selection,
+	StageProfile& profile)
+{
+	OGX_LINE.Format(ogx::Info, L"Selection '%ls': %d points, %d KB", name.c_str(), int(selection.Count()), int((selection.Bytes() + 1023) / 1024));
+	ScopedStage stage(profile, L"store selection", selection.Points());
+	std::vector<ogx::StoredReal> values(selection.Points());
+	ParallelFor(selection.ChunkCount(), 1, [&](std::size_t first_chunk, std::size_t last_chunk)
+	{
+		std::vector<std::uint64_t> words(SELECTION_CHUNK_WORDS);
+		for (std::size_t c = first_chunk; c < last_chunk; c++)
+		{
+			selection.Chunk(c).Words(words.data());
+			const std::size_t first = c * SELECTION_CHUNK, count = std::min(SELECTION_CHUNK, values.size() - first);
+			for (std::size_t i = 0; i < count; i++) values[first + i] = ogx::StoredReal((words[i / 64] >> (i % 64)) & 1);
+		}
+	});
+	auto layers = cloud.FindLayers(SelectionLayerName(name));
+	ogx::Data::Layers::ILayer* layer = layers.empty() ? cloud.CreateLayer(SelectionLayerName(name), 0) : layers[0]; // 0 - not selected
+	ogx::Data::Clouds::PointsRange points_all;
+	cloud.GetAccess().GetAllPoints(points_all);
+	points_all.SetLayerVals(values, *layer);
+	stage.Copied(values.size() * sizeof(ogx::StoredReal));
+	SharedSelections().Store(node.GetID(), name, SelectionStampOf(values), std::make_shared<const PointSelection>(std::move(selection)));
+}
+
+// Layers of one cloud resolved once per run: every name is searched for only the first time it is used
+class CloudLayers
+{
+public:
+	explicit CloudLayers(ogx::Data::Clouds::ICloud& cloud) : m_cloud(cloud) {}
+
+	// Layer of the name, null if the cloud has none
+	ogx::Data::Layers::ILayer* Find(const ogx::String& name)
+	{
+		auto found = m_layers.find(name);
+		if (found != m_layers.end()) return found->second;
+		auto layers = m_cloud.FindLayers(name);
+		ogx::Data::Layers::ILayer* layer = layers.empty() ? nullptr : layers[0];
+		m_layers[name] = layer;
+		return layer;
+	}
+
+	// Layer of the name, created if there is none
+	ogx::Data::Layers::ILayer& Get(const ogx::String& name)
+	{
+		ogx::Data::Layers::ILayer* layer = Find(name);
+		if (!layer)
+		{
+			layer = m_cloud.CreateLayer(name, 0); // 0 - default value
+			m_layers[name] = layer;
+		}
+		return *layer;
+	}
+
+private:
+	ogx::Data::Clouds::ICloud& m_cloud;
+	std::map<ogx::String, ogx::Data::Layers::ILayer*> m_layers;
+};
+
+// Error message if points spanning 'extent' (LargestExtent) do not fit in a VoxelHashGrid with the cell size,
+// empty if they do. 'parameter' is the parameter the cell size follows from.
+inline ogx::String VoxelGridError(double extent, double cell_size, const wchar_t* parameter)
+{
+	if (VoxelHashGrid::Holds(extent, cell_size)) return ogx::String();
+	wchar_t message[256];
+	std::swprintf(message, 256, L"Points span %g m, more than %d cells of %g m of the neighbourhood grid - increase the %ls or process a smaller cloud",
+		extent, int(VoxelHashGrid::AXIS_CELLS - 1), cell_size, parameter);
+	return message;
+}
+
+// Plans spatial tiles of the range in two streaming passes over xyz (extent, then points per cell)
+inline void PlanTiles(const ogx::Data::Clouds::PointsRange& range, std::size_t max_tile_points, double halo, TilePlan& plan)
+{
+	auto xyz_range = ogx::Data::Clouds::RangeLocalXYZConst(range);
+	for (auto& xyz : xyz_range)
+	{
+		plan.AddBounds(xyz.x(), xyz.y());
+	}
+	plan.BeginCounting();
+	for (auto& xyz : xyz_range)
+	{
+		plan.Count(xyz.x(), xyz.y());
+	}
+	plan.Split(max_tile_points, halo);
+}
+
+// Sorts the points of the range into the tiles of the plan and their halos in one streaming pass over xyz
+inline void SortTilePoints(const ogx::Data::Clouds::PointsRange& range, TileMembers& members)
+{
+	std::size_t point = 0;
+	for (auto& xyz : ogx::Data::Clouds::RangeLocalXYZConst(range))
+	{
+		members.Add(point++, xyz.x(), xyz.y());
+	}
+}
+
+// Iterator of a range moved forward to points given in increasing order, e.g. the points of a tile
+// (std::advance - constant time on random access ranges)
+template <typename Iterator>
+class PointCursor
+{
+public:
+	explicit PointCursor(Iterator begin) : m_iterator(begin), m_point(0) {}
+
+	auto At(std::size_t point) -> decltype(*std::declval<Iterator>())
+	{
+		std::advance(m_iterator, std::ptrdiff_t(point - m_point));
+		m_point = point;
+		return *m_iterator;
+	}
+
+private:
+	Iterator m_iterator;
+	std::size_t m_point;
+};
+
+template <typename Range>
+inline PointCursor<decltype(std::declval<const Range&>().begin())> CursorOf(const Range& range)
+{
+	return PointCursor<decltype(std::declval<const Range&>().begin())>(range.begin());
+}
+
+// Ground raster of the range in three streaming passes over xyz (extent, points per cell, lowest z of every cell)
+inline void StreamGroundRaster(const ogx::Data::Clouds::PointsRange& range, double cell_size, double percentile, GroundRaster& raster)
+{
+	auto xyz_range = ogx::Data::Clouds::RangeLocalXYZConst(range);
+	raster.SetCells(cell_size, percentile);
+	for (auto& xyz : xyz_range)
+	{
+		raster.AddBounds(xyz.x(), xyz.y());
+	}
+	raster.BeginCounting();
+	for (auto& xyz : xyz_range)
+	{
+		raster.Count(xyz.x(), xyz.y());
+	}
+	raster.BeginSelecting();
+	for (auto& xyz : xyz_range)
+	{
+		raster.Select(xyz.x(), xyz.y(), xyz.z());
+	}
+	raster.Finish();
+}
+
+// Color histograms of the range in one streaming pass, parts of at most chunk_points colors (0 - all at once) are
+// counted in parallel
+inline ColorHistograms StreamColorHistograms(const ogx::Data::Clouds::PointsRange& range, std::size_t chunk_points, bool hsl)
+{
+	ColorHistograms histograms(hsl);
+	if (chunk_points == 0) chunk_points = range.size();
+	std::vector<ogx::Data::Clouds::Color> colors;
+	colors.reserve(std::min(chunk_points, range.size()));
+	auto count = [&]
+	{
+		histograms.Merge(ColorHistogramsOf(reinterpret_cast<const std::uint8_t*>(colors.data()), sizeof(ogx::Data::Clouds::Color), colors.size(), hsl));
+		colors.clear();
+	};
+	for (auto& color : ogx::Data::Clouds::RangeColorConst(range))
+	{
+		colors.push_back(color);
+		if (colors.size() == chunk_points) count();
+	}
+	if (!colors.empty()) count();
+	return histograms;
+}
+
+// Groups of bins a histogram is written to the log in
+const std::size_t HISTOGRAM_LOG_GROUPS = 16;
+
+// Writes the histograms of the channels to the log with the thresholds suggested for them
+inline void ReportColorHistograms(const ColorHistograms& histograms, const std::vector<int>& channels)
+{
+	OGX_LINE.Format(ogx::Info, L"Histograms of %d points", int(histograms.Points()));
+	for (int channel : channels)
+	{
+		if (!histograms.HasChannel(channel)) continue;
+		const ChannelBins& bins = BinsOf(channel);
+		std::wstring line = std::wstring(bins.name) + L" [%]:";
+		for (double percentage : histograms.Percentages(channel, HISTOGRAM_LOG_GROUPS))
+		{
+			wchar_t value[32];
+			std::swprintf(value, 32, L" %.1f", percentage);
+			line += value;
+		}
+		OGX_LINE.Msg(ogx::Info, line);
+		ChannelThresholds thresholds = histograms.Thresholds(channel);
+		OGX_LINE.Format(ogx::Info, L"%ls threshold: %f (Otsu, %f %% of points below), %f (valley)", bins.name,
+			thresholds.otsu, thresholds.below_otsu * 100.0, thresholds.valley);
+	}
+}
+
+// Writes the stage summary of a run to the log, and the Chrome trace when a file is given
+inline void ReportStages(const StageProfile& profile, const ogx::String& trace_file)
+{
+	for (auto& line : profile.SummaryLines())
+	{
+		OGX_LINE.Msg(ogx::Info, line);
+	}
+	if (!trace_file.empty() && !profile.WriteChromeTrace(trace_file))
+	{
+		OGX_LINE.Msg(ogx::Info, L"Cannot write the trace file " + trace_file);
+	}
+}
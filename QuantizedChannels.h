@@ -0,0 +1,90 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Narrow per-point channels used by the kernels instead of StoredReal working copies:
+intensity as the 16-bit sum of R, G, B and lightness as max + min of the channels (both lossless),
+hue as a 16-bit code (error below 0.0055 degree) and feature classes as 8-bit ids.
+Layers of the cloud still hold StoredReal values: intensity sums and feature classes are converted when their
+layers are written, the H and L codes are working data only and never leave the kernels.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "ColorKernels.h"
+
+// Intensity of a color kept as R + G + B (0 - 765), the grayscale intensity is a third of it
+typedef std::uint16_t IntensitySum;
+
+inline IntensitySum IntensitySumOf(const std::uint8_t* c)
+{
+	return IntensitySum(c[0] + c[1] + c[2]);
+}
+
+inline float IntensityOfSum(IntensitySum sum)
+{
+	return float(1.0 / 3.0 * sum);
+}
+
+// Same as min < IntensityOfSum(sum) < max for integer limits
+inline bool IntensitySumInRange(IntensitySum sum, int min, int max)
+{
+	return sum > 3 * min && sum < 3 * max;
+}
+
+// Hue code: floor(H * HUE_CODES_PER_DEGREE), at most 65519 for H in [0, 360), error below 0.0055 degree.
+// A threshold which is a multiple of 1 / 182 degree (e.g. any whole degree) splits the codes exactly like the float hues.
+const double HUE_CODES_PER_DEGREE = 182;
+
+inline std::uint16_t HueCode(float H)
+{
+	return std::uint16_t(std::floor(double(H) * HUE_CODES_PER_DEGREE));
+}
+
+// H < t is tested as code < HueCodeBelow(t)
+inline std::uint16_t HueCodeBelow(double t)
+{
+	double code = std::ceil(t * HUE_CODES_PER_DEGREE);
+	return std::uint16_t(code < 0 ? 0 : (code > 65535 ? 65535 : code));
+}
+
+// Lightness of an 8-bit color is (max + min) / 510, kept without loss as the code max + min
+const double LIGHTNESS_CODES = 510;
+
+inline std::uint16_t LightnessCode(float L)
+{
+	return std::uint16_t(std::floor(double(L) * LIGHTNESS_CODES + 0.5));
+}
+
+// Exact thresholds of the codes: L >= t is code >= LightnessCodeAtLeast(t), L <= t is code <= LightnessCodeAtMost(t).
+// A threshold beyond the codes gives -1 or 65536, so every code stays on one side of it.
+inline double LightnessCodeAtLeast(double t)
+{
+	double code = std::ceil(t * LIGHTNESS_CODES - 1e-6);
+	return code < 0 ? -1.0 : (code > 65535 ? 65536.0 : code);
+}
+
+inline double LightnessCodeAtMost(double t)
+{
+	double code = std::floor(t * LIGHTNESS_CODES + 1e-6);
+	return code < 0 ? -1.0 : (code > 65535 ? 65536.0 : code);
+}
+
+// H and L codes of 'count' colors laid out every 'stride' bytes, converted through a small float block
+inline void RgbToHlCodes(const std::uint8_t* colors, std::size_t stride, std::size_t count, std::uint16_t* H, std::uint16_t* L)
+{
+	const std::size_t BLOCK = 256;
+	float h[BLOCK], l[BLOCK];
+	for (std::size_t begin = 0; begin < count; begin += BLOCK)
+	{
+		std::size_t n = count - begin < BLOCK ? count - begin : BLOCK;
+		RgbToHslChannels(colors + begin * stride, stride, n, h, nullptr, l);
+		for (std::size_t i = 0; i < n; i++)
+		{
+			H[begin + i] = HueCode(h[i]);
+			L[begin + i] = LightnessCode(l[i]);
+		}
+	}
+}
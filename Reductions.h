@@ -0,0 +1,307 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Reproducible reductions of per-point channels: sums, means, min / max, xy extents, counts and histograms,
+and thresholds splitting a histogram into two classes.
+Values are summed in blocks of REDUCTION_BLOCK points starting at multiples of it, every block in double in point
+order, and the block sums are combined in block order with compensated (Neumaier) summation. The result depends only
+on the values - not on the number of threads, nor on whether the channel is reduced in parallel or streamed in chunks.
+Counts and histograms are integers, their chunks are merged exactly.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "ColumnViews.h"
+#include "ThreadPool.h"
+
+// Points summed together in double before the block sums are combined
+const std::size_t REDUCTION_BLOCK = 4096;
+
+// Sum of terms added in a fixed order, with the rounding error of every addition carried separately
+class CompensatedSum
+{
+public:
+	CompensatedSum() : m_sum(0), m_compensation(0) {}
+
+	void Add(double term)
+	{
+		double sum = m_sum + term;
+		if (std::fabs(m_sum) >= std::fabs(term)) m_compensation += (m_sum - sum) + term;
+		else m_compensation += (term - sum) + m_sum;
+		m_sum = sum;
+	}
+
+	double Value() const { return m_sum + m_compensation; }
+
+private:
+	double m_sum;
+	double m_compensation;
+};
+
+// Partial statistics of one block of points
+struct BlockStatistics
+{
+	double sum;
+	std::size_t count;		// values which are not NaN
+	float min, max;
+};
+
+inline BlockStatistics EmptyBlockStatistics()
+{
+	BlockStatistics block = { 0.0, 0, std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity() };
+	return block;
+}
+
+// Statistics of the points [begin, end), NaN values are skipped
+inline BlockStatistics BlockStatisticsOf(ChannelView values, std::size_t begin, std::size_t end)
+{
+	BlockStatistics block = EmptyBlockStatistics();
+	for (std::size_t i = begin; i < end; i++)
+	{
+		const float value = values[i];
+		if (std::isnan(value)) continue;
+		block.sum += value;
+		block.count++;
+		block.min = std::min(block.min, value);
+		block.max = std::max(block.max, value);
+	}
+	return block;
+}
+
+// Count, sum, mean, min and max of a channel, NaN values are skipped.
+// Values are either streamed in point order (Add, in calls of any size) or given as whole blocks (AddBlock).
+class ChannelStatistics
+{
+public:
+	ChannelStatistics() : m_block(EmptyBlockStatistics()), m_block_points(0), m_count(0),
+		m_min(std::numeric_limits<float>::infinity()), m_max(-std::numeric_limits<float>::infinity()) {}
+
+	void Add(const float* values, std::size_t count)
+	{
+		for (std::size_t i = 0; i < count; i++)
+		{
+			const float value = values[i];
+			if (!std::isnan(value))
+			{
+				m_block.sum += value;
+				m_block.count++;
+				m_block.min = std::min(m_block.min, value);
+				m_block.max = std::max(m_block.max, value);
+			}
+			if (++m_block_points == REDUCTION_BLOCK) FlushBlock();
+		}
+	}
+
+	// Statistics of the next block, REDUCTION_BLOCK points long unless it is the last one
+	void AddBlock(const BlockStatistics& block)
+	{
+		assert(m_block_points == 0);
+		m_block = block;
+		FlushBlock();
+	}
+
+	std::size_t Count() const { return m_count + m_block.count; }
+
+	double Sum() const
+	{
+		CompensatedSum sum = m_sum;
+		if (m_block_points > 0) sum.Add(m_block.sum);
+		return sum.Value();
+	}
+
+	// Zero for a channel without values
+	double Mean() const { return Count() > 0 ? Sum() / double(Count()) : 0.0; }
+
+	// Infinity (min) and -infinity (max) for a channel without values
+	float Min() const { return std::min(m_min, m_block.min); }
+	float Max() const { return std::max(m_max, m_block.max); }
+
+private:
+	void FlushBlock()
+	{
+		m_sum.Add(m_block.sum);
+		m_count += m_block.count;
+		m_min = std::min(m_min, m_block.min);
+		m_max = std::max(m_max, m_block.max);
+		m_block = EmptyBlockStatistics();
+		m_block_points = 0;
+	}
+
+	BlockStatistics m_block;		// block being streamed
+	std::size_t m_block_points;
+	CompensatedSum m_sum;
+	std::size_t m_count;
+	float m_min, m_max;
+};
+
+// Statistics of the first 'count' points of a channel, blocks reduced in parallel
+inline ChannelStatistics ReduceChannel(ChannelView values, std::size_t count)
+{
+	std::vector<BlockStatistics> blocks((count + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK);
+	ParallelFor(blocks.size(), PARALLEL_GRAIN / REDUCTION_BLOCK, [&](std::size_t first_block, std::size_t last_block)
+	{
+		for (std::size_t b = first_block; b < last_block; b++)
+		{
+			blocks[b] = BlockStatisticsOf(values, b * REDUCTION_BLOCK, std::min((b + 1) * REDUCTION_BLOCK, count));
+		}
+	});
+	ChannelStatistics statistics;
+	for (const BlockStatistics& block : blocks) statistics.AddBlock(block);
+	return statistics;
+}
+
+// Bounding rectangle of points in the xy plane
+struct XyExtent
+{
+	double lo[2], hi[2];		// lo > hi if there are no points
+};
+
+template <typename Points>
+inline XyExtent XyExtentOf(const Points& points, std::size_t count)
+{
+	const XyExtent empty = { { std::numeric_limits<double>::max(), std::numeric_limits<double>::max() },
+		{ -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() } };
+	return ParallelReduce(count, PARALLEL_GRAIN, empty, [&](std::size_t begin, std::size_t end)
+	{
+		XyExtent chunk = empty;
+		for (std::size_t i = begin; i < end; i++)
+		{
+			for (int a = 0; a < 2; a++)
+			{
+				chunk.lo[a] = std::min(chunk.lo[a], double(points[i][a]));
+				chunk.hi[a] = std::max(chunk.hi[a], double(points[i][a]));
+			}
+		}
+		return chunk;
+	}, [](XyExtent a, const XyExtent& b)
+	{
+		for (int k = 0; k < 2; k++)
+		{
+			a.lo[k] = std::min(a.lo[k], b.lo[k]);
+			a.hi[k] = std::max(a.hi[k], b.hi[k]);
+		}
+		return a;
+	});
+}
+
+// Number of points i in [0, count) for which selected(i) holds
+template <typename Selected>
+inline std::size_t CountWhere(std::size_t count, Selected selected)
+{
+	return ParallelReduce(count, PARALLEL_GRAIN, std::size_t(0), [&](std::size_t begin, std::size_t end)
+	{
+		std::size_t found = 0;
+		for (std::size_t i = begin; i < end; i++)
+		{
+			if (selected(i)) found++;
+		}
+		return found;
+	}, [](std::size_t a, std::size_t b) { return a + b; });
+}
+
+// Counts of 'bins' bins, bin_of(i) gives the bin of point i or a negative number for a point left out
+template <typename BinOf>
+inline std::vector<std::size_t> Histogram(std::size_t count, std::size_t bins, BinOf bin_of)
+{
+	return ParallelReduce(count, PARALLEL_GRAIN, std::vector<std::size_t>(bins, 0), [&](std::size_t begin, std::size_t end)
+	{
+		std::vector<std::size_t> chunk(bins, 0);
+		for (std::size_t i = begin; i < end; i++)
+		{
+			const long long bin = bin_of(i);
+			if (bin >= 0) chunk[std::size_t(bin)]++;
+		}
+		return chunk;
+	}, [](std::vector<std::size_t> a, const std::vector<std::size_t>& b)
+	{
+		for (std::size_t k = 0; k < a.size(); k++) a[k] += b[k];
+		return a;
+	});
+}
+
+// Histogram of a channel over [lo, hi) in equal bins, values outside the range and NaN are left out
+inline std::vector<std::size_t> ChannelHistogram(ChannelView values, std::size_t count, double lo, double hi, std::size_t bins)
+{
+	const double scale = hi > lo ? double(bins) / (hi - lo) : 0.0;
+	return Histogram(count, bins, [&](std::size_t i) -> long long
+	{
+		const double value = values[i];
+		if (!(value >= lo && value < hi)) return -1;
+		return std::min((long long)((value - lo) * scale), (long long)bins - 1);
+	});
+}
+
+// Threshold of Otsu's method: the first bin of the upper class, chosen so the variance between the two classes is the
+// largest. 0 for a histogram with fewer than two non-empty bins.
+inline std::size_t OtsuThreshold(const std::vector<std::size_t>& histogram)
+{
+	double total = 0, total_sum = 0;
+	for (std::size_t b = 0; b < histogram.size(); b++)
+	{
+		total += double(histogram[b]);
+		total_sum += double(b) * double(histogram[b]);
+	}
+	std::size_t threshold = 0;
+	double lower = 0, lower_sum = 0, best = 0;
+	for (std::size_t b = 1; b < histogram.size(); b++)
+	{
+		lower += double(histogram[b - 1]);
+		lower_sum += double(b - 1) * double(histogram[b - 1]);
+		const double upper = total - lower;
+		if (lower == 0 || upper == 0) continue;
+		const double difference = lower_sum / lower - (total_sum - lower_sum) / upper;
+		const double between = lower * upper * difference * difference;
+		if (between > best)
+		{
+			best = between;
+			threshold = b;
+		}
+	}
+	return threshold;
+}
+
+// Threshold at the valley of a bimodal histogram (minimum method): the histogram is smoothed with a 3-bin mean until
+// it has two peaks, the lowest bin between them starts the upper class. Otsu's threshold if it never gets two peaks.
+inline std::size_t ValleyThreshold(const std::vector<std::size_t>& histogram, int max_smoothing = 1000)
+{
+	const std::size_t bins = histogram.size();
+	if (bins < 3) return OtsuThreshold(histogram);
+	std::vector<double> smoothed(histogram.begin(), histogram.end()), previous(bins);
+	for (int iteration = 0; iteration <= max_smoothing; iteration++)
+	{
+		// bins outside the histogram count as lower than any bin, a plateau is one peak at its first bin
+		std::size_t peaks[2], peak_count = 0;
+		for (std::size_t b = 0; b < bins; b++)
+		{
+			if (b > 0 && smoothed[b] <= smoothed[b - 1]) continue;
+			std::size_t end = b + 1;
+			while (end < bins && smoothed[end] == smoothed[b]) end++;
+			if (end < bins && smoothed[end] > smoothed[b]) continue;
+			if (peak_count < 2) peaks[peak_count] = b;
+			peak_count++;
+		}
+		if (peak_count == 2)
+		{
+			std::size_t valley = peaks[0];
+			for (std::size_t b = peaks[0]; b <= peaks[1]; b++)
+			{
+				if (smoothed[b] < smoothed[valley]) valley = b;
+			}
+			return valley;
+		}
+		if (peak_count < 2) break;
+		previous.swap(smoothed);
+		for (std::size_t b = 0; b < bins; b++)
+		{
+			const std::size_t lo = b > 0 ? b - 1 : 0, hi = std::min(b + 1, bins - 1);
+			smoothed[b] = (previous[lo] + previous[b] + previous[hi]) / 3.0;
+		}
+	}
+	return OtsuThreshold(histogram);
+}
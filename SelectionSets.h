@@ -0,0 +1,490 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Compressed selections of points. Points are split into chunks of SELECTION_CHUNK consecutive indices, every chunk is
+kept as runs of selected points or as a bitmap, whichever is smaller (as in roaring bitmaps), an empty chunk takes no
+memory. Results of the methods are stored as named selections and combined with and, or, not chunk by chunk, without
+a pass over the points or the states of the cloud. Expressions like 'vegetation and not selected-by-color' are
+compiled once and evaluated on the stored selections, states are written only from the final result.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <string>
+#include <vector>
+
+#include "ColorKernels.h"
+#include "ThreadPool.h"
+
+// Points of one chunk of a selection
+const std::size_t SELECTION_CHUNK = 65536;
+const std::size_t SELECTION_CHUNK_WORDS = SELECTION_CHUNK / 64;
+// A chunk with more runs is kept as a bitmap (4 bytes per run, the bitmap takes 8 KB)
+const std::size_t SELECTION_MAX_RUNS = SELECTION_CHUNK_WORDS * 2;
+
+// Points [begin, last] of a chunk, as offsets from its first point
+struct SelectionRun
+{
+	std::uint16_t begin, last;
+};
+
+// Selected points of one chunk: runs, or a bitmap if 'bits' is not empty
+struct SelectionChunk
+{
+	std::vector<SelectionRun> runs;
+	std::vector<std::uint64_t> bits;
+
+	bool Empty() const { return runs.empty() && bits.empty(); }
+
+	// Bitmap of the chunk in SELECTION_CHUNK_WORDS words
+	void Words(std::uint64_t* words) const
+	{
+		if (!bits.empty())
+		{
+			std::memcpy(words, bits.data(), SELECTION_CHUNK_WORDS * sizeof(std::uint64_t));
+			return;
+		}
+		std::memset(words, 0, SELECTION_CHUNK_WORDS * sizeof(std::uint64_t));
+		for (const SelectionRun& run : runs)
+		{
+			for (std::size_t w = run.begin / 64; w <= std::size_t(run.last) / 64; w++)
+			{
+				const std::size_t lo = std::max<std::size_t>(run.begin, w * 64) - w * 64, hi = std::min<std::size_t>(run.last, w * 64 + 63) - w * 64;
+				words[w] |= (hi == 63 ? ~std::uint64_t(0) : (std::uint64_t(1) << (hi + 1)) - 1) & ~((std::uint64_t(1) << lo) - 1);
+			}
+		}
+	}
+
+	// Chunk of the bitmap, as runs when there are few of them
+	static SelectionChunk Of(const std::uint64_t* words)
+	{
+		SelectionChunk chunk;
+		std::size_t runs = 0;
+		std::uint64_t carry = 0;		// last bit of the previous word
+		for (std::size_t w = 0; w < SELECTION_CHUNK_WORDS; w++)
+		{
+			runs += PopCount64(words[w] & ~((words[w] << 1) | carry));		// first points of runs
+			carry = words[w] >> 63;
+		}
+		if (runs > SELECTION_MAX_RUNS)
+		{
+			chunk.bits.assign(words, words + SELECTION_CHUNK_WORDS);
+			return chunk;
+		}
+		chunk.runs.reserve(runs);
+		for (std::size_t w = 0; w < SELECTION_CHUNK_WORDS; w++)
+		{
+			std::uint64_t word = words[w];
+			std::size_t bit = 0;
+			while (word)
+			{
+				// skip the zeros, then take the ones
+				const int zeros = CountTrailingZeros64(word);
+				word >>= zeros;
+				bit += zeros;
+				const int ones = (~word == 0) ? 64 : CountTrailingZeros64(~word);
+				const std::size_t begin = w * 64 + bit, last = begin + ones - 1;
+				if (!chunk.runs.empty() && chunk.runs.back().last + std::size_t(1) == begin) chunk.runs.back().last = std::uint16_t(last);
+				else
+				{
+					SelectionRun run = { std::uint16_t(begin), std::uint16_t(last) };
+					chunk.runs.push_back(run);
+				}
+				word = ones == 64 ? 0 : word >> ones;
+				bit += ones;
+			}
+		}
+		return chunk;
+	}
+};
+
+class PointSelection
+{
+public:
+	PointSelection() : m_points(0) {}
+	explicit PointSelection(std::size_t points) : m_points(points), m_chunks((points + SELECTION_CHUNK - 1) / SELECTION_CHUNK) {}
+
+	// Points i in [0, points) for which selected(i) holds, chunks built in parallel
+	template <typename Selected>
+	static PointSelection Of(std::size_t points, Selected selected)
+	{
+		PointSelection selection(points);
+		ParallelFor(selection.m_chunks.size(), 1, [&](std::size_t first_chunk, std::size_t last_chunk)
+		{
+			std::vector<std::uint64_t> words(SELECTION_CHUNK_WORDS);
+			for (std::size_t c = first_chunk; c < last_chunk; c++)
+			{
+				std::fill(words.begin(), words.end(), std::uint64_t(0));
+				const std::size_t first = c * SELECTION_CHUNK, count = std::min(SELECTION_CHUNK, points - first);
+				for (std::size_t i = 0; i < count; i++)
+				{
+					if (selected(first + i)) words[i / 64] |= std::uint64_t(1) << (i % 64);
+				}
+				selection.m_chunks[c] = SelectionChunk::Of(words.data());
+			}
+		});
+		return selection;
+	}
+
+	// Points with their bit set in the mask of MaskWords(points) words
+	static PointSelection OfMask(const std::uint64_t* mask, std::size_t points)
+	{
+		PointSelection selection(points);
+		ParallelFor(selection.m_chunks.size(), 1, [&](std::size_t first_chunk, std::size_t last_chunk)
+		{
+			std::vector<std::uint64_t> words(SELECTION_CHUNK_WORDS);
+			for (std::size_t c = first_chunk; c < last_chunk; c++)
+			{
+				std::fill(words.begin(), words.end(), std::uint64_t(0));
+				const std::size_t first_word = c * SELECTION_CHUNK_WORDS, count = std::min(SELECTION_CHUNK_WORDS, MaskWords(points) - first_word);
+				std::copy(mask + first_word, mask + first_word + count, words.begin());
+				selection.ClearTail(c, words.data());
+				selection.m_chunks[c] = SelectionChunk::Of(words.data());
+			}
+		});
+		return selection;
+	}
+
+	std::size_t Points() const { return m_points; }
+	std::size_t ChunkCount() const { return m_chunks.size(); }
+	const SelectionChunk& Chunk(std::size_t chunk) const { return m_chunks[chunk]; }
+
+	// Number of selected points
+	std::size_t Count() const
+	{
+		std::size_t count = 0;
+		for (const SelectionChunk& chunk : m_chunks)
+		{
+			for (const SelectionRun& run : chunk.runs) count += std::size_t(run.last) - run.begin + 1;
+			for (std::uint64_t word : chunk.bits) count += PopCount64(word);
+		}
+		return count;
+	}
+
+	// Memory of the runs and bitmaps
+	std::size_t Bytes() const
+	{
+		std::size_t bytes = m_chunks.size() * sizeof(SelectionChunk);
+		for (const SelectionChunk& chunk : m_chunks) bytes += chunk.runs.size() * sizeof(SelectionRun) + chunk.bits.size() * sizeof(std::uint64_t);
+		return bytes;
+	}
+
+	bool Contains(std::size_t i) const
+	{
+		const SelectionChunk& chunk = m_chunks[i / SELECTION_CHUNK];
+		const std::size_t offset = i % SELECTION_CHUNK;
+		if (!chunk.bits.empty()) return ((chunk.bits[offset / 64] >> (offset % 64)) & 1) != 0;
+		auto after = std::upper_bound(chunk.runs.begin(), chunk.runs.end(), offset, [](std::size_t point, const SelectionRun& run) { return point < run.begin; });
+		return after != chunk.runs.begin() && offset <= (after - 1)->last;
+	}
+
+	// Chunks of the result of operation(words of a, words of b, result words) on every pair of chunks, in parallel.
+	// 'empty_a' and 'empty_b' give the result when the chunk of a or of b is empty (0 - empty, 1 - the other chunk,
+	// 2 - computed), so empty chunks are mostly skipped.
+	template <typename Operation>
+	static PointSelection Combine(const PointSelection& a, const PointSelection& b, int empty_a, int empty_b, Operation operation)
+	{
+		PointSelection result(a.m_points);
+		ParallelFor(result.m_chunks.size(), 16, [&](std::size_t first_chunk, std::size_t last_chunk)
+		{
+			std::vector<std::uint64_t> x(SELECTION_CHUNK_WORDS), y(SELECTION_CHUNK_WORDS), z(SELECTION_CHUNK_WORDS);
+			for (std::size_t c = first_chunk; c < last_chunk; c++)
+			{
+				const SelectionChunk& ca = a.m_chunks[c];
+				const SelectionChunk& cb = b.m_chunks[c];
+				const int empty = ca.Empty() ? empty_a : (cb.Empty() ? empty_b : 2);
+				if (empty == 0) continue;
+				if (empty == 1)
+				{
+					result.m_chunks[c] = ca.Empty() ? cb : ca;
+					continue;
+				}
+				ca.Words(x.data());
+				cb.Words(y.data());
+				for (std::size_t w = 0; w < SELECTION_CHUNK_WORDS; w++) z[w] = operation(x[w], y[w]);
+				result.ClearTail(c, z.data());
+				result.m_chunks[c] = SelectionChunk::Of(z.data());
+			}
+		});
+		return result;
+	}
+
+private:
+	friend class SelectionBuilder;
+
+	// Clears the bits past the last point in the last chunk
+	void ClearTail(std::size_t chunk, std::uint64_t* words) const
+	{
+		const std::size_t count = std::min(SELECTION_CHUNK, m_points - chunk * SELECTION_CHUNK);
+		if (count == SELECTION_CHUNK) return;
+		if (count % 64) words[count / 64] &= (std::uint64_t(1) << (count % 64)) - 1;
+		std::fill(words + (count + 63) / 64, words + SELECTION_CHUNK_WORDS, std::uint64_t(0));
+	}
+
+	std::size_t m_points;
+	std::vector<SelectionChunk> m_chunks;
+};
+
+// Builds a selection from points added in increasing order, with one chunk of memory besides the result
+class SelectionBuilder
+{
+public:
+	explicit SelectionBuilder(std::size_t points) : m_selection(points), m_chunk(0), m_words(SELECTION_CHUNK_WORDS, 0), m_dirty(false) {}
+
+	void Add(std::size_t i)
+	{
+		if (i / SELECTION_CHUNK != m_chunk)
+		{
+			Flush();
+			m_chunk = i / SELECTION_CHUNK;
+		}
+		const std::size_t offset = i % SELECTION_CHUNK;
+		m_words[offset / 64] |= std::uint64_t(1) << (offset % 64);
+		m_dirty = true;
+	}
+
+	PointSelection Finish()
+	{
+		Flush();
+		return std::move(m_selection);
+	}
+
+private:
+	void Flush()
+	{
+		if (!m_dirty) return;
+		m_selection.m_chunks[m_chunk] = SelectionChunk::Of(m_words.data());
+		std::fill(m_words.begin(), m_words.end(), std::uint64_t(0));
+		m_dirty = false;
+	}
+
+	PointSelection m_selection;
+	std::size_t m_chunk;
+	std::vector<std::uint64_t> m_words;
+	bool m_dirty;
+};
+
+// Points selected in both
+inline PointSelection SelectionAnd(const PointSelection& a, const PointSelection& b)
+{
+	return PointSelection::Combine(a, b, 0, 0, [](std::uint64_t x, std::uint64_t y) { return x & y; });
+}
+
+// Points selected in any of them
+inline PointSelection SelectionOr(const PointSelection& a, const PointSelection& b)
+{
+	return PointSelection::Combine(a, b, 1, 1, [](std::uint64_t x, std::uint64_t y) { return x | y; });
+}
+
+// Points not selected
+inline PointSelection SelectionNot(const PointSelection& a)
+{
+	return PointSelection::Combine(a, a, 2, 2, [](std::uint64_t x, std::uint64_t) { return ~x; });
+}
+
+// Operators above a name in an expression, deeper expressions are rejected by Compile
+const int SELECTION_NESTING_DEPTH = 32;
+
+// Expression of named selections: names joined by and (&&), or (||), not (!) and parentheses, 'not' binds the
+// strongest and 'or' the weakest. Names are letters, digits, '_', '-' and '.', the operators are not case-sensitive.
+class SelectionExpression
+{
+public:
+	// Compiles the text, on failure the expression is left empty and 'error' describes the problem
+	bool Compile(const std::wstring& text, std::wstring& error)
+	{
+		m_program.clear();
+		m_names.clear();
+		m_text = text;
+		m_position = 0;
+		m_depth = 0;
+		m_error.clear();
+		Next();
+		ParseOr();
+		if (m_error.empty() && m_token != TOKEN_END) Fail(L"expected 'and', 'or' or the end of the expression");
+		if (m_error.empty() && m_program.empty()) Fail(L"empty expression");
+		error = m_error;
+		if (!m_error.empty()) m_program.clear();
+		return m_error.empty();
+	}
+
+	// Names of the selections the expression reads
+	const std::vector<std::wstring>& Names() const { return m_names; }
+
+	// Evaluates the expression, find(name) gives the stored selection or null. False (with 'error') for a missing
+	// selection or selections of different clouds.
+	template <typename Find>
+	bool Evaluate(Find find, PointSelection& result, std::wstring& error) const
+	{
+		std::vector<PointSelection> stack;
+		std::size_t points = 0;
+		for (std::size_t n = 0; n < m_names.size(); n++)
+		{
+			const PointSelection* selection = find(m_names[n]);
+			if (!selection)
+			{
+				error = L"no selection '" + m_names[n] + L"'";
+				return false;
+			}
+			if (n > 0 && selection->Points() != points)
+			{
+				error = L"selection '" + m_names[n] + L"' is of a different number of points";
+				return false;
+			}
+			points = selection->Points();
+		}
+		for (const Instruction& instruction : m_program)
+		{
+			switch (instruction.opcode)
+			{
+			case OP_NAME:
+				stack.push_back(*find(m_names[instruction.name]));
+				break;
+			case OP_NOT:
+				stack.back() = SelectionNot(stack.back());
+				break;
+			case OP_AND: case OP_OR:
+				stack[stack.size() - 2] = instruction.opcode == OP_AND ? SelectionAnd(stack[stack.size() - 2], stack.back()) : SelectionOr(stack[stack.size() - 2], stack.back());
+				stack.pop_back();
+				break;
+			}
+		}
+		result = stack.back();
+		return true;
+	}
+
+private:
+	enum Opcode { OP_NAME, OP_AND, OP_OR, OP_NOT };
+	enum Token { TOKEN_END, TOKEN_NAME, TOKEN_SYMBOL };
+
+	struct Instruction
+	{
+		Opcode opcode;
+		std::size_t name;		// index in m_names for OP_NAME
+	};
+
+	void Fail(const std::wstring& message)
+	{
+		if (m_error.empty()) m_error = message + L" at character " + std::to_wstring(m_token_start + 1);
+		m_token = TOKEN_END;
+	}
+
+	static bool IsNameCharacter(wchar_t c)
+	{
+		return std::iswalnum(c) || c == L'_' || c == L'-' || c == L'.';
+	}
+
+	void Next()
+	{
+		while (m_position < m_text.size() && std::iswspace(m_text[m_position])) m_position++;
+		m_token_start = m_position;
+		m_name.clear();
+		if (m_position == m_text.size())
+		{
+			m_token = TOKEN_END;
+			return;
+		}
+		if (IsNameCharacter(m_text[m_position]))
+		{
+			while (m_position < m_text.size() && IsNameCharacter(m_text[m_position])) m_name += m_text[m_position++];
+			m_token = TOKEN_NAME;
+			return;
+		}
+		static const wchar_t* const symbols[] = { L"&&", L"||", L"!", L"(", L")" };
+		for (const wchar_t* symbol : symbols)
+		{
+			const std::wstring name(symbol);
+			if (m_text.compare(m_position, name.size(), name) == 0)
+			{
+				m_name = name;
+				m_position += name.size();
+				m_token = TOKEN_SYMBOL;
+				return;
+			}
+		}
+		Fail(std::wstring(L"unexpected '") + m_text[m_position] + L"'");
+	}
+
+	static bool IsKeyword(const std::wstring& name)
+	{
+		std::wstring lower;
+		for (wchar_t c : name) lower += wchar_t(std::towlower(c));
+		return lower == L"and" || lower == L"or" || lower == L"not";
+	}
+
+	// Operator keywords are matched without regard to case
+	bool Accept(const wchar_t* name)
+	{
+		if (m_token == TOKEN_END) return false;
+		std::wstring lower;
+		for (wchar_t c : m_name) lower += wchar_t(std::towlower(c));
+		if (lower != name) return false;
+		Next();
+		return true;
+	}
+
+	void Emit(Opcode opcode, std::size_t name = 0)
+	{
+		Instruction instruction = { opcode, name };
+		m_program.push_back(instruction);
+	}
+
+	void ParseOr()
+	{
+		ParseAnd();
+		while (Accept(L"or") || Accept(L"||"))
+		{
+			ParseAnd();
+			Emit(OP_OR);
+		}
+	}
+
+	void ParseAnd()
+	{
+		ParseNot();
+		while (Accept(L"and") || Accept(L"&&"))
+		{
+			ParseNot();
+			Emit(OP_AND);
+		}
+	}
+
+	void ParseNot()
+	{
+		if (++m_depth > SELECTION_NESTING_DEPTH) Fail(L"expression nested too deeply");
+		if (Accept(L"not") || Accept(L"!"))
+		{
+			ParseNot();
+			Emit(OP_NOT);
+		}
+		else if (Accept(L"("))
+		{
+			ParseOr();
+			if (!Accept(L")")) Fail(L"expected ')'");
+		}
+		else if (m_token == TOKEN_NAME && !IsKeyword(m_name))
+		{
+			std::size_t n = std::find(m_names.begin(), m_names.end(), m_name) - m_names.begin();
+			if (n == m_names.size()) m_names.push_back(m_name);
+			Emit(OP_NAME, n);
+			Next();
+		}
+		else Fail(L"expected a selection name, 'not' or '('");
+		m_depth--;
+	}
+
+	std::vector<Instruction> m_program;		// postfix
+	std::vector<std::wstring> m_names;
+
+	// compilation
+	std::wstring m_text;
+	std::size_t m_position, m_token_start;
+	int m_depth;
+	Token m_token;
+	std::wstring m_name;
+	std::wstring m_error;
+};
@@ -0,0 +1,153 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Temat: zaznaczenia
+czenie wynikw metod zapisanych jako nazwane zaznaczenia punktw (and, or, not) bez przebiegu po punktach chmury,
+wynik jest zapisywany jako nowe zaznaczenie, a do stanw punktw tylko na danie. Zaznaczenia s zapisywane w warstwach
+chmury ("selection <nazwa>"), wic pozostaj w projekcie i s widoczne dla metod z innych moduw.
+*/
+
+
+#include <ogx/Plugins/EasyPlugin.h>
+#include <ogx/Data/Clouds/CloudHelpers.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "PluginHelpers.h"
+#include "SelectionSets.h"
+
+using namespace ogx;
+using namespace ogx::Data;
+
+// Cloud combined by one run: operands found on the calling thread, evaluated on the pool, stored on the calling thread
+struct SelectionsJob
+{
+	SelectionsJob() : points(0), skipped(false), evaluated(false) {}
+
+	std::size_t points;
+	Data::ResourceID node_id;
+	bool skipped;			// no method stored selections for the cloud
+	std::map<std::wstring, std::vector<StoredReal>> layer_values;	// of the selection layers of the operands found
+	std::map<std::wstring, std::shared_ptr<const PointSelection>> operands;
+	PointSelection result;
+	bool evaluated;
+	std::wstring error;
+};
+
+struct Selections : public ogx::Plugin::EasyMethod
+{
+	//fields
+	Nodes::ITransTreeNode* m_node;
+	SelectionExpression m_expression;	// compiled by Init
+
+	//parameters
+	Data::ResourceID m_node_id;
+	String expression;			// stored selections joined by and, or, not
+	String result_name;			// the result is stored as a selection of this name
+	bool write_states;			// points of the result are selected in the states if true
+	String trace_file;			// Chrome trace of the stages of every run (empty - not written)
+
+	//constructor
+	Selections() : EasyMethod(L"Mateusz Pielach", L"Selections of points - and, or, not of the stored results")
+	{
+	}
+
+	//add input/output parameters
+	virtual void DefineParameters(ParameterBank& bank)
+	{
+		bank.Add(L"node_id", m_node_id = Data::ResourceID::invalid).AsNode();	//cloud choice
+		bank.Add(L"expression", expression = L"vegetation and not selected-by-color", L"Selections stored by the other methods (selected-by-color, a color class, "
+			L"selected-by-intensity, snow, vegetation, roads, or a result of this method) joined by and, or, not and parentheses");
+		bank.Add(L"result name", result_name = L"result", L"The result is stored as a selection of this name, to be used by later expressions");
+		bank.Add(L"write states", write_states = true, L"If set, points of the result are selected in the states and the other points unselected, other state bits are kept");
+		bank.Add(L"trace file", trace_file = L"", L"If set, time of every stage is also written to this file as a Chrome trace (chrome://tracing, ui.perfetto.dev)");
+	}
+
+	bool Init(Execution::Context& context)
+	{
+		OGX_SCOPE(log);
+		//get node from id
+		m_node = context.m_project->TransTreeFindNode(m_node_id);
+		if (!m_node) ReportError(L"You must define node_id");
+
+		// the expression is compiled once, runs only combine the runs of the selections
+		std::wstring expression_error;
+		if (!m_expression.Compile(expression, expression_error)) ReportError(L"Invalid expression: " + expression_error);
+
+		OGX_LINE.Msg(User, L"Initialization succeeded");
+		return EasyMethod::Init(context);
+	}
+
+	virtual void Run(Context&)
+	{
+		ThreadPoolRun pool_run;
+		StageProfile profile;
+		ParallelForEachCloud(*m_node, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node)
+		{
+			SelectionsJob job;
+			Data::Clouds::PointsRange points_all;
+			cloud.GetAccess().GetAllPoints(points_all);
+			job.points = points_all.size();
+			job.node_id = node.GetID();
+
+			// selections are stored in the layers of the cloud, only those of the expression are read
+			ScopedStage stage(profile, L"read selections", points_all.size());
+			CloudLayers layers(cloud);
+			for (auto& name : m_expression.Names())
+			{
+				Data::Layers::ILayer* layer = layers.Find(SelectionLayerName(name));
+				if (layer) points_all.GetLayerVals(job.layer_values[name], *layer);
+			}
+			stage.Copied(job.layer_values.size() * points_all.size() * sizeof(StoredReal));
+
+			// clouds no method stored selections for (like simplified copies) are not inputs
+			job.skipped = job.layer_values.empty();
+			if (job.skipped) OGX_LINE.Msg(ogx::Warning, L"No selections stored for the cloud, skipped");
+			return job;
+		}, [&](SelectionsJob & job)
+		{
+			if (job.skipped) return;
+			// unchanged layers give the selections kept in the store
+			ScopedStage stage(profile, L"combine selections", job.points);
+			for (auto& values : job.layer_values)
+			{
+				job.operands[values.first] = SelectionOfLayer(job.node_id, values.first, values.second);
+			}
+			job.layer_values.clear();
+			// selections are combined chunk by chunk, the points are not visited
+			job.evaluated = m_expression.Evaluate([&](const std::wstring &name) { return job.operands[name].get(); }, job.result, job.error);
+		}, [&](Clouds::ICloud & cloud, Nodes::ITransTreeNode & node, SelectionsJob & job)
+		{
+			if (job.skipped) return;
+			if (!job.evaluated)
+			{
+				std::wstring stored;
+				for (auto& operand : job.operands) if (operand.second) stored += (stored.empty() ? L"" : L", ") + operand.first;
+				ReportError(L"Cannot evaluate the expression: " + job.error + L" (selections of the expression stored with the cloud: " + (stored.empty() ? L"none" : stored) + L")");
+			}
+
+			// states are written only on request, the selected bit of every point from the bitmap of its chunk
+			if (write_states)
+			{
+				Data::Clouds::PointsRange points_all;
+				cloud.GetAccess().GetAllPoints(points_all);
+				ScopedStage stage(profile, L"write states", points_all.size());
+				std::vector<std::uint64_t> words(SELECTION_CHUNK_WORDS);
+				std::size_t i = 0;
+				for (auto& state : Data::Clouds::RangeState(points_all))
+				{
+					const std::size_t offset = i % SELECTION_CHUNK;
+					if (offset == 0) job.result.Chunk(i / SELECTION_CHUNK).Words(words.data());
+					state[Data::Clouds::PS_SELECTED] = ((words[offset / 64] >> (offset % 64)) & 1) != 0;
+					i++;
+				}
+				stage.Copied(points_all.size() * sizeof(Data::Clouds::State));
+			}
+			StoreSelection(cloud, node, result_name, std::move(job.result), profile);
+		});
+		ReportStages(profile, trace_file);
+	}
+};
+
+OGX_EXPORT_METHOD(Selections)
@@ -0,0 +1,86 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Homogeneous simplification computed as a set of representative points of the original cloud.
+Nothing is copied - the result is a selection bitmask over the original point indices.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ColorKernels.h"
+#include "SpatialIndex.h"
+#include "ThreadPool.h"
+
+// Greedy selection of representatives: a point becomes a representative unless one already lies closer
+// than 'minimal_distance'. The grid must be built with cell size minimal_distance, so conflicts can only
+// come from the 26 neighbouring cells. Cells are processed in 8 phases by coordinate parity - cells of one
+// phase are never neighbours, so each phase runs in parallel and the result does not depend on thread count.
+// Returns the number of representatives, mask gets MaskWords(grid.Size()) words.
+inline std::size_t HomogeneousRepresentatives(const VoxelHashGrid& grid, double minimal_distance, std::vector<std::uint64_t>& mask)
+{
+	const double d2 = minimal_distance * minimal_distance;
+	std::vector<std::uint8_t> accepted(grid.Size(), 0);		// per position in cell order
+
+	std::vector<std::uint32_t> phase_cells[8];
+	for (std::size_t c = 0; c < grid.CellCount(); c++)
+	{
+		int coords[3];
+		grid.CellCoords(c, coords);
+		phase_cells[(coords[0] & 1) | ((coords[1] & 1) << 1) | ((coords[2] & 1) << 2)].push_back(std::uint32_t(c));
+	}
+
+	for (int phase = 0; phase < 8; phase++)
+	{
+		const std::vector<std::uint32_t>& cells = phase_cells[phase];
+		ParallelFor(cells.size(), 256, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t k = begin; k < end; k++)
+			{
+				std::size_t c = cells[k];
+				int coords[3];
+				grid.CellCoords(c, coords);
+				long long neighbours[27];
+				int neighbour_count = 0;
+				for (int dz = -1; dz <= 1; dz++)
+					for (int dy = -1; dy <= 1; dy++)
+						for (int dx = -1; dx <= 1; dx++)
+						{
+							long long other = grid.FindCell(coords[0] + dx, coords[1] + dy, coords[2] + dz);
+							if (other >= 0) neighbours[neighbour_count++] = other;
+						}
+
+				for (std::size_t pos = grid.CellBegin(c); pos < grid.CellEnd(c); pos++)
+				{
+					const float* p = grid.PointAt(pos);
+					bool free = true;
+					for (int n = 0; n < neighbour_count && free; n++)
+					{
+						std::size_t other = std::size_t(neighbours[n]);
+						for (std::size_t q = grid.CellBegin(other); q < grid.CellEnd(other) && free; q++)
+						{
+							if (!accepted[q]) continue;
+							const float* o = grid.PointAt(q);
+							double x = double(o[0]) - p[0], y = double(o[1]) - p[1], z = double(o[2]) - p[2];
+							free = x * x + y * y + z * z >= d2;
+						}
+					}
+					accepted[pos] = free;
+				}
+			}
+		});
+	}
+
+	mask.assign(MaskWords(grid.Size()), 0);
+	std::size_t representatives = 0;
+	for (std::size_t pos = 0; pos < grid.Size(); pos++)
+	{
+		if (!accepted[pos]) continue;
+		std::uint32_t i = grid.IndexAt(pos);
+		mask[i / 64] |= std::uint64_t(1) << (i % 64);
+		representatives++;
+	}
+	return representatives;
+}
@@ -0,0 +1,441 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Spatial indices built once per cloud from the already loaded xyz values.
+Queries return indices into the arrays the index was built from, so neighbour attributes
+are read straight from the loaded vectors instead of through new PointsRange copies.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Balanced kd-tree over 3D points. Points are stored again in tree order, so a leaf is one
+// contiguous block and consecutive queries in tree order touch the same memory.
+// The shape depends only on the number of points: node n has children 2n+1 and 2n+2,
+// every split halves its range and leaves hold at most LEAF_SIZE points.
+class KdTree
+{
+public:
+	static const std::size_t LEAF_SIZE = 16;
+
+	KdTree() : m_levels(0) {}
+
+	// Builds the tree from points[i][0..2], i in [0, count)
+	template <typename Points>
+	void Build(const Points& points, std::size_t count)
+	{
+		m_levels = 0;
+		while ((count >> m_levels) > LEAF_SIZE) m_levels++;
+		m_split_value.assign((std::size_t(1) << m_levels) - 1, 0.0f);
+		m_split_axis.assign(m_split_value.size(), 0);
+
+		std::vector<float> source(count * 3);
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++)
+			{
+				for (int a = 0; a < 3; a++) source[i * 3 + a] = float(points[i][a]);
+			}
+		});
+		m_index.resize(count);
+		for (std::size_t i = 0; i < count; i++) m_index[i] = std::uint32_t(i);
+
+		BuildNode(source, 0, 0, count, 0);
+
+		m_xyz.resize(count * 3);
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t pos = begin; pos < end; pos++)
+			{
+				for (int a = 0; a < 3; a++) m_xyz[pos * 3 + a] = source[std::size_t(m_index[pos]) * 3 + a];
+			}
+		});
+	}
+
+	std::size_t Size() const { return m_index.size(); }
+
+	// Original index and coordinates of the pos-th point in tree order
+	std::uint32_t IndexAt(std::size_t pos) const { return m_index[pos]; }
+	const float* PointAt(std::size_t pos) const { return &m_xyz[pos * 3]; }
+
+	// k nearest points of the query (the query point itself included when it is in the tree).
+	// Writes original indices and squared distances sorted by distance, returns how many were found.
+	int FindNearest(const float* query, int k, std::uint32_t* indices, float* sq_distances) const
+	{
+		if (k <= 0 || m_index.empty()) return 0;
+		int found = 0;
+		SearchNode(query, k, indices, sq_distances, found, 0, 0, m_index.size(), 0);
+		return found;
+	}
+
+	// Reads or writes every member through the archive (IndexFileWriter / IndexFileReader)
+	template <typename Archive>
+	bool Serialize(Archive& archive)
+	{
+		return archive.Count(m_levels) && archive.Array(m_split_value) && archive.Array(m_split_axis) && archive.Array(m_index) && archive.Array(m_xyz);
+	}
+
+	// Checks the sizes of a tree read from a file
+	bool Consistent(std::size_t count) const
+	{
+		return m_levels < 32 && m_split_value.size() == (std::size_t(1) << m_levels) - 1 && m_split_axis.size() == m_split_value.size()
+			&& m_index.size() == count && m_xyz.size() == 3 * count;
+	}
+
+private:
+	void BuildNode(std::vector<float>& source, std::size_t node, std::size_t begin, std::size_t end, std::size_t level)
+	{
+		if (level == m_levels) return;
+
+		// split along the longest side of the range's bounding box
+		float lo[3], hi[3];
+		for (int a = 0; a < 3; a++) lo[a] = hi[a] = source[std::size_t(m_index[begin]) * 3 + a];
+		for (std::size_t i = begin; i < end; i++)
+		{
+			const float* p = &source[std::size_t(m_index[i]) * 3];
+			for (int a = 0; a < 3; a++)
+			{
+				lo[a] = std::min(lo[a], p[a]);
+				hi[a] = std::max(hi[a], p[a]);
+			}
+		}
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+		{
+			if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+		}
+
+		std::size_t mid = begin + (end - begin) / 2;
+		std::nth_element(m_index.begin() + begin, m_index.begin() + mid, m_index.begin() + end, [&](std::uint32_t a, std::uint32_t b)
+		{
+			return source[std::size_t(a) * 3 + axis] < source[std::size_t(b) * 3 + axis];
+		});
+		m_split_axis[node] = std::uint8_t(axis);
+		m_split_value[node] = source[std::size_t(m_index[mid]) * 3 + axis];
+
+		// large halves are built in parallel, they never touch the same part of m_index
+		if (end - begin > PARALLEL_GRAIN)
+		{
+			TaskGroup group;
+			group.Run([&] { BuildNode(source, node * 2 + 1, begin, mid, level + 1); });
+			BuildNode(source, node * 2 + 2, mid, end, level + 1);
+			group.Wait();
+		}
+		else
+		{
+			BuildNode(source, node * 2 + 1, begin, mid, level + 1);
+			BuildNode(source, node * 2 + 2, mid, end, level + 1);
+		}
+	}
+
+	void SearchNode(const float* query, int k, std::uint32_t* indices, float* sq_distances, int& found,
+		std::size_t node, std::size_t begin, std::size_t end, std::size_t level) const
+	{
+		if (level == m_levels)
+		{
+			for (std::size_t pos = begin; pos < end; pos++)
+			{
+				const float* p = &m_xyz[pos * 3];
+				float dx = p[0] - query[0], dy = p[1] - query[1], dz = p[2] - query[2];
+				float d = dx * dx + dy * dy + dz * dz;
+				if (found == k && d >= sq_distances[k - 1]) continue;
+
+				// insertion into the sorted result list
+				int slot = found < k ? found++ : k - 1;
+				while (slot > 0 && sq_distances[slot - 1] > d)
+				{
+					sq_distances[slot] = sq_distances[slot - 1];
+					indices[slot] = indices[slot - 1];
+					slot--;
+				}
+				sq_distances[slot] = d;
+				indices[slot] = m_index[pos];
+			}
+			return;
+		}
+
+		std::size_t mid = begin + (end - begin) / 2;
+		float diff = query[m_split_axis[node]] - m_split_value[node];
+		if (diff < 0)
+		{
+			SearchNode(query, k, indices, sq_distances, found, node * 2 + 1, begin, mid, level + 1);
+			if (found < k || diff * diff < sq_distances[k - 1]) SearchNode(query, k, indices, sq_distances, found, node * 2 + 2, mid, end, level + 1);
+		}
+		else
+		{
+			SearchNode(query, k, indices, sq_distances, found, node * 2 + 2, mid, end, level + 1);
+			if (found < k || diff * diff <= sq_distances[k - 1]) SearchNode(query, k, indices, sq_distances, found, node * 2 + 1, begin, mid, level + 1);
+		}
+	}
+
+	std::size_t m_levels;
+	std::vector<float> m_split_value;
+	std::vector<std::uint8_t> m_split_axis;
+	std::vector<std::uint32_t> m_index;		// original index of every point in tree order
+	std::vector<float> m_xyz;				// coordinates in tree order
+};
+
+// Uniform voxel grid with a hash from voxel coordinates to occupied cells.
+// Points are stored again in cell order, so the points of one cell are one contiguous block.
+// The voxel key holds 21 bits per axis, so the points must span fewer than AXIS_CELLS cells along every axis
+// (Holds) - they are never clamped to the edge cells.
+class VoxelHashGrid
+{
+public:
+	static const std::size_t AXIS_CELLS = std::size_t(1) << 21;
+
+	// Checks if a grid with the cell size holds points spanning 'extent' along every axis (LargestExtent),
+	// with a cell to spare for the rounding of the keys
+	static bool Holds(double extent, double cell_size)
+	{
+		return cell_size > 0 && extent / cell_size < double(AXIS_CELLS - 1);
+	}
+
+	VoxelHashGrid() : m_cell_size(1.0f), m_hash_mask(0)
+	{
+		m_origin[0] = m_origin[1] = m_origin[2] = 0.0f;
+	}
+
+	// Builds the grid from points[i][0..2], i in [0, count). Returns false and leaves the grid empty if the points
+	// span too many cells (check Holds first).
+	template <typename Points>
+	bool Build(const Points& points, std::size_t count, float cell_size)
+	{
+		m_cell_size = cell_size;
+		float top[3];
+		for (int a = 0; a < 3; a++) m_origin[a] = top[a] = count ? float(points[0][a]) : 0.0f;
+		for (std::size_t i = 1; i < count; i++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				m_origin[a] = std::min(m_origin[a], float(points[i][a]));
+				top[a] = std::max(top[a], float(points[i][a]));
+			}
+		}
+		m_index.clear();
+		m_xyz.clear();
+		m_cell_key.clear();
+		m_cell_start.assign(1, 0);
+		m_hash.clear();
+		m_hash_mask = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			if (!(cell_size > 0) || (top[a] - m_origin[a]) / cell_size >= float(AXIS_CELLS)) return false;
+		}
+
+		// sort points by voxel key: chunks sorted in parallel, then merged pairwise in parallel rounds
+		std::vector<std::pair<std::uint64_t, std::uint32_t>> keyed(count);
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; i++)
+			{
+				keyed[i] = std::make_pair(VoxelKey(float(points[i][0]), float(points[i][1]), float(points[i][2])), std::uint32_t(i));
+			}
+			std::sort(keyed.begin() + begin, keyed.begin() + end);
+		});
+		for (std::size_t width = PARALLEL_GRAIN; width < count; width *= 2)
+		{
+			ParallelFor((count + 2 * width - 1) / (2 * width), 1, [&](std::size_t first_pair, std::size_t last_pair)
+			{
+				for (std::size_t p = first_pair; p < last_pair; p++)
+				{
+					std::size_t begin = p * 2 * width;
+					std::size_t mid = std::min(begin + width, count);
+					std::size_t end = std::min(begin + 2 * width, count);
+					std::inplace_merge(keyed.begin() + begin, keyed.begin() + mid, keyed.begin() + end);
+				}
+			});
+		}
+
+		m_index.resize(count);
+		m_xyz.resize(count * 3);
+		m_cell_key.clear();
+		m_cell_start.clear();
+		for (std::size_t pos = 0; pos < count; pos++)
+		{
+			if (pos == 0 || keyed[pos].first != keyed[pos - 1].first)
+			{
+				m_cell_key.push_back(keyed[pos].first);
+				m_cell_start.push_back(std::uint32_t(pos));
+			}
+		}
+		m_cell_start.push_back(std::uint32_t(count));
+		ParallelFor(count, PARALLEL_GRAIN, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t pos = begin; pos < end; pos++)
+			{
+				m_index[pos] = keyed[pos].second;
+				for (int a = 0; a < 3; a++) m_xyz[pos * 3 + a] = float(points[keyed[pos].second][a]);
+			}
+		});
+
+		// open addressing hash, at most half full
+		std::size_t slots = 16;
+		while (slots < m_cell_key.size() * 2) slots *= 2;
+		m_hash_mask = slots - 1;
+		m_hash.assign(slots, std::uint32_t(EMPTY_SLOT));
+		for (std::size_t c = 0; c < m_cell_key.size(); c++)
+		{
+			std::size_t slot = HashSlot(m_cell_key[c]);
+			while (m_hash[slot] != EMPTY_SLOT) slot = (slot + 1) & m_hash_mask;
+			m_hash[slot] = std::uint32_t(c);
+		}
+		return true;
+	}
+
+	float CellSize() const { return m_cell_size; }
+	std::size_t CellCount() const { return m_cell_key.size(); }
+	std::size_t Size() const { return m_index.size(); }
+
+	// Reads or writes every member through the archive (IndexFileWriter / IndexFileReader)
+	template <typename Archive>
+	bool Serialize(Archive& archive)
+	{
+		return archive.Scalar(m_cell_size) && archive.Scalar(m_origin[0]) && archive.Scalar(m_origin[1]) && archive.Scalar(m_origin[2])
+			&& archive.Array(m_cell_key) && archive.Array(m_cell_start) && archive.Array(m_hash) && archive.Count(m_hash_mask)
+			&& archive.Array(m_index) && archive.Array(m_xyz);
+	}
+
+	// Checks the sizes of a grid read from a file
+	bool Consistent(std::size_t count) const
+	{
+		return m_cell_size > 0 && m_cell_start.size() == m_cell_key.size() + 1 && m_cell_start.front() == 0 && m_cell_start.back() == count
+			&& m_hash.size() == m_hash_mask + 1 && (m_hash.size() & m_hash_mask) == 0 && m_hash.size() >= 2 * m_cell_key.size()
+			&& m_index.size() == count && m_xyz.size() == 3 * count;
+	}
+
+	// Points of cell c are the positions [CellBegin(c), CellEnd(c)) in cell order
+	std::size_t CellBegin(std::size_t c) const { return m_cell_start[c]; }
+	std::size_t CellEnd(std::size_t c) const { return m_cell_start[c + 1]; }
+	std::uint32_t IndexAt(std::size_t pos) const { return m_index[pos]; }
+	const float* PointAt(std::size_t pos) const { return &m_xyz[pos * 3]; }
+
+	void CellCoords(std::size_t c, int coords[3]) const
+	{
+		for (int a = 0; a < 3; a++) coords[a] = int((m_cell_key[c] >> (21 * a)) & KEY_AXIS_MASK);
+	}
+
+	void CellCenter(std::size_t c, double center[3]) const
+	{
+		int coords[3];
+		CellCoords(c, coords);
+		for (int a = 0; a < 3; a++) center[a] = m_origin[a] + (coords[a] + 0.5) * m_cell_size;
+	}
+
+	// Cells are sorted by their voxel key x | y << 21 | z << 42, so the occupied cells of one row along x are consecutive
+	std::uint64_t CellKey(std::size_t c) const { return m_cell_key[c]; }
+	static int MaxCoord() { return int(KEY_AXIS_MASK); }
+	static std::uint64_t KeyOf(int x, int y, int z)
+	{
+		return std::uint64_t(x) | (std::uint64_t(y) << 21) | (std::uint64_t(z) << 42);
+	}
+
+	// Voxel coordinates of a point, -1 or MaxCoord() + 1 along the axes it lies beyond the grid
+	void VoxelCoords(const float p[3], int coords[3]) const
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			float v = std::floor((p[a] - m_origin[a]) / m_cell_size);
+			coords[a] = int(std::max(-1.0f, std::min(v, float(MaxCoord() + 1))));
+		}
+	}
+
+	// visit(dx, dy, dz) for every point within 'radius' of q, with its offset from q. Scans the cells the radius
+	// can reach, so it suits a few queries at any cell size - a whole cloud is better walked cell by cell.
+	template <typename Visit>
+	void ForEachPointWithin(const float q[3], double radius, Visit visit) const
+	{
+		const double r2 = radius * radius;
+		const int reach = int(std::ceil(radius / m_cell_size));
+		int coords[3];
+		VoxelCoords(q, coords);
+		for (int z = coords[2] - reach; z <= coords[2] + reach; z++)
+		{
+			for (int y = coords[1] - reach; y <= coords[1] + reach; y++)
+			{
+				for (int x = coords[0] - reach; x <= coords[0] + reach; x++)
+				{
+					long long c = FindCell(x, y, z);
+					if (c < 0) continue;
+					for (std::size_t pos = CellBegin(std::size_t(c)); pos < CellEnd(std::size_t(c)); pos++)
+					{
+						const float* p = PointAt(pos);
+						double dx = double(p[0]) - q[0], dy = double(p[1]) - q[1], dz = double(p[2]) - q[2];
+						if (dx * dx + dy * dy + dz * dz <= r2) visit(dx, dy, dz);
+					}
+				}
+			}
+		}
+	}
+
+	// Cell at the voxel coordinates, -1 when the voxel holds no points
+	long long FindCell(int x, int y, int z) const
+	{
+		if (m_hash.empty() || x < 0 || y < 0 || z < 0 || x > int(KEY_AXIS_MASK) || y > int(KEY_AXIS_MASK) || z > int(KEY_AXIS_MASK)) return -1;
+		std::uint64_t key = KeyOf(x, y, z);
+		for (std::size_t slot = HashSlot(key); m_hash[slot] != EMPTY_SLOT; slot = (slot + 1) & m_hash_mask)
+		{
+			if (m_cell_key[m_hash[slot]] == key) return m_hash[slot];
+		}
+		return -1;
+	}
+
+private:
+	static const std::uint64_t KEY_AXIS_MASK = (1 << 21) - 1;	// 21 bits per axis
+	static const std::uint32_t EMPTY_SLOT = 0xFFFFFFFFu;
+
+	// Key of a point the grid is built from - Build checked that it lies within AXIS_CELLS cells of the origin
+	std::uint64_t VoxelKey(float x, float y, float z) const
+	{
+		const float p[3] = { x, y, z };
+		std::uint64_t key = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			key |= std::uint64_t((p[a] - m_origin[a]) / m_cell_size) << (21 * a);
+		}
+		return key;
+	}
+
+	std::size_t HashSlot(std::uint64_t key) const
+	{
+		key ^= key >> 29;
+		key *= 0xbf58476d1ce4e5b9ULL;
+		key ^= key >> 32;
+		return std::size_t(key) & m_hash_mask;
+	}
+
+	float m_cell_size;
+	float m_origin[3];
+	std::vector<std::uint64_t> m_cell_key;		// voxel key of every occupied cell, ascending
+	std::vector<std::uint32_t> m_cell_start;	// first position of every cell, plus the end
+	std::vector<std::uint32_t> m_hash;			// cell of every hash slot
+	std::size_t m_hash_mask;
+	std::vector<std::uint32_t> m_index;			// original index of every point in cell order
+	std::vector<float> m_xyz;					// coordinates in cell order
+};
+
+// Largest extent of the points along the x, y and z axes
+template <typename Points>
+inline double LargestExtent(const Points& points, std::size_t count)
+{
+	double largest = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		double lo = std::numeric_limits<double>::max(), hi = -std::numeric_limits<double>::max();
+		for (std::size_t i = 0; i < count; i++)
+		{
+			lo = std::min(lo, double(points[i][a]));
+			hi = std::max(hi, double(points[i][a]));
+		}
+		if (count) largest = std::max(largest, hi - lo);
+	}
+	return largest;
+}
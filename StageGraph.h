@@ -0,0 +1,149 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Dependency-aware scheduling of the stages of a method run. A stage starts as soon as all stages it depends on
+have finished, independent stages run concurrently on the shared pool. Stages which must stay on the calling
+thread (project changes, algorithm calls, writes to the cloud) are run there, in between it helps with the pool tasks.
+*/
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+
+class StageGraph
+{
+public:
+	typedef std::size_t Stage;
+
+	explicit StageGraph(ThreadPool& pool = SharedThreadPool()) : m_pool(pool), m_group(nullptr), m_started(0), m_finished(0) {}
+
+	// Stage run after all 'after' stages, which must have been added before it (so the graph has no cycles)
+	Stage Add(std::function<void()> function, std::vector<Stage> after = std::vector<Stage>(), bool on_caller = false)
+	{
+		Node node;
+		node.function = function;
+		node.dependencies = after.size();
+		node.on_caller = on_caller;
+		m_nodes.push_back(node);
+		Stage stage = m_nodes.size() - 1;
+		for (Stage dependency : after)
+		{
+			assert(dependency < stage);
+			m_nodes[dependency].dependents.push_back(stage);
+		}
+		return stage;
+	}
+
+	// Stage which must run on the thread calling Run
+	Stage AddOnCaller(std::function<void()> function, std::vector<Stage> after = std::vector<Stage>())
+	{
+		return Add(function, after, true);
+	}
+
+	// Runs all stages once and returns when they are finished. After the first exception thrown by a stage
+	// no further stages are started, the exception is rethrown once the running ones have finished.
+	void Run()
+	{
+		TaskGroup group(m_pool);
+		m_group = &group;
+		m_started = 0;
+		m_finished = 0;
+		m_error = nullptr;
+		m_caller_ready.clear();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (Stage stage = 0; stage < m_nodes.size(); stage++)
+			{
+				if (m_nodes[stage].dependencies == 0) Start(stage);
+			}
+		}
+		for (;;)
+		{
+			Stage next = 0;
+			bool caller_stage = false;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_caller_ready.empty())
+				{
+					next = m_caller_ready.front();
+					m_caller_ready.pop_front();
+					caller_stage = true;
+				}
+				else if (m_finished == m_started)
+				{
+					break;
+				}
+			}
+			if (caller_stage) Execute(next);
+			else if (!m_pool.RunPendingTask()) std::this_thread::yield();
+		}
+		group.Wait();
+		m_group = nullptr;
+		if (m_error)
+		{
+			std::exception_ptr error = m_error;
+			m_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	struct Node
+	{
+		std::function<void()> function;
+		std::size_t dependencies;		// not finished yet
+		std::vector<Stage> dependents;
+		bool on_caller;
+	};
+
+	// Called with the mutex locked
+	void Start(Stage stage)
+	{
+		m_started++;
+		if (m_nodes[stage].on_caller)
+		{
+			m_caller_ready.push_back(stage);
+			return;
+		}
+		m_group->Run([this, stage] { Execute(stage); });
+	}
+
+	void Execute(Stage stage)
+	{
+		bool failed = false;
+		try
+		{
+			m_nodes[stage].function();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_error) m_error = std::current_exception();
+			failed = true;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_finished++;
+		if (failed || m_error) return;
+		for (Stage dependent : m_nodes[stage].dependents)
+		{
+			if (--m_nodes[dependent].dependencies == 0) Start(dependent);
+		}
+	}
+
+	ThreadPool& m_pool;
+	std::vector<Node> m_nodes;
+	TaskGroup* m_group;
+	std::mutex m_mutex;
+	std::size_t m_started;
+	std::size_t m_finished;
+	std::deque<Stage> m_caller_ready;
+	std::exception_ptr m_error;
+};
@@ -0,0 +1,271 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Scoped instrumentation of the stages of a method run: wall time, points processed, bytes copied and allocations
+of every stage. Stages are summarized as a table for the log and can be written as a Chrome trace
+(chrome://tracing or ui.perfetto.dev).
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Allocations of the process, counted only if its global operator new reports them here (the benchmark does).
+// Without such a hook the allocation columns of the summary stay empty.
+struct AllocationCounters
+{
+	std::atomic<std::uint64_t> count;
+	std::atomic<std::uint64_t> bytes;
+	std::atomic<bool> enabled;
+};
+
+inline AllocationCounters& StageAllocations()
+{
+	static AllocationCounters counters;		// static storage, starts zeroed
+	return counters;
+}
+
+struct StageRecord
+{
+	std::wstring name;
+	int depth;						// number of stages open on the same thread when it began
+	unsigned thread;				// small thread number, in order of the first stage of every thread
+	double start;					// seconds since the profile was created
+	double seconds;
+	std::uint64_t points;
+	std::uint64_t bytes_copied;
+	std::uint64_t allocations;		// all threads of the process while the stage was open
+	std::uint64_t allocated_bytes;
+};
+
+// Stages recorded during one run. Stages may be opened from several threads, every thread nests its own.
+class StageProfile
+{
+public:
+	StageProfile() : m_origin(std::chrono::steady_clock::now()) {}
+
+	std::size_t Begin(const std::wstring& name, std::uint64_t points)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto thread = m_threads.find(std::this_thread::get_id());
+		if (thread == m_threads.end())
+		{
+			ThreadState state = { unsigned(m_threads.size()), 0 };
+			thread = m_threads.insert(std::make_pair(std::this_thread::get_id(), state)).first;
+		}
+		StageRecord record;
+		record.name = name;
+		record.depth = thread->second.depth++;
+		record.thread = thread->second.number;
+		record.start = Now();
+		record.seconds = 0;
+		record.points = points;
+		record.bytes_copied = 0;
+		record.allocations = StageAllocations().count.load();
+		record.allocated_bytes = StageAllocations().bytes.load();
+		m_stages.push_back(record);
+		return m_stages.size() - 1;
+	}
+
+	void End(std::size_t stage)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		StageRecord& record = m_stages[stage];
+		record.seconds = Now() - record.start;
+		record.allocations = StageAllocations().count.load() - record.allocations;
+		record.allocated_bytes = StageAllocations().bytes.load() - record.allocated_bytes;
+		m_threads[std::this_thread::get_id()].depth--;
+	}
+
+	void AddPoints(std::size_t stage, std::uint64_t points)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stages[stage].points += points;
+	}
+
+	void AddCopied(std::size_t stage, std::uint64_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stages[stage].bytes_copied += bytes;
+	}
+
+	std::vector<StageRecord> Stages() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stages;
+	}
+
+	// Summary table, one line per stage name and depth in the order they first began
+	// (repeated stages, e.g. of every tile, are summed up). Shares are of the summed time of the stages at depth 0,
+	// which may overlap (stages of a StageGraph, clouds in parallel), so the last line compares it with the wall time.
+	std::vector<std::wstring> SummaryLines() const
+	{
+		std::vector<StageRecord> stages = Stages();
+		std::vector<StageRecord> rows;
+		std::vector<unsigned> calls;
+		std::map<std::pair<std::wstring, int>, std::size_t> row_of;
+		double total = 0;
+		double first_start = 0, last_end = 0;		// wall time spanned by the stages at depth 0
+		bool any_top = false;
+		for (auto& stage : stages)
+		{
+			if (stage.depth == 0)
+			{
+				total += stage.seconds;
+				first_start = any_top ? std::min(first_start, stage.start) : stage.start;
+				last_end = any_top ? std::max(last_end, stage.start + stage.seconds) : stage.start + stage.seconds;
+				any_top = true;
+			}
+			auto key = std::make_pair(stage.name, stage.depth);
+			auto found = row_of.find(key);
+			if (found == row_of.end())
+			{
+				row_of[key] = rows.size();
+				rows.push_back(stage);
+				calls.push_back(1);
+				continue;
+			}
+			StageRecord& row = rows[found->second];
+			row.seconds += stage.seconds;
+			row.points += stage.points;
+			row.bytes_copied += stage.bytes_copied;
+			row.allocations += stage.allocations;
+			row.allocated_bytes += stage.allocated_bytes;
+			calls[found->second]++;
+		}
+
+		const bool allocations = StageAllocations().enabled.load();
+		const double mb = 1.0 / (1 << 20);
+		std::vector<std::wstring> lines;
+		wchar_t line[256];
+		std::swprintf(line, 256, L"%-34ls %6ls %10ls %6ls %12ls %9ls %10ls %9ls %10ls", L"stage", L"calls", L"time [ms]", L"share",
+			L"points", L"Mpts/s", L"copied MB", L"allocs", L"alloc MB");
+		lines.push_back(line);
+		for (std::size_t r = 0; r < rows.size(); r++)
+		{
+			const StageRecord& row = rows[r];
+			std::wstring name = std::wstring(2 * row.depth, L' ') + row.name;
+			double share = total > 0 ? 100.0 * row.seconds / total : 0;
+			double throughput = row.seconds > 0 ? row.points / row.seconds / 1e6 : 0;
+			wchar_t allocs[32], allocated[32];
+			if (allocations)
+			{
+				std::swprintf(allocs, 32, L"%llu", (unsigned long long)row.allocations);
+				std::swprintf(allocated, 32, L"%.1f", row.allocated_bytes * mb);
+			}
+			else
+			{
+				std::swprintf(allocs, 32, L"-");
+				std::swprintf(allocated, 32, L"-");
+			}
+			std::swprintf(line, 256, L"%-34ls %6u %10.1f %5.1f%% %12llu %9.2f %10.1f %9ls %10ls", name.c_str(), calls[r], row.seconds * 1000.0, share,
+				(unsigned long long)row.points, throughput, row.bytes_copied * mb, allocs, allocated);
+			lines.push_back(line);
+		}
+		const double wall = last_end - first_start;
+		std::swprintf(line, 256, L"stage time %.1f ms in %.1f ms of wall time (overlap %.2fx)", total * 1000.0, wall * 1000.0, wall > 0 ? total / wall : 1.0);
+		lines.push_back(line);
+		return lines;
+	}
+
+	// Chrome trace event format, every stage as one complete event on the thread it ran on
+	bool WriteChromeTrace(const std::wstring& path) const
+	{
+#ifdef _MSC_VER
+		std::ofstream file(path.c_str());
+#else
+		std::ofstream file(std::string(path.begin(), path.end()).c_str());	// plain ASCII paths outside Windows
+#endif
+		if (!file) return false;
+		std::vector<StageRecord> stages = Stages();
+		file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		for (std::size_t s = 0; s < stages.size(); s++)
+		{
+			const StageRecord& stage = stages[s];
+			char event[512];
+			std::snprintf(event, sizeof(event), "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+				"\"args\": {\"points\": %llu, \"bytes copied\": %llu, \"allocations\": %llu, \"allocated bytes\": %llu}}",
+				stage.thread, stage.start * 1e6, stage.seconds * 1e6, (unsigned long long)stage.points,
+				(unsigned long long)stage.bytes_copied, (unsigned long long)stage.allocations, (unsigned long long)stage.allocated_bytes);
+			file << "{\"name\": \"" << JsonText(stage.name) << event << (s + 1 < stages.size() ? ",\n" : "\n");
+		}
+		file << "]}\n";
+		return bool(file);
+	}
+
+private:
+	struct ThreadState
+	{
+		unsigned number;
+		int depth;
+	};
+
+	double Now() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_origin).count();
+	}
+
+	static std::string JsonText(const std::wstring& text)
+	{
+		std::string json;
+		for (wchar_t c : text)
+		{
+			if (c == L'"' || c == L'\\')
+			{
+				json += '\\';
+				json += char(c);
+			}
+			else if (c >= 0x20 && c < 0x7f)
+			{
+				json += char(c);
+			}
+			else
+			{
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(c) & 0xffffu);
+				json += escaped;
+			}
+		}
+		return json;
+	}
+
+	std::chrono::steady_clock::time_point m_origin;
+	mutable std::mutex m_mutex;
+	std::vector<StageRecord> m_stages;
+	std::map<std::thread::id, ThreadState> m_threads;
+};
+
+// Stage open for the lifetime of the object
+class ScopedStage
+{
+public:
+	ScopedStage(StageProfile& profile, const wchar_t* name, std::uint64_t points = 0) : m_profile(profile), m_stage(profile.Begin(name, points)) {}
+	~ScopedStage() { m_profile.End(m_stage); }
+
+	void Points(std::uint64_t points) { m_profile.AddPoints(m_stage, points); }
+	void Copied(std::uint64_t bytes) { m_profile.AddCopied(m_stage, bytes); }
+
+	// Ends the stage and begins the following one, for a sequence of stages in one scope
+	void Next(const wchar_t* name, std::uint64_t points = 0)
+	{
+		m_profile.End(m_stage);
+		m_stage = m_profile.Begin(name, points);
+	}
+
+private:
+	ScopedStage(const ScopedStage&);
+	ScopedStage& operator=(const ScopedStage&);
+
+	StageProfile& m_profile;
+	std::size_t m_stage;
+};
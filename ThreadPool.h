@@ -0,0 +1,305 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Shared worker pool used by the plugins.
+Every worker owns a task queue and steals from the others when its own queue runs dry.
+Threads waiting for a task group keep executing queued tasks, so parallel loops can be nested
+(clouds in parallel, points of each cloud in parallel chunks).
+The shared pool is started on first use and shut down explicitly when the last running method ends (ThreadPoolRun),
+never by a static destructor: joining threads while the plugin module is unloaded can deadlock on the loader lock.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	// The calling thread takes part in the work, so 'concurrency' - 1 workers are started
+	explicit ThreadPool(unsigned concurrency = std::thread::hardware_concurrency()) : m_pending(0), m_stop(false), m_next_queue(0)
+	{
+		unsigned workers = concurrency > 1 ? concurrency - 1 : 0;
+		for (unsigned i = 0; i < workers + 1; i++)
+		{
+			m_queues.emplace_back(new Queue());	// the last queue takes tasks submitted from outside the pool
+		}
+		for (unsigned i = 0; i < workers; i++)
+		{
+			m_threads.emplace_back([this, i] { WorkerLoop(i); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_wake_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (auto& thread : m_threads) thread.join();
+	}
+
+	// Number of threads executing tasks, including the waiting caller
+	unsigned Concurrency() const { return unsigned(m_threads.size()) + 1; }
+
+	void Submit(Task task)
+	{
+		int index = WorkerIndex(this);
+		Queue& queue = *m_queues[index >= 0 ? std::size_t(index) : (m_next_queue++ % m_queues.size())];
+		{
+			// counted before the push, so a worker taking the task right away never decrements below zero
+			std::lock_guard<std::mutex> lock(m_wake_mutex);
+			m_pending++;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(std::move(task));
+		}
+		m_wake.notify_one();
+	}
+
+	// Runs one queued task on the calling thread, returns false if there was nothing to run
+	bool RunPendingTask()
+	{
+		int index = WorkerIndex(this);
+		Task task;
+		if (!TakeTask(index >= 0 ? std::size_t(index) : m_queues.size() - 1, task)) return false;
+		task();
+		return true;
+	}
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	// Index of the pool worker running on this thread, -1 for other threads
+	static int WorkerIndex(const ThreadPool* pool, int set_index = -2)
+	{
+		static thread_local const ThreadPool* t_pool = nullptr;
+		static thread_local int t_index = -1;
+		if (set_index != -2)
+		{
+			t_pool = pool;
+			t_index = set_index;
+		}
+		return t_pool == pool ? t_index : -1;
+	}
+
+	// Own queue is used LIFO (cache-warm), stolen tasks are taken FIFO from the other end
+	bool TakeTask(std::size_t own, Task& task)
+	{
+		for (std::size_t k = 0; k < m_queues.size(); k++)
+		{
+			Queue& queue = *m_queues[(own + k) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) continue;
+			if (k == 0)
+			{
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			m_pending--;
+			return true;
+		}
+		return false;
+	}
+
+	void WorkerLoop(unsigned index)
+	{
+		WorkerIndex(this, int(index));
+		for (;;)
+		{
+			Task task;
+			if (TakeTask(index, task))
+			{
+				task();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_wake_mutex);
+			m_wake.wait(lock, [this] { return m_stop || m_pending > 0; });
+			if (m_stop) return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::mutex m_wake_mutex;
+	std::condition_variable m_wake;
+	std::atomic<std::size_t> m_pending;
+	bool m_stop;
+	std::atomic<std::size_t> m_next_queue;
+};
+
+// Pool shared by all methods of the plugin, the slot is allocated once and never destroyed
+inline std::atomic<ThreadPool*>& SharedThreadPoolSlot()
+{
+	static std::atomic<ThreadPool*>* slot = new std::atomic<ThreadPool*>(nullptr);
+	return *slot;
+}
+
+inline std::mutex& SharedThreadPoolMutex()
+{
+	static std::mutex* mutex = new std::mutex();
+	return *mutex;
+}
+
+// Started on first use
+inline ThreadPool& SharedThreadPool()
+{
+	ThreadPool* pool = SharedThreadPoolSlot().load(std::memory_order_acquire);
+	if (pool) return *pool;
+	std::lock_guard<std::mutex> lock(SharedThreadPoolMutex());
+	pool = SharedThreadPoolSlot().load(std::memory_order_relaxed);
+	if (!pool)
+	{
+		pool = new ThreadPool();
+		SharedThreadPoolSlot().store(pool, std::memory_order_release);
+	}
+	return *pool;
+}
+
+// Number of method runs in progress (ThreadPoolRun), guarded by SharedThreadPoolMutex
+inline std::size_t& SharedThreadPoolRuns()
+{
+	static std::size_t* runs = new std::size_t(0);
+	return *runs;
+}
+
+// Joins the workers of the shared pool, the next parallel loop starts a new one. Only when no parallel loop is running.
+inline void ShutdownSharedThreadPool()
+{
+	std::lock_guard<std::mutex> lock(SharedThreadPoolMutex());
+	delete SharedThreadPoolSlot().exchange(nullptr);
+}
+
+// Holds the shared pool for a method run. The pool is shut down when the last run in progress ends, also when
+// it ends with an exception, so methods running at the same time keep their workers.
+class ThreadPoolRun
+{
+public:
+	ThreadPoolRun()
+	{
+		std::lock_guard<std::mutex> lock(SharedThreadPoolMutex());
+		SharedThreadPoolRuns()++;
+	}
+
+	~ThreadPoolRun()
+	{
+		std::lock_guard<std::mutex> lock(SharedThreadPoolMutex());
+		if (--SharedThreadPoolRuns() == 0) delete SharedThreadPoolSlot().exchange(nullptr);
+	}
+};
+
+// Set of tasks that can be waited for; the first exception thrown by a task is rethrown by Wait
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool = SharedThreadPool()) : m_pool(pool), m_remaining(0) {}
+	~TaskGroup() { WaitNoThrow(); }
+
+	void Run(std::function<void()> function)
+	{
+		m_remaining++;
+		m_pool.Submit([this, function]
+		{
+			try
+			{
+				function();
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(m_error_mutex);
+				if (!m_error) m_error = std::current_exception();
+			}
+			m_remaining--;
+		});
+	}
+
+	void Wait()
+	{
+		WaitNoThrow();
+		if (m_error)
+		{
+			std::exception_ptr error = m_error;
+			m_error = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+
+private:
+	void WaitNoThrow()
+	{
+		while (m_remaining > 0)
+		{
+			if (!m_pool.RunPendingTask()) std::this_thread::yield();
+		}
+	}
+
+	ThreadPool& m_pool;
+	std::atomic<std::size_t> m_remaining;
+	std::mutex m_error_mutex;
+	std::exception_ptr m_error;
+};
+
+// Default number of points per chunk of a parallel loop
+const std::size_t PARALLEL_GRAIN = 1 << 16;
+
+// Calls function(begin, end) for consecutive chunks of [0, count) in parallel.
+// Chunk boundaries depend only on count and grain, never on the number of threads.
+template <typename Function>
+inline void ParallelFor(std::size_t count, std::size_t grain, Function function)
+{
+	if (grain == 0) grain = 1;
+	if (count <= grain)
+	{
+		if (count > 0) function(std::size_t(0), count);
+		return;
+	}
+	TaskGroup group;
+	for (std::size_t begin = 0; begin < count; begin += grain)
+	{
+		std::size_t end = std::min(begin + grain, count);
+		group.Run([&function, begin, end] { function(begin, end); });
+	}
+	group.Wait();
+}
+
+// Maps every chunk of [0, count) to a partial result and merges the partials in chunk order,
+// so the result is the same for any number of threads
+template <typename T, typename Map, typename Merge>
+inline T ParallelReduce(std::size_t count, std::size_t grain, T identity, Map map, Merge merge)
+{
+	if (grain == 0) grain = 1;
+	std::size_t chunks = (count + grain - 1) / grain;
+	std::vector<T> partial(chunks, identity);
+	ParallelFor(chunks, 1, [&](std::size_t first_chunk, std::size_t last_chunk)
+	{
+		for (std::size_t c = first_chunk; c < last_chunk; c++)
+		{
+			partial[c] = map(c * grain, std::min((c + 1) * grain, count));
+		}
+	});
+	T result = identity;
+	for (auto& p : partial) result = merge(result, p);
+	return result;
+}
@@ -0,0 +1,272 @@
+/*
+Projekt wykonywany w ramach OSAD3D
+Spatial tiles for processing clouds which do not fit in memory.
+The xy extent of the cloud is covered by a grid of cells, the cells are split into rectangular tiles
+holding a bounded number of points together with a halo of neighbouring points around them.
+Every point belongs to exactly one tile, the tile of a point depends only on its x, y.
+The points of every tile and of its halo are sorted into index lists in one pass over the cloud (TileMembers),
+so each tile then reads and writes only its own points.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Unit of the memory budget parameters
+const std::size_t MEMORY_BUDGET_UNIT = 1 << 20;		// MB
+
+// Number of points which fit in the budget (in MB) at the given cost of one point, 0 if there is no budget
+inline std::size_t TilePointsForBudget(double budget, std::size_t bytes_per_point)
+{
+	if (budget <= 0) return 0;
+	double points = budget * MEMORY_BUDGET_UNIT / bytes_per_point;
+	return points < 1 ? 1 : std::size_t(points);
+}
+
+class TilePlan
+{
+public:
+	static const int RESOLUTION = 256;		// cells per axis
+
+	TilePlan()
+	{
+		m_min[0] = m_min[1] = std::numeric_limits<double>::max();
+		m_max[0] = m_max[1] = -std::numeric_limits<double>::max();
+		m_cell[0] = m_cell[1] = 1;
+		m_halo = 0;
+	}
+
+	// First pass: xy extent of all points
+	void AddBounds(double x, double y)
+	{
+		m_min[0] = std::min(m_min[0], x); m_max[0] = std::max(m_max[0], x);
+		m_min[1] = std::min(m_min[1], y); m_max[1] = std::max(m_max[1], y);
+	}
+
+	// Second pass: number of points in every cell
+	void BeginCounting()
+	{
+		for (int a = 0; a < 2; a++)
+		{
+			double extent = m_max[a] - m_min[a];
+			m_cell[a] = extent > 0 ? extent / RESOLUTION : 1;
+		}
+		m_counts.assign(std::size_t(RESOLUTION) * RESOLUTION, 0);
+	}
+
+	void Count(double x, double y)
+	{
+		m_counts[CellOf(x, y)]++;
+	}
+
+	// Splits the cells into tiles holding at most max_points points together with the halo around them.
+	// A single cell can't be split, so a tile may still exceed the limit in a very dense cell.
+	void Split(std::size_t max_points, double halo)
+	{
+		m_halo = halo;
+		m_sums.assign(std::size_t(RESOLUTION + 1) * (RESOLUTION + 1), 0);		// 2D prefix sums of the counts
+		for (int r = 0; r < RESOLUTION; r++)
+		{
+			for (int c = 0; c < RESOLUTION; c++)
+			{
+				m_sums[Sum(c + 1, r + 1)] = m_counts[std::size_t(r) * RESOLUTION + c] + m_sums[Sum(c, r + 1)] + m_sums[Sum(c + 1, r)] - m_sums[Sum(c, r)];
+			}
+		}
+		m_halo_cells[0] = int(std::min(std::ceil(halo / m_cell[0]), double(RESOLUTION)));
+		m_halo_cells[1] = int(std::min(std::ceil(halo / m_cell[1]), double(RESOLUTION)));
+		m_tiles.clear();
+		m_cell_tile.assign(m_counts.size(), std::size_t(NO_TILE));
+		SplitCells(0, 0, RESOLUTION, RESOLUTION, max_points < 1 ? 1 : max_points);
+
+		// tiles whose halo overlaps every cell, as lists of all cells one after another
+		m_halo_start.assign(m_counts.size() + 1, 0);
+		for (std::size_t tile = 0; tile < m_tiles.size(); tile++)
+		{
+			ForEachHaloCell(tile, [&](std::size_t cell) { m_halo_start[cell + 1]++; });
+		}
+		for (std::size_t cell = 0; cell < m_counts.size(); cell++) m_halo_start[cell + 1] += m_halo_start[cell];
+		m_halo_tiles.resize(m_halo_start.back());
+		std::vector<std::uint32_t> next(m_halo_start.begin(), m_halo_start.end() - 1);
+		for (std::size_t tile = 0; tile < m_tiles.size(); tile++)
+		{
+			ForEachHaloCell(tile, [&](std::size_t cell) { m_halo_tiles[next[cell]++] = std::uint32_t(tile); });
+		}
+	}
+
+	// xy extent of all points from the first pass
+	void Extent(double lo[2], double hi[2]) const
+	{
+		lo[0] = m_min[0]; lo[1] = m_min[1];
+		hi[0] = m_max[0]; hi[1] = m_max[1];
+	}
+
+	std::size_t TileCount() const { return m_tiles.size(); }
+
+	// Number of points of the tile together with its halo (an upper bound, halo counted by whole cells)
+	std::size_t TilePoints(std::size_t tile) const { return m_tiles[tile].halo_points; }
+
+	// Tile the point belongs to
+	std::size_t TileOf(double x, double y) const
+	{
+		return m_cell_tile[CellOf(x, y)];
+	}
+
+	// Checks if the point is a part of the tile or of its halo
+	bool InHalo(std::size_t tile, double x, double y) const
+	{
+		const Tile& t = m_tiles[tile];
+		if (x >= t.lo[0] - m_halo && x <= t.hi[0] + m_halo && y >= t.lo[1] - m_halo && y <= t.hi[1] + m_halo) return true;
+		return TileOf(x, y) == tile;	// points on the rounded edge of the extent
+	}
+
+	// Calls visit(tile) for every tile whose halo holds the point, the tile of the point included
+	template <typename Visit>
+	void ForEachHaloTile(double x, double y, Visit visit) const
+	{
+		const std::size_t cell = CellOf(x, y);
+		for (std::uint32_t k = m_halo_start[cell]; k < m_halo_start[cell + 1]; k++)
+		{
+			if (InHalo(m_halo_tiles[k], x, y)) visit(std::size_t(m_halo_tiles[k]));
+		}
+	}
+
+private:
+	static const std::size_t NO_TILE = ~std::size_t(0);
+
+	struct Tile
+	{
+		double lo[2], hi[2];
+		std::size_t halo_points;
+	};
+
+	std::size_t CellOf(double x, double y) const
+	{
+		int c = int((x - m_min[0]) / m_cell[0]);
+		int r = int((y - m_min[1]) / m_cell[1]);
+		c = c < 0 ? 0 : (c >= RESOLUTION ? RESOLUTION - 1 : c);
+		r = r < 0 ? 0 : (r >= RESOLUTION ? RESOLUTION - 1 : r);
+		return std::size_t(r) * RESOLUTION + c;
+	}
+
+	// Cells overlapped by the tile with its halo, one more cell around for the rounding of the halo edges
+	template <typename Visit>
+	void ForEachHaloCell(std::size_t tile, Visit visit) const
+	{
+		const Tile& t = m_tiles[tile];
+		int lo[2], hi[2];
+		for (int a = 0; a < 2; a++)
+		{
+			double first = std::floor((t.lo[a] - m_halo - m_min[a]) / m_cell[a]) - 1;
+			double last = std::floor((t.hi[a] + m_halo - m_min[a]) / m_cell[a]) + 1;
+			lo[a] = int(std::max(0.0, std::min(first, double(RESOLUTION - 1))));
+			hi[a] = int(std::max(0.0, std::min(last, double(RESOLUTION - 1))));
+		}
+		for (int r = lo[1]; r <= hi[1]; r++)
+		{
+			for (int c = lo[0]; c <= hi[0]; c++) visit(std::size_t(r) * RESOLUTION + c);
+		}
+	}
+
+	static std::size_t Sum(int c, int r) { return std::size_t(r) * (RESOLUTION + 1) + c; }
+
+	// Points in cells [c0, c1) x [r0, r1), clamped to the grid
+	std::uint64_t Points(int c0, int r0, int c1, int r1) const
+	{
+		c0 = std::max(c0, 0); r0 = std::max(r0, 0);
+		c1 = std::min(c1, int(RESOLUTION)); r1 = std::min(r1, int(RESOLUTION));
+		if (c0 >= c1 || r0 >= r1) return 0;
+		return m_sums[Sum(c1, r1)] - m_sums[Sum(c0, r1)] - m_sums[Sum(c1, r0)] + m_sums[Sum(c0, r0)];
+	}
+
+	void SplitCells(int c0, int r0, int c1, int r1, std::size_t max_points)
+	{
+		std::uint64_t core = Points(c0, r0, c1, r1);
+		if (core == 0) return;		// no point will ever ask for this tile
+		std::uint64_t with_halo = Points(c0 - m_halo_cells[0], r0 - m_halo_cells[1], c1 + m_halo_cells[0], r1 + m_halo_cells[1]);
+		bool columns = (c1 - c0) >= (r1 - r0);
+		if (with_halo <= max_points || (c1 - c0 == 1 && r1 - r0 == 1))
+		{
+			Tile tile;
+			tile.lo[0] = m_min[0] + c0 * m_cell[0]; tile.hi[0] = m_min[0] + c1 * m_cell[0];
+			tile.lo[1] = m_min[1] + r0 * m_cell[1]; tile.hi[1] = m_min[1] + r1 * m_cell[1];
+			tile.halo_points = std::size_t(with_halo);
+			for (int r = r0; r < r1; r++)
+			{
+				std::fill(m_cell_tile.begin() + std::size_t(r) * RESOLUTION + c0, m_cell_tile.begin() + std::size_t(r) * RESOLUTION + c1, m_tiles.size());
+			}
+			m_tiles.push_back(tile);
+			return;
+		}
+
+		// split the longer side where half of the core points is reached
+		int lo = columns ? c0 : r0, hi = columns ? c1 : r1;
+		int split = lo + 1;
+		while (split < hi - 1 && 2 * (columns ? Points(c0, r0, split, r1) : Points(c0, r0, c1, split)) < core) split++;
+		if (columns)
+		{
+			SplitCells(c0, r0, split, r1, max_points);
+			SplitCells(split, r0, c1, r1, max_points);
+		}
+		else
+		{
+			SplitCells(c0, r0, c1, split, max_points);
+			SplitCells(c0, split, c1, r1, max_points);
+		}
+	}
+
+	double m_min[2], m_max[2], m_cell[2];
+	double m_halo;
+	int m_halo_cells[2];
+	std::vector<std::uint32_t> m_counts;
+	std::vector<std::uint64_t> m_sums;
+	std::vector<Tile> m_tiles;
+	std::vector<std::size_t> m_cell_tile;
+	std::vector<std::uint32_t> m_halo_start;	// first entry of every cell in m_halo_tiles
+	std::vector<std::uint32_t> m_halo_tiles;
+};
+
+// Points of every tile together with its halo: indices in cloud order and whether each point belongs to the tile
+// itself. Filled in one pass over the points, 5 bytes for every point of every tile it is loaded by.
+class TileMembers
+{
+public:
+	explicit TileMembers(const TilePlan& plan) : m_plan(plan), m_points(plan.TileCount()), m_core(plan.TileCount())
+	{
+		for (std::size_t tile = 0; tile < plan.TileCount(); tile++)
+		{
+			m_points[tile].reserve(plan.TilePoints(tile));
+			m_core[tile].reserve(plan.TilePoints(tile));
+		}
+	}
+
+	// Next point of the pass, points must come in cloud order
+	void Add(std::size_t point, double x, double y)
+	{
+		const std::size_t own = m_plan.TileOf(x, y);
+		m_plan.ForEachHaloTile(x, y, [&](std::size_t tile)
+		{
+			m_points[tile].push_back(std::uint32_t(point));
+			m_core[tile].push_back(tile == own);
+		});
+	}
+
+	const std::vector<std::uint32_t>& Points(std::size_t tile) const { return m_points[tile]; }
+	const std::vector<std::uint8_t>& Core(std::size_t tile) const { return m_core[tile]; }
+
+	// Frees the lists of a tile which was processed
+	void Release(std::size_t tile)
+	{
+		std::vector<std::uint32_t>().swap(m_points[tile]);
+		std::vector<std::uint8_t>().swap(m_core[tile]);
+	}
+
+private:
+	const TilePlan& m_plan;
+	std::vector<std::vector<std::uint32_t>> m_points;
+	std::vector<std::vector<std::uint8_t>> m_core;
+};